@@ -0,0 +1,701 @@
+/*
+ * cluster.c - consistent-hash partitioning and two-phase friendship
+ *   updates across friendlist servers
+ *
+ * The ring is a sorted array of virtual-node points, searched with
+ * binary search. Transactions are carried to other nodes as POSTs to
+ * /cluster/prepare, /cluster/commit and /cluster/abort over the pooled
+ * peer connections; the node coordinating a transaction takes part in
+ * it directly. A participant locks every user whose list a prepared
+ * transaction will change. A prepare that needs a locked user waits a
+ * little for it: coordinators prepare nodes in index order, so a
+ * transaction only ever waits for one that is further along, and no
+ * two can wait on each other. A lock that stays busy fails the prepare
+ * with a conflict, and the coordinator backs off and retries.
+ */
+#include <stdint.h>
+#include <time.h>
+#include "csapp.h"
+#include "dictionary.h"
+#include "more_string.h"
+#include "peer.h"
+#include "cluster.h"
+
+/* Points each node gets on the ring: */
+#define CLUSTER_VNODES 64
+/* Attempts at a transaction that keeps colliding with others: */
+#define CLUSTER_RETRIES 5
+/* Milliseconds a prepare waits for a locked user: */
+#define CLUSTER_LOCK_WAIT 1000
+/* Attempts at delivering a commit before leaving it to the background: */
+#define CLUSTER_COMMIT_TRIES 3
+/* Seconds a prepared transaction waits before asking for its outcome: */
+#define CLUSTER_TX_TIMEOUT 30
+/* Seconds between the background thread's rounds: */
+#define CLUSTER_RESOLVE_INTERVAL 5
+
+#define FORM_HEADER "Content-Type: application/x-www-form-urlencoded\r\n"
+
+typedef struct
+{
+  uint64_t point;
+  int node;
+} vnode_t;
+
+/* A prepared transaction on this node: */
+typedef struct
+{
+  cluster_op_t *ops;
+  int count;
+  time_t prepared;
+} staged_t;
+
+/* A transaction this node coordinates, until every node has its outcome: */
+typedef struct
+{
+  int committed;  /* 0 while the nodes are being prepared */
+  char *unacked;  /* per node, 1 if it has not yet answered the commit */
+} decision_t;
+
+static int node_count, self = -1;
+static char **hosts, **ports;
+static vnode_t *ring;
+static int ring_size;
+static cluster_apply_t apply_ops;
+
+static dictionary_t *staged; /* tx -> staged_t* */
+static dictionary_t *locks;  /* user -> id of the tx holding it */
+static dictionary_t *decisions; /* tx -> decision_t* */
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unlocked = PTHREAD_COND_INITIALIZER;
+static unsigned long tx_counter;
+
+static uint64_t hash_string(const char *s);
+static int compare_vnodes(const void *a, const void *b);
+static void append_op(char **text, int adding, const char *user, const char *friend);
+static int run_transaction(const char *tx, char **ops);
+static int send_to_node(int node, const char *path, const char *tx, const char *ops);
+static staged_t *parse_ops(const char *text);
+static void free_staged(staged_t *s);
+static void release_locks(const char *tx, staged_t *s);
+static int find_conflict(const char *tx, staged_t *s);
+static void free_decision(void *d);
+static void *resolve_main(void *arg);
+static void resolve_prepared(time_t now);
+static void resend_commits(void);
+static int ask_outcome(int node, const char *tx);
+
+int cluster_configure(const char *nodes, cluster_apply_t apply)
+{
+  char **specs = split_string(nodes, ',');
+  int i, v, count = 0;
+
+  while (specs[count])
+    count++;
+
+  hosts = calloc(count, sizeof(char *));
+  ports = calloc(count, sizeof(char *));
+  for (i = 0; i < count; i++)
+  {
+    char *colon = strrchr(specs[i], ':');
+    if (!colon || colon == specs[i] || !colon[1])
+      count = -1;
+    else
+    {
+      hosts[i] = strndup(specs[i], colon - specs[i]);
+      ports[i] = strdup(colon + 1);
+    }
+  }
+  for (i = 0; specs[i]; i++)
+    free(specs[i]);
+  free(specs);
+  if (count <= 0)
+    return -1;
+
+  ring_size = count * CLUSTER_VNODES;
+  ring = malloc(ring_size * sizeof(vnode_t));
+  for (i = 0; i < count; i++)
+  {
+    for (v = 0; v < CLUSTER_VNODES; v++)
+    {
+      char name[MAXLINE];
+      snprintf(name, sizeof(name), "%s:%s#%d", hosts[i], ports[i], v);
+      ring[i * CLUSTER_VNODES + v].point = hash_string(name);
+      ring[i * CLUSTER_VNODES + v].node = i;
+    }
+  }
+  qsort(ring, ring_size, sizeof(vnode_t), compare_vnodes);
+
+  staged = make_dictionary(COMPARE_CASE_SENS, NULL);
+  locks = make_dictionary(COMPARE_CASE_SENS, free);
+  decisions = make_dictionary(COMPARE_CASE_SENS, free_decision);
+  apply_ops = apply;
+  node_count = count;
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, resolve_main, NULL);
+  pthread_detach(tid);
+  return count;
+}
+
+void cluster_set_self(int node)
+{
+  self = node;
+}
+
+int cluster_enabled(void)
+{
+  return node_count > 0;
+}
+
+int cluster_size(void)
+{
+  return node_count;
+}
+
+int cluster_self(void)
+{
+  return self;
+}
+
+const char *cluster_host(int node)
+{
+  return hosts[node];
+}
+
+const char *cluster_port(int node)
+{
+  return ports[node];
+}
+
+int cluster_owner(const char *user)
+{
+  uint64_t h = hash_string(user);
+  int lo = 0, hi = ring_size;
+
+  /* First point at or after h, wrapping around */
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (ring[mid].point < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return ring[lo == ring_size ? 0 : lo].node;
+}
+
+/*
+ * hash_string - 64-bit FNV-1a, finished with a mixer so that similar
+ *   names land far apart on the ring
+ */
+static uint64_t hash_string(const char *s)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; *s; s++)
+  {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int compare_vnodes(const void *a, const void *b)
+{
+  uint64_t pa = ((const vnode_t *)a)->point, pb = ((const vnode_t *)b)->point;
+  return (pa > pb) - (pa < pb);
+}
+
+int cluster_update(const char *user, char **friends, int adding)
+{
+  char **ops = calloc(node_count, sizeof(char *));
+  int i, attempt, result = CLUSTER_PREPARED, any = 0;
+
+  for (i = 0; friends[i] != NULL; i++)
+  {
+    if (strcmp(friends[i], user) == 0)
+      continue;
+    append_op(&ops[cluster_owner(user)], adding, user, friends[i]);
+    append_op(&ops[cluster_owner(friends[i])], adding, friends[i], user);
+    any = 1;
+  }
+
+  for (attempt = 0; any && attempt < CLUSTER_RETRIES; attempt++)
+  {
+    char tx[64];
+
+    /* Back off exponentially, with jitter so that colliding
+       coordinators spread out */
+    if (attempt > 0)
+      usleep((2000 << attempt) + rand() % (2000 << attempt));
+    snprintf(tx, sizeof(tx), "%d.%ld.%lu", self, (long)getpid(),
+             __sync_add_and_fetch(&tx_counter, 1));
+    result = run_transaction(tx, ops);
+    if (result != CLUSTER_CONFLICT)
+      break;
+  }
+
+  for (i = 0; i < node_count; i++)
+    free(ops[i]);
+  free(ops);
+  return (result == CLUSTER_PREPARED ? 0 : -1);
+}
+
+/*
+ * append_op - add one operation line to a node's share of a transaction
+ */
+static void append_op(char **text, int adding, const char *user, const char *friend)
+{
+  char *user_enc = query_encode(user), *friend_enc = query_encode(friend);
+  char *old = *text;
+
+  *text = append_strings(old ? old : "", adding ? "+ " : "- ",
+                         user_enc, " ", friend_enc, "\n", NULL);
+  free(old);
+  free(user_enc);
+  free(friend_enc);
+}
+
+/*
+ * run_transaction - prepare `tx` on every node with operations (in node
+ *   order), then commit it everywhere or abort wherever it was prepared
+ */
+static int run_transaction(const char *tx, char **ops)
+{
+  int *prepared = calloc(node_count, sizeof(int));
+  int i, result = CLUSTER_PREPARED, unacked = 0;
+  decision_t *d = calloc(1, sizeof(decision_t));
+
+  /* Recorded before any node prepares, so that one asking early hears
+     that the transaction is still pending rather than aborted */
+  d->unacked = calloc(node_count, 1);
+  pthread_mutex_lock(&tx_lock);
+  dictionary_set(decisions, tx, d);
+  pthread_mutex_unlock(&tx_lock);
+
+  for (i = 0; i < node_count && result == CLUSTER_PREPARED; i++)
+  {
+    if (!ops[i])
+      continue;
+    if (i == self)
+      result = cluster_prepare(tx, ops[i]);
+    else
+    {
+      int status = send_to_node(i, "/cluster/prepare", tx, ops[i]);
+      result = (status == 200 ? CLUSTER_PREPARED
+                : status == 409 ? CLUSTER_CONFLICT : CLUSTER_INVALID);
+    }
+    prepared[i] = (result == CLUSTER_PREPARED);
+  }
+
+  if (result == CLUSTER_PREPARED)
+  {
+    pthread_mutex_lock(&tx_lock);
+    d->committed = 1;
+    pthread_mutex_unlock(&tx_lock);
+  }
+
+  for (i = 0; i < node_count; i++)
+  {
+    if (!prepared[i])
+      continue;
+    if (result != CLUSTER_PREPARED)
+    {
+      if (i == self)
+        cluster_abort(tx);
+      else
+        send_to_node(i, "/cluster/abort", tx, NULL);
+    }
+    else if (i == self)
+      cluster_commit(tx);
+    else
+    {
+      int tries = 0;
+      while (send_to_node(i, "/cluster/commit", tx, NULL) < 0
+             && ++tries < CLUSTER_COMMIT_TRIES)
+        usleep(100000);
+      if (tries == CLUSTER_COMMIT_TRIES)
+      {
+        fprintf(stderr, "cluster: could not commit %s on %s:%s yet\n",
+                tx, hosts[i], ports[i]);
+        pthread_mutex_lock(&tx_lock);
+        d->unacked[i] = 1;
+        pthread_mutex_unlock(&tx_lock);
+        unacked = 1;
+      }
+    }
+  }
+
+  /* An abort, or a commit every node has, need not be remembered */
+  if (!unacked)
+  {
+    pthread_mutex_lock(&tx_lock);
+    dictionary_remove(decisions, tx);
+    pthread_mutex_unlock(&tx_lock);
+  }
+
+  free(prepared);
+  return result;
+}
+
+/*
+ * send_to_node - POST a transaction message, returning the HTTP status
+ *   or -1 if the node did not answer
+ */
+static int send_to_node(int node, const char *path, const char *tx, const char *ops)
+{
+  peer_response_t resp;
+  char *tx_enc = query_encode(tx), *ops_enc = NULL, *body;
+  int status = -1;
+
+  if (ops)
+  {
+    ops_enc = query_encode(ops);
+    body = append_strings("tx=", tx_enc, "&ops=", ops_enc, NULL);
+  }
+  else
+    body = append_strings("tx=", tx_enc, NULL);
+
+  if (peer_request(hosts[node], ports[node], "POST", path, FORM_HEADER,
+                   body, strlen(body), &resp) == 0)
+  {
+    status = resp.status;
+    peer_response_free(&resp);
+  }
+
+  free(body);
+  free(tx_enc);
+  free(ops_enc);
+  return status;
+}
+
+int cluster_prepare(const char *tx, const char *text)
+{
+  staged_t *s = parse_ops(text);
+  struct timespec deadline;
+  int i;
+
+  if (!s)
+    return CLUSTER_INVALID;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += CLUSTER_LOCK_WAIT / 1000;
+  deadline.tv_nsec += (CLUSTER_LOCK_WAIT % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&tx_lock);
+  if (dictionary_get(staged, tx))
+  {
+    /* A repeated prepare */
+    pthread_mutex_unlock(&tx_lock);
+    free_staged(s);
+    return CLUSTER_PREPARED;
+  }
+  while (find_conflict(tx, s))
+  {
+    if (pthread_cond_timedwait(&unlocked, &tx_lock, &deadline) != 0
+        && find_conflict(tx, s))
+    {
+      pthread_mutex_unlock(&tx_lock);
+      free_staged(s);
+      return CLUSTER_CONFLICT;
+    }
+  }
+  for (i = 0; i < s->count; i++)
+    dictionary_set(locks, s->ops[i].user, strdup(tx));
+  dictionary_set(staged, tx, s);
+  pthread_mutex_unlock(&tx_lock);
+
+  return CLUSTER_PREPARED;
+}
+
+int cluster_commit(const char *tx)
+{
+  staged_t *s;
+
+  pthread_mutex_lock(&tx_lock);
+  s = dictionary_get(staged, tx);
+  if (s)
+    dictionary_remove(staged, tx);
+  pthread_mutex_unlock(&tx_lock);
+
+  if (!s)
+    return -1;
+
+  /* The users stay locked until the change is in place, so a later
+     transaction cannot overtake this one on any node */
+  apply_ops(s->ops, s->count);
+
+  pthread_mutex_lock(&tx_lock);
+  release_locks(tx, s);
+  pthread_mutex_unlock(&tx_lock);
+  free_staged(s);
+  return 0;
+}
+
+void cluster_abort(const char *tx)
+{
+  staged_t *s;
+
+  pthread_mutex_lock(&tx_lock);
+  s = dictionary_get(staged, tx);
+  if (s)
+  {
+    dictionary_remove(staged, tx);
+    release_locks(tx, s);
+  }
+  pthread_mutex_unlock(&tx_lock);
+
+  if (s)
+    free_staged(s);
+}
+
+/*
+ * parse_ops - parse operation lines, returning NULL if any is malformed
+ */
+static staged_t *parse_ops(const char *text)
+{
+  char **lines = split_string(text, '\n');
+  staged_t *s = calloc(1, sizeof(staged_t));
+  int i, bad = 0;
+
+  for (i = 0; lines[i]; i++)
+    ;
+  s->ops = calloc(i, sizeof(cluster_op_t));
+  s->prepared = time(NULL);
+
+  for (i = 0; lines[i]; i++)
+  {
+    char **parts = split_string(lines[i], ' ');
+    int n;
+
+    for (n = 0; parts[n]; n++)
+      ;
+    if (n == 3 && (!strcmp(parts[0], "+") || !strcmp(parts[0], "-")))
+    {
+      cluster_op_t *op = &s->ops[s->count++];
+      op->adding = (parts[0][0] == '+');
+      op->user = query_decode(parts[1]);
+      op->friend = query_decode(parts[2]);
+    }
+    else
+      bad = 1;
+
+    for (n = 0; parts[n]; n++)
+      free(parts[n]);
+    free(parts);
+    free(lines[i]);
+  }
+  free(lines);
+
+  if (bad)
+  {
+    free_staged(s);
+    return NULL;
+  }
+  return s;
+}
+
+static void free_staged(staged_t *s)
+{
+  int i;
+
+  for (i = 0; i < s->count; i++)
+  {
+    free(s->ops[i].user);
+    free(s->ops[i].friend);
+  }
+  free(s->ops);
+  free(s);
+}
+
+/* Must be called with tx_lock held */
+static void release_locks(const char *tx, staged_t *s)
+{
+  int i;
+
+  for (i = 0; i < s->count; i++)
+  {
+    const char *holder = dictionary_get(locks, s->ops[i].user);
+    if (holder && strcmp(holder, tx) == 0)
+      dictionary_remove(locks, s->ops[i].user);
+  }
+  pthread_cond_broadcast(&unlocked);
+}
+
+/*
+ * find_conflict - whether another transaction holds a user that `s`
+ *   changes; must be called with tx_lock held
+ */
+static int find_conflict(const char *tx, staged_t *s)
+{
+  int i;
+
+  for (i = 0; i < s->count; i++)
+  {
+    const char *holder = dictionary_get(locks, s->ops[i].user);
+    if (holder && strcmp(holder, tx) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+int cluster_outcome(const char *tx)
+{
+  decision_t *d;
+  int outcome;
+
+  pthread_mutex_lock(&tx_lock);
+  d = dictionary_get(decisions, tx);
+  outcome = (d == NULL ? CLUSTER_ABORTED
+             : d->committed ? CLUSTER_COMMITTED : CLUSTER_PENDING);
+  pthread_mutex_unlock(&tx_lock);
+  return outcome;
+}
+
+static void free_decision(void *d)
+{
+  free(((decision_t *)d)->unacked);
+  free(d);
+}
+
+/*
+ * resolve_main - the background thread: asks about transactions
+ *   prepared here long ago, and resends commits that did not get
+ *   through
+ */
+static void *resolve_main(void *arg)
+{
+  while (1)
+  {
+    sleep(CLUSTER_RESOLVE_INTERVAL);
+    resolve_prepared(time(NULL));
+    resend_commits();
+  }
+  return NULL;
+}
+
+/*
+ * resolve_prepared - ask the coordinator of each transaction that has
+ *   been prepared for too long how it ended, and commit or abort it;
+ *   one whose coordinator cannot say stays prepared
+ */
+static void resolve_prepared(time_t now)
+{
+  char **waiting;
+  size_t i, count = 0;
+
+  pthread_mutex_lock(&tx_lock);
+  waiting = malloc((dictionary_count(staged) + 1) * sizeof(char *));
+  for (i = 0; i < dictionary_count(staged); i++)
+  {
+    staged_t *s = dictionary_value(staged, i);
+    if (now - s->prepared > CLUSTER_TX_TIMEOUT)
+      waiting[count++] = strdup(dictionary_key(staged, i));
+  }
+  pthread_mutex_unlock(&tx_lock);
+
+  for (i = 0; i < count; i++)
+  {
+    /* A transaction's id starts with its coordinator's node */
+    int node = atoi(waiting[i]);
+    int outcome = (node >= 0 && node < node_count && node != self
+                   ? ask_outcome(node, waiting[i]) : -1);
+
+    if (outcome == CLUSTER_COMMITTED)
+      cluster_commit(waiting[i]);
+    else if (outcome == CLUSTER_ABORTED)
+    {
+      fprintf(stderr, "cluster: %s was aborted by its coordinator\n", waiting[i]);
+      cluster_abort(waiting[i]);
+    }
+    free(waiting[i]);
+  }
+  free(waiting);
+}
+
+/*
+ * resend_commits - deliver again each commit that a node has not yet
+ *   answered; any answer will do, since a node that no longer has the
+ *   transaction prepared has already learned its outcome
+ */
+static void resend_commits(void)
+{
+  char **txs;
+  int *nodes;
+  size_t i, count = 0;
+  int n;
+
+  pthread_mutex_lock(&tx_lock);
+  txs = malloc((dictionary_count(decisions) * node_count + 1) * sizeof(char *));
+  nodes = malloc((dictionary_count(decisions) * node_count + 1) * sizeof(int));
+  for (i = 0; i < dictionary_count(decisions); i++)
+  {
+    decision_t *d = dictionary_value(decisions, i);
+    for (n = 0; n < node_count; n++)
+      if (d->unacked[n])
+      {
+        txs[count] = strdup(dictionary_key(decisions, i));
+        nodes[count++] = n;
+      }
+  }
+  pthread_mutex_unlock(&tx_lock);
+
+  for (i = 0; i < count; i++)
+  {
+    if (send_to_node(nodes[i], "/cluster/commit", txs[i], NULL) >= 0)
+    {
+      pthread_mutex_lock(&tx_lock);
+      decision_t *d = dictionary_get(decisions, txs[i]);
+      if (d != NULL)
+      {
+        d->unacked[nodes[i]] = 0;
+        for (n = 0; n < node_count && !d->unacked[n]; n++)
+          ;
+        if (n == node_count)
+          dictionary_remove(decisions, txs[i]);
+      }
+      pthread_mutex_unlock(&tx_lock);
+    }
+    free(txs[i]);
+  }
+  free(txs);
+  free(nodes);
+}
+
+/*
+ * ask_outcome - ask a coordinator about a transaction, returning the
+ *   outcome or -1 if it did not answer
+ */
+static int ask_outcome(int node, const char *tx)
+{
+  peer_response_t resp;
+  char *tx_enc = query_encode(tx), *body = append_strings("tx=", tx_enc, NULL);
+  int outcome = -1;
+
+  if (peer_request(hosts[node], ports[node], "POST", "/cluster/outcome", FORM_HEADER,
+                   body, strlen(body), &resp) == 0)
+  {
+    if (resp.status == 200 && starts_with("commit", resp.body))
+      outcome = CLUSTER_COMMITTED;
+    else if (resp.status == 200 && starts_with("abort", resp.body))
+      outcome = CLUSTER_ABORTED;
+    else if (resp.status == 200)
+      outcome = CLUSTER_PENDING;
+    peer_response_free(&resp);
+  }
+
+  free(body);
+  free(tx_enc);
+  return outcome;
+}
@@ -0,0 +1,77 @@
+/* Cluster mode, in which users are partitioned across several
+   friendlist servers by consistent hashing. Each node appears on a
+   hash ring at many points, and a user belongs to the first node at
+   or after the user's own hash, so the users spread evenly and adding
+   a node moves only about 1/N of them. Every node of a cluster must
+   be started with the same node list.
+
+   A friendship lives in the friend lists of both users, which can
+   belong to different nodes, so changing one is a two-phase
+   transaction: each node involved first prepares its half, locking
+   the users it will touch, and only when every node has prepared are
+   the halves committed; otherwise all of them are aborted.
+
+   The coordinator remembers a commit until every node has answered
+   it, and goes on resending it in the background to nodes that could
+   not be reached. A node that has prepared never gives up its half by
+   itself: if no outcome arrives for a while, it asks the coordinator,
+   and keeps the users locked until it gets an answer. A coordinator
+   that has no record of a transaction (because it aborted it, or was
+   restarted before deciding) answers that it was aborted. */
+
+/* One half of a friendship change: add (or remove) `friend` in
+   `user`'s friend list. */
+typedef struct
+{
+  int adding;
+  char *user, *friend;
+} cluster_op_t;
+
+/* Applies committed operations to this node's friend lists. */
+typedef void (*cluster_apply_t)(cluster_op_t *ops, int count);
+
+/* Enables cluster mode for the comma-separated "host:port" list
+   `nodes`, with `apply` to carry out committed operations. Returns
+   the number of nodes, or -1 if the list is malformed. */
+int cluster_configure(const char *nodes, cluster_apply_t apply);
+
+/* Records which node in the list is this server. */
+void cluster_set_self(int node);
+
+/* Returns 1 once cluster_configure() has succeeded. */
+int cluster_enabled(void);
+
+int cluster_size(void);
+int cluster_self(void);
+const char *cluster_host(int node);
+const char *cluster_port(int node);
+
+/* Returns the node that owns `user`'s friend list. */
+int cluster_owner(const char *user);
+
+/* Adds (or removes) friendships between `user` and each name in the
+   NULL-terminated `friends`, on whichever nodes own the two halves.
+   A transaction that collides with another one is retried a few
+   times. Returns 0 once committed and -1 if it was aborted. */
+int cluster_update(const char *user, char **friends, int adding);
+
+/* Results of cluster_prepare(): */
+#define CLUSTER_PREPARED 0
+#define CLUSTER_CONFLICT 1 /* another transaction holds a user */
+#define CLUSTER_INVALID 2
+
+/* The participant's side of a transaction with id `tx`. `ops` holds
+   one operation per line as written by cluster_update(). Committing
+   returns -1 for a transaction that is not (or no longer) prepared. */
+int cluster_prepare(const char *tx, const char *ops);
+int cluster_commit(const char *tx);
+void cluster_abort(const char *tx);
+
+/* Results of cluster_outcome(): */
+#define CLUSTER_PENDING 0 /* not decided yet */
+#define CLUSTER_COMMITTED 1
+#define CLUSTER_ABORTED 2
+
+/* The coordinator's side: what became of transaction `tx`, for a
+   participant that has waited too long to hear. */
+int cluster_outcome(const char *tx);
@@ -79,6 +79,24 @@ void dictionary_remove(dictionary_t *d, const char *key) {
   }
 }
 
+void dictionary_filter(dictionary_t *d,
+                       int (*keep)(const char *key, void *value, void *arg),
+                       void *arg) {
+  size_t i, n = 0;
+
+  for (i = 0; i < d->count; i++) {
+    if (keep(d->keys[i], d->values[i], arg)) {
+      d->keys[n] = d->keys[i];
+      d->values[n] = d->values[i];
+      n++;
+    } else {
+      free((void *)d->keys[i]);
+      d->free_value(d->values[i]);
+    }
+  }
+  d->count = n;
+}
+
 void *dictionary_get(dictionary_t *d, const char *key) {
   int i;
 
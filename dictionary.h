@@ -35,6 +35,13 @@ void dictionary_set(dictionary_t *d, const char *key, void *value);
 /* Removes the dictionary's mapping, if any, for `key`. */
 void dictionary_remove(dictionary_t *d, const char *key);
 
+/* Removes, in one pass, every mapping for which `keep` returns 0,
+   destroying its value as dictionary_remove() would; the others keep
+   their order: */
+void dictionary_filter(dictionary_t *d,
+                       int (*keep)(const char *key, void *value, void *arg),
+                       void *arg);
+
 /* Returns the dictionary's value for `key`, or NULL if the dictionary
    has no value for `key`. The dictionary retains ownership of the
    result value, so beware that the result can be destroyed if the
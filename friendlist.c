@@ -8,49 +8,338 @@
  *   Dave O'Hallaron
  *   Carnegie Mellon University
  */
+#include <ifaddrs.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "dictionary.h"
 #include "more_string.h"
+#include "peer.h"
+#include "peer_cache.h"
+#include "peer_async.h"
+#include "resolver.h"
+#include "cluster.h"
+#include "replication.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "graph.h"
+#include "trie.h"
+
+/* Seconds a persistent client connection may sit idle between requests: */
+#define KEEPALIVE_TIMEOUT 15
+
+/* What doit() leaves the connection to: */
+#define CONN_CLOSE 0
+#define CONN_KEEP 1
+#define CONN_PARKED 2 /* handed off to wait for a peer */
+
+/* Steps of building the /is-friend filter taken per hold of the lock,
+   and how often to look for a filter that is due: */
+#define FILTER_SLICE 65536
+#define FILTER_IDLE_USEC 100000
+
+/* Threads that finish introductions once their peer has answered, and
+   how many answered introductions may wait for one: */
+#define INTRO_WORKERS 8
+#define INTRO_BACKLOG 1024
+
+/* Suggestions returned by /suggest without a k, and at most: */
+#define SUGGEST_DEFAULT 20
+#define SUGGEST_MAX 1000
+
+/* Steps /distance searches without a max, and at most: */
+#define DISTANCE_DEFAULT 6
+#define DISTANCE_MAX 64
+
+/* Most connected users /stats lists without a k, and at most: */
+#define STATS_TOP_DEFAULT 10
+#define STATS_TOP_MAX 1000
+
+/* Friends a page of /friends holds without a limit, and at most: */
+#define FRIENDS_PAGE_DEFAULT 100
+#define FRIENDS_PAGE_MAX 1000
+
+/* Names /search returns without a limit, and at most: */
+#define SEARCH_DEFAULT 20
+#define SEARCH_MAX 1000
+
+/* A client connection together with its read buffer, so that a parked
+   connection can be resumed on another thread. The client's address
+   stays in binary form and is only formatted for the access log. */
+typedef struct
+{
+  int fd;
+  rio_t rio;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+} conn_t;
 
-static void doit(int fd);
-static char *ok_header(size_t len, const char *content_type);
+/* An /introduce request waiting for a peer to send a friend list: */
+typedef struct introduction_t
+{
+  conn_t *conn;
+  int keep_alive;
+  char *user, *host, *port;
+  char *path, *key; /* peer path and peer cache key for the list */
+  char *etag;       /* of a stale cached copy, if any */
+  peer_response_t *response;
+  char *FriFriends;              /* the list, once it has arrived */
+  int waiter;                    /* joined another one's fetch */
+  struct introduction_t *next;   /* others waiting on the same fetch */
+  struct introduction_t *queued; /* next one waiting for a worker */
+} introduction_t;
+
+/* A user whose friend list an export (or a replica's snapshot) copied
+   out of AllClients: */
+typedef struct
+{
+  char *user;
+  char **friends;
+  size_t count;
+} exported_t;
+
+/* An export's output, sent in chunks of up to EXPORT_CHUNK bytes: */
+#define EXPORT_CHUNK 65536
+typedef struct
+{
+  int fd, chunked, failed;
+  size_t len;
+  char data[EXPORT_CHUNK];
+} export_out_t;
+
+static int doit(conn_t *conn);
+static void serveConnection(conn_t *conn, int state);
+static void logConnection(conn_t *conn);
+static char *ok_header(size_t len, const char *content_type,
+                       const char *extra_headers);
 static dictionary_t *read_requesthdrs(rio_t *rp);
 static void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d);
-static void clienterror(int fd, char *cause, char *errnum,
+static void clienterror(int fd, const char *cause, char *errnum,
                         char *shortmsg, char *longmsg);
 static void print_stringdictionary(dictionary_t *d);
 static void serve_request(int fd, dictionary_t *query);
 static dictionary_t *registerClient(dictionary_t *query, const char *user);
 static void WriteResponse(int fd, char *body);
+static void WriteResponseWith(int fd, char *body, const char *extra_headers);
 static char *UpdateUserFriends(char *newFriends, const char *user);
-static char *getFriFriend(char *host, char *port, char *friends);
-static void getFriends(int fd, dictionary_t *query);
+static char *RemoveUserFriends(char *oldFriends, const char *user);
+static char *changeFriends(const char *user, char *friends, int adding);
+static void addFriendship(const char *user, const char *friend);
+static void removeFriendship(const char *user, const char *friend);
+static void linkFriend(const char *user, const char *friend);
+static void unlinkFriend(const char *user, const char *friend);
+static void applyClusterOps(cluster_op_t *ops, int count);
+static int forwardRequest(int fd, const char *uri, dictionary_t *headers,
+                          dictionary_t *query);
+static void relayRequest(int fd, const char *host, const char *port,
+                         const char *uri, dictionary_t *headers,
+                         dictionary_t *query);
+static int isWriteRequest(char *uri);
+static void snapshotGraph(replication_add_t add, void *ctx, unsigned long *seq_p);
+static void applyReplicated(int reset, replication_op_t *ops, int count);
+static void replicationRequest(int fd, char *uri, dictionary_t *query);
+static void followPrimary(const char *primary);
+static void replayChange(int adding, const char *user, const char *friend);
+static dictionary_t *lookupClient(const char *user);
+static void freeClient(void *user_Friends_Dictionary);
+static char *friendsBody(const char *user);
+static void walkGraph(void *walk_arg, snapshot_emit_t emit, void *ctx);
+static void compactGraph(int fd);
+static void saveGraph(int fd);
+static int startSave(void);
+static int changedSinceFork(const char *user, void *user_Friends_Dictionary,
+                            void *arg);
+static void finishSave(snapshot_stats_t *stats, void *done_arg);
+static void snapshotStatus(int fd);
+static void exportGraph(int fd, const char *version);
+static exported_t *pinGraph(snapshot_t **snap_p, size_t *count_p,
+                            unsigned long *seq_p);
+static void freeExported(exported_t *changed, size_t count);
+static void rebuildGraph(int carry);
+static void *filterMain(void *arg);
+static void noteChanged(const char *user);
+static char **fetchFriends(int owner, const char *user);
+static void mutualFriends(int fd, dictionary_t *query);
+static int compareIds(const void *a, const void *b);
+static void suggestFriends(int fd, dictionary_t *query);
+static void findDistance(int fd, dictionary_t *query);
+static void degreeStats(int fd, dictionary_t *query);
+static void userComponent(int fd, dictionary_t *query);
+static void sameComponent(int fd, dictionary_t *query);
+static void isFriend(int fd, dictionary_t *query);
+static void searchUsers(int fd, dictionary_t *headers, dictionary_t *query);
+static char *encodeQuery(dictionary_t *query);
+static void clusterRequest(int fd, char *uri, dictionary_t *query);
+static void joinCluster(const char *nodes);
+static int isThisServer(const char *host, const char *port);
+static int isLocalAddress(const struct sockaddr *addr);
+static char *introduceLocally(const char *user, const char *friend);
+static introduction_t *makeIntroduction(conn_t *conn, const char *user,
+                                        const char *host, const char *port,
+                                        const char *friends);
+static void freeIntroduction(introduction_t *intro);
+static void startIntroduction(introduction_t *intro);
+static void introductionFetched(peer_response_t *response, void *arg);
+static void resumeIntroduction(introduction_t *intro);
+static int joinIntroduction(introduction_t *intro);
+static void shareFriendList(introduction_t *intro, const char *FriFriends);
+static void completeIntroduction(introduction_t *intro);
+static void refuseIntroduction(introduction_t *intro);
+static int queueIntroduction(introduction_t *intro);
+static void *introductionWorker(void *arg);
+static void startIntroductionWorkers(void);
+static void *continueConnection(void *arg);
+static void finishIntroduction(int fd, const char *user, char *FriFriends);
+static void getFriends(int fd, dictionary_t *headers, dictionary_t *query);
+static void getFriendsPage(int fd, const char *user, dictionary_t *query,
+                           const char *etag);
+static char *friendsETag(const char *user);
+static int etagMatches(const char *if_none_match, const char *etag);
+static void notModified(int fd, const char *etag);
+static char *encodeCursor(const char *name);
+static char *decodeCursor(const char *cursor);
+static void getFriendChanges(int fd, dictionary_t *query);
+static int parseETag(const char *etag, uint64_t *version_p);
 static void beFriends(int fd, dictionary_t *query);
 static void unFriend(int fd, dictionary_t *query);
-static void introduceFriend(int fd, dictionary_t *query);
+static int introduceFriend(conn_t *conn, dictionary_t *query);
 static char *getBody(dictionary_t *user_Friends_Dictionary);
+static int wantsKeepAlive(const char *version, const char *connection);
 
 pthread_mutex_t mutex;
 static dictionary_t *AllClients;
+
+/* The snapshot the graph was last compacted into, if any (-s). Users
+   in AllClients have changed since, and supersede their entries: */
+static snapshot_t *base;
+static char *snapshot_path;
+
+/* The same graph, indexed by number for graph queries (graph.h): */
+static graph_t *graph;
+
+/* Users registered since the snapshot, by name, for /search; those in
+   the snapshot are found in its own sorted names: */
+static trie_t *registered;
+
+/* Background snapshots (/bgsave and /compact): whether one is running,
+   where the write-ahead log stood when it forked (or whether the log
+   had failed, so the snapshot replaces all of it), and how the last
+   one went; `saved` is signalled as each one ends: */
+static int saving;
+static long save_mark;
+static int save_resets;
+static pthread_cond_t saved = PTHREAD_COND_INITIALIZER;
+/* Users whose friend lists have changed (or who were registered) since
+   the running background snapshot forked, so not as the snapshot has
+   them; NULL while no snapshot is running: */
+static dictionary_t *changed_since_fork;
+static long saves;
+static snapshot_stats_t last_save = {0, -1, -1, -1};
 void *thread_client(void *args);
 
+/* The port we listen on, and the addresses of this host's interfaces,
+   for recognizing an /introduce that points back at us: */
+static char *listen_port;
+static struct ifaddrs *local_addrs;
+
+/* Whether to log each accepted connection (-l): */
+static int access_log;
+
+/* Different each time the server starts, and part of every ETag, so a
+   version from an earlier run never matches: */
+static char boot_id[32];
+
+/* Peer fetches in progress, mapping a peer cache key to the
+   introduction that started the fetch; others asking for the same
+   list wait on its `next` chain instead of fetching it again: */
+static dictionary_t *inflight;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Introductions whose peer has answered, oldest first, waiting for one
+   of the INTRO_WORKERS threads: */
+static introduction_t *intro_head, *intro_tail;
+static int intro_queued;
+static pthread_mutex_t intro_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t intro_ready = PTHREAD_COND_INITIALIZER;
+
+/* Whether the connection served by this thread stays open after the
+   current response: */
+static __thread int keep_alive;
+
 int main(int argc, char **argv)
 {
-  int listenfd, connfd;
-  char hostname[MAXLINE], port[MAXLINE];
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
-  AllClients = make_dictionary(COMPARE_CASE_SENS, free);
+  int listenfd, opt;
+  char *cluster_nodes = NULL, *primary = NULL, *wal_path = NULL;
+  int wal_window = 0;
+  AllClients = make_dictionary(COMPARE_CASE_SENS, freeClient);
+  registered = trie_make();
+  inflight = make_dictionary(COMPARE_CASE_SENS, NULL);
+  snprintf(boot_id, sizeof(boot_id), "%lx%x", (unsigned long)time(NULL),
+           (unsigned int)getpid());
   pthread_mutex_init(&mutex, NULL);
 
   /* Check command line args */
-  if (argc != 2)
+  while ((opt = getopt(argc, argv, "lc:r:w:d:s:")) != -1)
+  {
+    if (opt == 'l')
+      access_log = 1;
+    else if (opt == 'c')
+      cluster_nodes = optarg;
+    else if (opt == 'r')
+      primary = optarg;
+    else if (opt == 'w')
+      wal_path = optarg;
+    else if (opt == 'd')
+      wal_window = atoi(optarg);
+    else if (opt == 's')
+      snapshot_path = optarg;
+    else
+      optind = argc; /* reject below */
+  }
+  if (optind != argc - 1 || (cluster_nodes && primary) || (primary && (wal_path || snapshot_path)))
   {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    fprintf(stderr, "usage: %s [-l] [-s snapshot] [-w wal [-d ms]]"
+                    " [-c host:port,... | -r host:port] <port>\n",
+            argv[0]);
     exit(1);
   }
 
-  listenfd = Open_listenfd(argv[1]);
+  listen_port = argv[optind];
+  listenfd = Open_listenfd(listen_port);
+  if (getifaddrs(&local_addrs) < 0)
+    local_addrs = NULL;
+  if (cluster_nodes)
+    joinCluster(cluster_nodes);
+  replication_init(snapshotGraph);
+  if (snapshot_path)
+  {
+    base = snapshot_open(snapshot_path);
+    if (base == NULL && errno != ENOENT)
+    {
+      fprintf(stderr, "cannot use snapshot %s: %s\n", snapshot_path,
+              strerror(errno));
+      exit(1);
+    }
+  }
+  graph = graph_make(base);
+  if (wal_path)
+  {
+    long replayed = wal_open(wal_path, wal_window, replayChange);
+    if (replayed < 0)
+    {
+      fprintf(stderr, "cannot use write-ahead log %s: %s\n", wal_path,
+              strerror(errno));
+      exit(1);
+    }
+    printf("Replayed %ld changes from %s\n", replayed, wal_path);
+  }
+  if (primary)
+    followPrimary(primary);
+  startIntroductionWorkers();
+  {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, filterMain, NULL) == 0)
+      pthread_detach(tid);
+  }
 
   /* Don't kill the server if there's an error, because
      we want to survive errors due to a client. But we
@@ -60,45 +349,91 @@ int main(int argc, char **argv)
   /* Also, don't stop on broken connections: */
   Signal(SIGPIPE, SIG_IGN);
 
+  /* Accept connections and hand each one to its own thread; nothing
+     here may block on anything but the next connection */
   while (1)
   {
     pthread_t tid;
-    clientlen = sizeof(clientaddr);
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    if (connfd >= 0)
-    {
-      Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
-                  port, MAXLINE, 0);
-      printf("Accepted connection from (%s, %s)\n", hostname, port);
-      int *arg = malloc(sizeof(int));
-      *arg = connfd;
-      pthread_create(&tid, NULL, thread_client, arg);
+    conn_t *conn = malloc(sizeof(conn_t));
+    conn->addrlen = sizeof(conn->addr);
+    conn->fd = Accept(listenfd, (SA *)&conn->addr, &conn->addrlen);
+    if (conn->fd < 0)
+      free(conn);
+    else if (pthread_create(&tid, NULL, thread_client, conn) == 0)
       pthread_detach(tid);
+    else
+    {
+      close(conn->fd);
+      free(conn);
     }
   }
 }
 
 void *thread_client(void *args)
 {
-  int connfd = *((int *)args);
-  free(args);
-  doit(connfd);
+  conn_t *conn = args;
+  struct timeval timeout = {KEEPALIVE_TIMEOUT, 0};
+  int nodelay = 1;
+
+  if (access_log)
+    logConnection(conn);
+
+  /* A persistent connection that goes quiet is dropped */
+  setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  /* Headers and body go out in separate writes; don't let the body
+     wait for the client to acknowledge the headers */
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  Rio_readinitb(&conn->rio, conn->fd);
+  serveConnection(conn, CONN_KEEP);
   return NULL;
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * logConnection - report a new connection using the numeric address,
+ *   so that logging never waits on reverse DNS
+ */
+static void logConnection(conn_t *conn)
+{
+  char hostname[NI_MAXHOST], port[NI_MAXSERV];
+
+  if (getnameinfo((SA *)&conn->addr, conn->addrlen, hostname, sizeof(hostname),
+                  port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+    printf("Accepted connection from (%s, %s)\n", hostname, port);
+}
+
+/*
+ * serveConnection - serve requests until the client closes the
+ *   connection or it is parked, starting from `state` (CONN_KEEP for a
+ *   new connection, or what the last request left it in)
+ */
+static void serveConnection(conn_t *conn, int state)
+{
+  while (state == CONN_KEEP)
+    state = doit(conn);
+
+  if (state == CONN_CLOSE)
+  {
+    close(conn->fd);
+    free(conn);
+  }
+}
+
+/*
+ * doit - handle one HTTP request/response transaction, returning
+ *   what should become of the connection afterwards
  */
-void doit(int fd)
+static int doit(conn_t *conn)
 {
   char buf[MAXLINE], *method, *uri, *version;
-  rio_t rio;
   dictionary_t *headers, *query;
+  int fd = conn->fd, parked = 0;
+  rio_t *rio = &conn->rio;
+
+  keep_alive = 0;
 
   /* Read request line and headers */
-  Rio_readinitb(&rio, fd);
-  if (Rio_readlineb(&rio, buf, MAXLINE) <= 0)
-    return;
+  if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+    return CONN_CLOSE;
   printf("%s", buf);
 
   if (!parse_request_line(buf, &method, &uri, &version))
@@ -120,13 +455,14 @@ void doit(int fd)
     }
     else
     {
-      headers = read_requesthdrs(&rio);
+      headers = read_requesthdrs(rio);
+      keep_alive = wantsKeepAlive(version, dictionary_get(headers, "Connection"));
 
       /* Parse all query arguments into a dictionary */
       query = make_dictionary(COMPARE_CASE_SENS, free);
       parse_uriquery(uri, query);
       if (!strcasecmp(method, "POST"))
-        read_postquery(&rio, headers, query);
+        read_postquery(rio, headers, query);
 
       /* For debugging, print the dictionary */
       print_stringdictionary(query);
@@ -135,9 +471,46 @@ void doit(int fd)
          but the intial implementation always returns
          nothing: */
 
-      if (starts_with("/friends", uri))
+      if (starts_with("/cluster/", uri))
+      {
+        clusterRequest(fd, uri, query);
+      }
+      else if (starts_with("/replicat", uri))
+      {
+        replicationRequest(fd, uri, query);
+      }
+      else if (starts_with("/compact", uri))
+      {
+        compactGraph(fd);
+      }
+      else if (starts_with("/bgsave", uri))
+      {
+        saveGraph(fd);
+      }
+      else if (starts_with("/snapshot", uri))
+      {
+        snapshotStatus(fd);
+      }
+      else if (starts_with("/export", uri))
+      {
+        exportGraph(fd, version);
+      }
+      else if (replication_primary_host() != NULL && isWriteRequest(uri))
+      {
+        relayRequest(fd, replication_primary_host(), replication_primary_port(),
+                     uri, headers, query);
+      }
+      else if (forwardRequest(fd, uri, headers, query))
+      {
+        /* answered by the node that owns the user */
+      }
+      else if (starts_with("/friends/changes", uri))
       {
-        getFriends(fd, query);
+        getFriendChanges(fd, query);
+      }
+      else if (starts_with("/friends", uri))
+      {
+        getFriends(fd, headers, query);
       }
       else if (starts_with("/befriend", uri))
       {
@@ -149,7 +522,39 @@ void doit(int fd)
       }
       else if (starts_with("/introduce", uri))
       {
-        introduceFriend(fd, query);
+        parked = introduceFriend(conn, query);
+      }
+      else if (starts_with("/mutual", uri))
+      {
+        mutualFriends(fd, query);
+      }
+      else if (starts_with("/suggest", uri))
+      {
+        suggestFriends(fd, query);
+      }
+      else if (starts_with("/distance", uri))
+      {
+        findDistance(fd, query);
+      }
+      else if (starts_with("/stats", uri))
+      {
+        degreeStats(fd, query);
+      }
+      else if (starts_with("/component", uri))
+      {
+        userComponent(fd, query);
+      }
+      else if (starts_with("/same-component", uri))
+      {
+        sameComponent(fd, query);
+      }
+      else if (starts_with("/is-friend", uri))
+      {
+        isFriend(fd, query);
+      }
+      else if (starts_with("/search", uri))
+      {
+        searchUsers(fd, headers, query);
       }
       else
       {
@@ -165,34 +570,275 @@ void doit(int fd)
     free(method);
     free(uri);
     free(version);
-
-    close(fd);
   }
+
+  if (parked)
+    return CONN_PARKED;
+  return (keep_alive ? CONN_KEEP : CONN_CLOSE);
+}
+
+/*
+ * wantsKeepAlive - HTTP/1.1 connections persist unless the client asks
+ *   to close, and HTTP/1.0 connections only persist on request
+ */
+static int wantsKeepAlive(const char *version, const char *connection)
+{
+  if (connection)
+    return !strcasecmp(connection, "keep-alive");
+  return !strcasecmp(version, "HTTP/1.1");
 }
 
 /**
- * @brief Get the friends of a user
+ * @brief Get the friends of a user, or answer 304 Not Modified if the
+ * client's ETag shows it already has them
  */
-static void getFriends(int fd, dictionary_t *query)
+static void getFriends(int fd, dictionary_t *headers, dictionary_t *query)
 {
   char *user = dictionary_get(query, "user");
+  const char *if_none_match = dictionary_get(headers, "If-None-Match");
+  char *etag = NULL;
 
   pthread_mutex_lock(&mutex);
-  dictionary_t *user_Friends_Dictionary = registerClient(AllClients, user);
+  if (user != NULL)
+    etag = friendsETag(user);
+  if (etag != NULL && if_none_match != NULL && etagMatches(if_none_match, etag))
+  {
+    pthread_mutex_unlock(&mutex);
+    notModified(fd, etag);
+    free(etag);
+    return;
+  }
+  if (dictionary_get(query, "limit") != NULL || dictionary_get(query, "cursor") != NULL)
+  {
+    pthread_mutex_unlock(&mutex);
+    getFriendsPage(fd, user, query, etag);
+    free(etag);
+    return;
+  }
+  char *body = friendsBody(user);
   pthread_mutex_unlock(&mutex);
 
-  if (user_Friends_Dictionary == NULL)
+  char *extra = (etag ? append_strings("ETag: ", etag, "\r\n", NULL) : NULL);
+  WriteResponseWith(fd, body, extra);
+
+  free(extra);
+  free(etag);
+  free(body);
+}
+
+/*
+ * friendsETag - the ETag of a user's friend list; must be called with
+ *   the mutex held
+ */
+static char *friendsETag(const char *user)
+{
+  char version[32];
+
+  snprintf(version, sizeof(version), "%llu",
+           (unsigned long long)graph_version(graph, user));
+  return append_strings("\"", boot_id, "-", version, "\"", NULL);
+}
+
+/*
+ * etagMatches - whether an If-None-Match list names `etag`, or is "*"
+ */
+static int etagMatches(const char *if_none_match, const char *etag)
+{
+  const char *at = if_none_match;
+
+  while (*at == ' ')
+    at++;
+  if (!strcmp(at, "*"))
+    return 1;
+  /* The tag is quoted, so a match is a whole entry (maybe a weak one) */
+  return strstr(at, etag) != NULL;
+}
+
+/**
+ * @brief Get one page of a user's friends, in name order; when there
+ * may be more, the X-Friendlist-Next-Cursor header carries the cursor
+ * for the next page, which stays good however the list changes
+ */
+static void getFriendsPage(int fd, const char *user, dictionary_t *query,
+                           const char *etag)
+{
+  const char *limit_str = dictionary_get(query, "limit");
+  const char *cursor = dictionary_get(query, "cursor");
+  int limit = (limit_str ? atoi(limit_str) : FRIENDS_PAGE_DEFAULT);
+  char *after = NULL, *extra = NULL;
+
+  if (user == NULL)
+  {
+    clienterror(fd, "/friends", "400", "Bad Request",
+                "Friendlist needs a user for");
+    return;
+  }
+  if (cursor != NULL && cursor[0] != 0 && (after = decodeCursor(cursor)) == NULL)
   {
+    clienterror(fd, cursor, "400", "Bad Request",
+                "Friendlist did not recognize the cursor");
     return;
   }
+  if (limit < 1)
+    limit = 1;
+  if (limit > FRIENDS_PAGE_MAX)
+    limit = FRIENDS_PAGE_MAX;
 
-  char *body = getBody(user_Friends_Dictionary);
+  uint32_t *ids = malloc((limit + 1) * sizeof(uint32_t));
+  const char **names = malloc((limit + 1) * sizeof(char *));
 
-  WriteResponse(fd, body);
+  pthread_mutex_lock(&mutex);
+  long id = graph_find(graph, user);
+  int n = 0;
+  if (id >= 0)
+    n = graph_friends_after(graph, id, after, limit + 1, ids);
+  else
+    registerClient(AllClients, user);
+  for (int i = 0; i < n && i < limit; i++)
+    names[i] = graph_name(graph, ids[i]);
+  if (etag != NULL)
+    extra = append_strings("ETag: ", etag, "\r\n", NULL);
+  if (n > limit)
+  {
+    // one more than asked for shows that there is another page
+    n = limit;
+    char *next = encodeCursor(names[n - 1]), *old = extra;
+    extra = append_strings((old ? old : ""), "X-Friendlist-Next-Cursor: ", next,
+                           "\r\n", NULL);
+    free(old);
+    free(next);
+  }
+  names[n] = NULL;
+  char *body = join_strings(names, '\n');
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponseWith(fd, body, extra);
+
+  free(body);
+  free(extra);
+  free(names);
+  free(ids);
+  free(after);
+}
+
+/*
+ * encodeCursor - a cursor that resumes after `name`: the name in hex,
+ *   so that it is opaque and safe in a URL
+ */
+static char *encodeCursor(const char *name)
+{
+  size_t len = strlen(name);
+  char *cursor = malloc(2 * len + 1);
+
+  for (size_t i = 0; i < len; i++)
+    sprintf(cursor + 2 * i, "%02x", (unsigned char)name[i]);
+  cursor[2 * len] = 0;
+  return cursor;
+}
+
+/*
+ * decodeCursor - the name a cursor resumes after, or NULL if it is
+ *   not one of ours
+ */
+static char *decodeCursor(const char *cursor)
+{
+  size_t len = strlen(cursor);
+  char *name;
+
+  if (len % 2 != 0 || strspn(cursor, "0123456789abcdef") != len)
+    return NULL;
+  name = malloc(len / 2 + 1);
+  for (size_t i = 0; i < len / 2; i++)
+  {
+    unsigned int byte;
+    sscanf(cursor + 2 * i, "%2x", &byte);
+    name[i] = byte;
+  }
+  name[len / 2] = 0;
+  if (strlen(name) != len / 2)
+  {
+    free(name);
+    return NULL;
+  }
+  return name;
+}
+
+/**
+ * @brief Send what has changed in a user's friends since the version in
+ * an ETag from /friends or from here (/friends/changes?since=): "delta"
+ * and then a "+name" or "-name" line for each friend gained or lost, or,
+ * if that version is too old to go back to, "full" and then a "+name"
+ * line for every friend
+ */
+static void getFriendChanges(int fd, dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  const char *since = dictionary_get(query, "since");
+  graph_change_t changes[GRAPH_CHANGES_MAX];
+  const uint32_t *friends = NULL;
+  uint64_t version;
+  uint32_t degree = 0;
+  size_t len = 0;
+  long id;
+  int n = -1, i;
+
+  if (user == NULL)
+  {
+    clienterror(fd, "/friends/changes", "400", "Bad Request",
+                "Friendlist needs a user for");
+    return;
+  }
 
+  pthread_mutex_lock(&mutex);
+  if (since != NULL && parseETag(since, &version))
+    n = graph_changes(graph, user, version, changes);
+  id = graph_find(graph, user);
+  if (n < 0 && id >= 0)
+    degree = graph_friends(graph, id, &friends);
+
+  /* Both kinds of line are a sign, a name and a newline */
+  for (i = 0; i < n; i++)
+    len += strlen(graph_name(graph, changes[i].id)) + 2;
+  for (i = 0; i < (int)degree; i++)
+    len += strlen(graph_name(graph, friends[i])) + 2;
+  char *body = malloc(len + sizeof("delta\n")), *at = body;
+  at = stpcpy(at, (n < 0 ? "full\n" : "delta\n"));
+  for (i = 0; i < n; i++)
+    at += sprintf(at, "%c%s\n", (changes[i].added ? '+' : '-'),
+                  graph_name(graph, changes[i].id));
+  for (i = 0; i < (int)degree; i++)
+    at += sprintf(at, "+%s\n", graph_name(graph, friends[i]));
+  char *etag = friendsETag(user);
+  pthread_mutex_unlock(&mutex);
+
+  char *extra = append_strings("ETag: ", etag, "\r\n", NULL);
+  WriteResponseWith(fd, body, extra);
+
+  free(extra);
+  free(etag);
   free(body);
 }
 
+/*
+ * parseETag - the version in an ETag that this run of the server gave
+ *   out, quoted or not; returns 0 if it is not one
+ */
+static int parseETag(const char *etag, uint64_t *version_p)
+{
+  size_t boot_len = strlen(boot_id);
+  char *end;
+
+  if (!strncmp(etag, "W/", 2))
+    etag += 2;
+  if (*etag == '"')
+    etag++;
+  if (strncmp(etag, boot_id, boot_len) || etag[boot_len] != '-'
+      || !isdigit((unsigned char)etag[boot_len + 1]))
+    return 0;
+  *version_p = strtoull(etag + boot_len + 1, &end, 10);
+  return (*end == 0 || !strcmp(end, "\""));
+}
+
 /**
  * @brief Add friends to a user
  */
@@ -203,9 +849,13 @@ static void beFriends(int fd, dictionary_t *query)
   user = dictionary_get(query, "user");
   friends = dictionary_get(query, "friends");
 
-  pthread_mutex_lock(&mutex);
-  char *body = UpdateUserFriends(friends, user);
-  pthread_mutex_unlock(&mutex);
+  char *body = changeFriends(user, friends, 1);
+  if (body == NULL)
+  {
+    clienterror(fd, user, "503", "Service Unavailable",
+                "Friendlist could not complete the change for");
+    return;
+  }
   WriteResponse(fd, body);
 
   free(body);
@@ -213,33 +863,85 @@ static void beFriends(int fd, dictionary_t *query)
 
 /**
  * @brief Introduce a friend to another friend
+ *
+ * A friend list that is not in the peer cache is fetched
+ * asynchronously: the connection is parked, this thread is released,
+ * and resumeIntroduction() picks the connection up on one of the
+ * introduction workers once the peer has answered.
+ *
+ * @return 1 if the connection was parked, 0 if the response was written
  */
-static void introduceFriend(int fd, dictionary_t *query)
+static int introduceFriend(conn_t *conn, dictionary_t *query)
 {
   // Get info from query
   const char *user;
   char *friends;
   user = dictionary_get(query, "user");
   friends = dictionary_get(query, "friend");
-  char *host = dictionary_get(query, "host");
-  char *port = dictionary_get(query, "port");
+  const char *host = dictionary_get(query, "host");
+  const char *port = dictionary_get(query, "port");
 
-  // if the user is not registered in the dictionary
-  pthread_mutex_lock(&mutex);
-  dictionary_t *user_Friends_Dictionary = registerClient(AllClients, user);
-  pthread_mutex_unlock(&mutex);
-  char *FriFriends = getFriFriend(host, port, friends);
+  if (user == NULL || friends == NULL || host == NULL || port == NULL)
+  {
+    clienterror(conn->fd, "/introduce", "400", "Bad Request",
+                "Friendlist needs a user, friend, host and port for");
+    return 0;
+  }
+  int here = isThisServer(host, port);
+
+  // the friend's list is right here, so skip the loopback round-trip
+  if (here && cluster_enabled())
+  {
+    int owner = cluster_owner(friends);
+    if (owner == cluster_self())
+    {
+      pthread_mutex_lock(&mutex);
+      char *FriFriends = friendsBody(friends);
+      pthread_mutex_unlock(&mutex);
+      finishIntroduction(conn->fd, user, FriFriends);
+      free(FriFriends);
+      return 0;
+    }
+
+    // ask the node that owns the friend rather than ourselves
+    host = cluster_host(owner);
+    port = cluster_port(owner);
+  }
+  else if (here)
+  {
+    pthread_mutex_lock(&mutex);
+    char *body = (wal_failed() ? NULL : introduceLocally(user, friends));
+    pthread_mutex_unlock(&mutex);
+    if (body == NULL || wal_commit() < 0)
+    {
+      clienterror(conn->fd, user, "503", "Service Unavailable",
+                  "Friendlist could not complete the change for");
+      free(body);
+      return 0;
+    }
+    WriteResponse(conn->fd, body);
+    free(body);
+    return 0;
+  }
 
+  // if the user is not registered in the dictionary
   pthread_mutex_lock(&mutex);
-  UpdateUserFriends(FriFriends, user);
+  registerClient(AllClients, user);
   pthread_mutex_unlock(&mutex);
 
-  char *body = getBody(user_Friends_Dictionary);
-
-  WriteResponse(fd, body);
+  introduction_t *intro = makeIntroduction(conn, user, host, port, friends);
+  char *FriFriends = peer_cache_lookup(intro->key, &intro->etag);
+  if (FriFriends != NULL)
+  {
+    finishIntroduction(conn->fd, user, FriFriends);
+    free(FriFriends);
+    freeIntroduction(intro);
+    return 0;
+  }
 
-  free(FriFriends);
-  free(body);
+  if (!joinIntroduction(intro))
+    startIntroduction(intro);
+  return 1;
 }
 
 /**
@@ -251,31 +953,14 @@ static void unFriend(int fd, dictionary_t *query)
   char *friends;
   user = dictionary_get(query, "user");
   friends = dictionary_get(query, "friends");
-  char **friends_array = split_string(friends, '\n');
 
-  pthread_mutex_lock(&mutex);
-  dictionary_t *user_Friends_Dictionary = registerClient(AllClients, user);
-  int count = 0;
-  while (friends_array[count] != NULL)
+  char *body = changeFriends(user, friends, 0);
+  if (body == NULL)
   {
-    const char *current_Friend = friends_array[count];
-    for (int i = 0; i < dictionary_count(user_Friends_Dictionary); i++)
-    {
-      if (strcmp(dictionary_key(user_Friends_Dictionary, i), current_Friend) == 0)
-      {
-        dictionary_remove(user_Friends_Dictionary, current_Friend);
-
-        dictionary_t *friend_Friends = dictionary_get(AllClients, current_Friend);
-        dictionary_remove(friend_Friends, user);
-      }
-    }
-
-    count++;
+    clienterror(fd, user, "503", "Service Unavailable",
+                "Friendlist could not complete the change for");
+    return;
   }
-  pthread_mutex_unlock(&mutex);
-
-  char *body = getBody(user_Friends_Dictionary);
-
   WriteResponse(fd, body);
 
   free(body);
@@ -291,9 +976,13 @@ static void unFriend(int fd, dictionary_t *query)
  */
 static dictionary_t *registerClient(dictionary_t *query, const char *user)
 {
-  if (dictionary_get(query, user) == NULL)
+  if (lookupClient(user) == NULL)
   {
     dictionary_set(query, user, make_dictionary(COMPARE_CASE_SENS, free));
+    trie_insert(registered, user);
+    noteChanged(user);
+    // counted by /stats even while the user has no friends
+    graph_add(graph, user);
   }
 
   dictionary_t *user_Friends_Dictionary = dictionary_get(AllClients, user);
@@ -304,10 +993,19 @@ static dictionary_t *registerClient(dictionary_t *query, const char *user)
  * @brief Write the response to the client
  */
 static void WriteResponse(int fd, char *body)
+{
+  WriteResponseWith(fd, body, NULL);
+}
+
+/**
+ * @brief Write the response to the client, with `extra_headers` (if not
+ * NULL) being complete "\r\n"-terminated header lines to add
+ */
+static void WriteResponseWith(int fd, char *body, const char *extra_headers)
 {
   size_t len = strlen(body);
   /* Send response headers to client */
-  char *header = ok_header(len, "text/html; charset=utf-8");
+  char *header = ok_header(len, "text/html; charset=utf-8", extra_headers);
   Rio_writen(fd, header, strlen(header));
   printf("Response headers:\n");
   printf("%s", header);
@@ -318,6 +1016,25 @@ static void WriteResponse(int fd, char *body)
   Rio_writen(fd, body, len);
 }
 
+/**
+ * @brief Tell the client that what it has under `etag` is still current
+ */
+static void notModified(int fd, const char *etag)
+{
+  char *header = append_strings("HTTP/1.1 304 Not Modified\r\n",
+                                "Server: Friendlist Web Server\r\n",
+                                (keep_alive ? "Connection: keep-alive\r\n"
+                                            : "Connection: close\r\n"),
+                                "Content-length: 0\r\n",
+                                "ETag: ", etag, "\r\n\r\n",
+                                NULL);
+  Rio_writen(fd, header, strlen(header));
+  printf("Response headers:\n");
+  printf("%s", header);
+
+  free(header);
+}
+
 /**
  * @brief Update the friends of a user
  *
@@ -332,22 +1049,12 @@ static char *UpdateUserFriends(char *newFriends, const char *user)
   int count = 0;
   while (friends_array[count] != NULL)
   {
-    if (strcmp(friends_array[count], user) == 0)
-    {
-      count++;
-      continue;
-    }
-    const char *current_Friend = friends_array[count];
-    dictionary_set(user_Friends_Dictionary, current_Friend, NULL);
-
-    // if the friend is not registered in the dictionary
-    registerClient(AllClients, current_Friend);
-
-    dictionary_t *friend_Friends = dictionary_get(AllClients, current_Friend);
-    dictionary_set(friend_Friends, user, NULL);
-
+    if (strcmp(friends_array[count], user) != 0)
+      addFriendship(user, friends_array[count]);
+    free(friends_array[count]);
     count++;
   }
+  free(friends_array);
 
   char *body = getBody(user_Friends_Dictionary);
 
@@ -355,64 +1062,1891 @@ static char *UpdateUserFriends(char *newFriends, const char *user)
 }
 
 /**
- * @brief Get the friends of a friend
- *
- * @param host: the host of the friend
- * @param port: the port of the friend
- * @param friends: the friend
- *
- * @return the friends of the friend
- *
+ * @brief Record a friendship in both users' friend lists; must be
+ * called with the mutex held
  */
-static char *getFriFriend(char *host, char *port, char *friends)
+static void addFriendship(const char *user, const char *friend)
 {
-  int connection_fd = open_clientfd(host, port);
-  char *friend_encode = query_encode(friends);
-  char http_request[MAXLINE];
-  sprintf(http_request, "GET /friends?user=%s HTTP/1.0\r\n\r\n", friend_encode);
-  rio_writen(connection_fd, http_request, strlen(http_request));
+  linkFriend(user, friend);
 
-  char buf[MAXLINE];
-  rio_t rio;
-  Rio_readinitb(&rio, connection_fd);
-  Rio_readlineb(&rio, buf, MAXLINE); 
-  dictionary_t *response = read_requesthdrs(&rio);
-  parse_header_line(buf, response);
-  char *content_length_str = dictionary_get(response, "Content-Length");
-  int content_length = atoi(content_length_str);
-
-  char *content = malloc(content_length + 1);
-  rio_readnb(&rio, content, content_length);
-  content[content_length] = 0;
-  close(connection_fd);
+  // if the friend is not registered in the dictionary
+  linkFriend(friend, user);
+}
 
-  free(friend_encode);
-  free(content_length_str);
+/**
+ * @brief Remove the friends of a user
+ *
+ * @param oldFriends: the friends that the user wants to remove
+ * @param user: the user that wants to remove them
+ */
+static char *RemoveUserFriends(char *oldFriends, const char *user)
+{
+  dictionary_t *user_Friends_Dictionary = registerClient(AllClients, user);
+  char **friends_array = split_string(oldFriends, '\n');
+
+  int count = 0;
+  while (friends_array[count] != NULL)
+  {
+    if (strcmp(friends_array[count], user) != 0)
+      removeFriendship(user, friends_array[count]);
+    free(friends_array[count]);
+    count++;
+  }
+  free(friends_array);
 
-  return content;
+  return getBody(user_Friends_Dictionary);
 }
 
-static char *getBody(dictionary_t *user_Friends_Dictionary)
+/**
+ * @brief Remove a friendship from both users' friend lists; must be
+ * called with the mutex held
+ */
+static void removeFriendship(const char *user, const char *friend)
 {
-  char *body = join_strings(dictionary_keys(user_Friends_Dictionary), '\n');
-  return body;
+  unlinkFriend(user, friend);
+  unlinkFriend(friend, user);
 }
 
-/*
- * read_requesthdrs - read HTTP request headers
+/**
+ * @brief Add one half of a friendship: `friend` in `user`'s list; must
+ * be called with the mutex held
  */
-dictionary_t *read_requesthdrs(rio_t *rp)
+static void linkFriend(const char *user, const char *friend)
+{
+  dictionary_set(registerClient(AllClients, user), friend, NULL);
+  noteChanged(user);
+  graph_link(graph, user, friend);
+  wal_append(1, user, friend);
+  replication_log(1, user, friend);
+}
+
+/**
+ * @brief Remove `friend` from `user`'s list, if it is there; must be
+ * called with the mutex held
+ */
+static void unlinkFriend(const char *user, const char *friend)
+{
+  dictionary_t *user_Friends_Dictionary = lookupClient(user);
+
+  if (user_Friends_Dictionary != NULL)
+    dictionary_remove(user_Friends_Dictionary, friend);
+  noteChanged(user);
+  graph_unlink(graph, user, friend);
+  wal_append(0, user, friend);
+  replication_log(0, user, friend);
+}
+
+/**
+ * @brief Add (or remove) friendships between a user and each of a
+ * newline-separated list of friends
+ *
+ * In cluster mode the two halves of each friendship can belong to
+ * different nodes, so the change runs as a cluster transaction, which
+ * must not hold the mutex while it waits on other nodes.
+ *
+ * @return the user's new friend list, or NULL if the cluster could not
+ * agree on the change or it could not be logged
+ */
+static char *changeFriends(const char *user, char *friends, int adding)
+{
+  char *body;
+
+  if (cluster_enabled())
+  {
+    // this node's own halves could not be logged
+    if (wal_failed())
+      return NULL;
+    char **friends_array = split_string(friends, '\n');
+    int rc = cluster_update(user, friends_array, adding);
+
+    for (int i = 0; friends_array[i] != NULL; i++)
+      free(friends_array[i]);
+    free(friends_array);
+    if (rc != 0)
+      return NULL;
+
+    pthread_mutex_lock(&mutex);
+    body = getBody(registerClient(AllClients, user));
+    pthread_mutex_unlock(&mutex);
+    return body;
+  }
+
+  pthread_mutex_lock(&mutex);
+  // once the log has failed, refuse the change rather than make it
+  // without logging it
+  if (wal_failed())
+  {
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+  }
+  if (adding)
+    body = UpdateUserFriends(friends, user);
+  else
+    body = RemoveUserFriends(friends, user);
+  pthread_mutex_unlock(&mutex);
+
+  // don't acknowledge the change before it is durable
+  if (wal_commit() < 0)
+  {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
+
+/**
+ * @brief Apply this node's halves of a committed cluster transaction
+ */
+static void applyClusterOps(cluster_op_t *ops, int count)
+{
+  pthread_mutex_lock(&mutex);
+  for (int i = 0; i < count; i++)
+  {
+    if (ops[i].adding)
+      linkFriend(ops[i].user, ops[i].friend);
+    else
+      unlinkFriend(ops[i].user, ops[i].friend);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  // the coordinator has already committed; all we can do is complain
+  if (wal_commit() < 0)
+    fprintf(stderr, "cluster changes applied but not logged\n");
+}
+
+/**
+ * @brief Pass a request about a user that another node owns on to that
+ * node, and relay its answer
+ *
+ * Forwarded requests are marked, and a
+ * marked request is always served where it lands, so nodes with
+ * different ideas of the ring cannot bounce a request between them.
+ *
+ * @return 1 if the request was forwarded, 0 if it belongs here
+ */
+static int forwardRequest(int fd, const char *uri, dictionary_t *headers,
+                          dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  int owner;
+
+  if (!cluster_enabled() || user == NULL
+      || dictionary_get(headers, "X-Friendlist-Forwarded") != NULL)
+    return 0;
+  owner = cluster_owner(user);
+  if (owner == cluster_self())
+    return 0;
+
+  relayRequest(fd, cluster_host(owner), cluster_port(owner), uri, headers, query);
+  return 1;
+}
+
+/**
+ * @brief Send a request on to another server and relay its answer
+ *
+ * The arguments travel as a form body, so a long friend list is never
+ * squeezed into a request line.
+ */
+static void relayRequest(int fd, const char *host, const char *port,
+                         const char *uri, dictionary_t *headers,
+                         dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  peer_response_t resp;
+
+  const char *if_none_match = dictionary_get(headers, "If-None-Match");
+  char *path = strndup(uri, strcspn(uri, "?"));
+  char *body = encodeQuery(query);
+  char *request_headers = append_strings("Content-Type: application/x-www-form-urlencoded\r\n"
+                                         "X-Friendlist-Forwarded: 1\r\n",
+                                         (if_none_match ? "If-None-Match: " : ""),
+                                         (if_none_match ? if_none_match : ""),
+                                         (if_none_match ? "\r\n" : ""), NULL);
+  if (peer_request(host, port, "POST", path, request_headers, body, strlen(body),
+                   &resp) < 0)
+    clienterror(fd, host, "502", "Bad Gateway",
+                "Friendlist could not reach the server that owns the data");
+  else
+  {
+    const char *etag = dictionary_get(resp.headers, "ETag");
+    const char *cursor = dictionary_get(resp.headers, "X-Friendlist-Next-Cursor");
+    if (resp.status == 200)
+    {
+      char *extra = append_strings((etag ? "ETag: " : ""), (etag ? etag : ""),
+                                   (etag ? "\r\n" : ""),
+                                   (cursor ? "X-Friendlist-Next-Cursor: " : ""),
+                                   (cursor ? cursor : ""), (cursor ? "\r\n" : ""),
+                                   NULL);
+      WriteResponseWith(fd, resp.body, extra);
+      free(extra);
+    }
+    else if (resp.status == 304 && etag != NULL)
+      notModified(fd, etag);
+    else if (resp.status == 503)
+      clienterror(fd, user, "503", "Service Unavailable",
+                  "Friendlist could not complete the change for");
+    else
+      clienterror(fd, user, "502", "Bad Gateway",
+                  "The server that owns the data failed the request for");
+    peer_response_free(&resp);
+  }
+
+  free(request_headers);
+  free(path);
+  free(body);
+}
+
+static char *encodeQuery(dictionary_t *query)
+{
+  char *body = strdup("");
+
+  for (size_t i = 0; i < dictionary_count(query); i++)
+  {
+    char *key = query_encode(dictionary_key(query, i));
+    char *value = query_encode(dictionary_value(query, i));
+    char *old = body;
+    body = append_strings(old, (i > 0 ? "&" : ""), key, "=", value, NULL);
+    free(old);
+    free(key);
+    free(value);
+  }
+
+  return body;
+}
+
+/**
+ * @brief Handle a transaction message from the node coordinating it
+ */
+static void clusterRequest(int fd, char *uri, dictionary_t *query)
+{
+  const char *tx = dictionary_get(query, "tx");
+  const char *ops = dictionary_get(query, "ops");
+
+  if (!cluster_enabled() || tx == NULL)
+  {
+    clienterror(fd, uri, "400", "Bad Request",
+                "Friendlist is not part of a cluster or got no transaction");
+    return;
+  }
+
+  if (starts_with("/cluster/prepare", uri))
+  {
+    if (wal_failed())
+    {
+      clienterror(fd, tx, "503", "Service Unavailable",
+                  "Friendlist cannot log changes, so it refuses");
+      return;
+    }
+    int result = (ops ? cluster_prepare(tx, ops) : CLUSTER_INVALID);
+    if (result == CLUSTER_PREPARED)
+      WriteResponse(fd, "prepared");
+    else if (result == CLUSTER_CONFLICT)
+      clienterror(fd, tx, "409", "Conflict",
+                  "Another transaction holds a user changed by");
+    else
+      clienterror(fd, tx, "400", "Bad Request",
+                  "Friendlist could not parse the operations of");
+  }
+  else if (starts_with("/cluster/commit", uri))
+  {
+    if (cluster_commit(tx) == 0)
+      WriteResponse(fd, "committed");
+    else
+      clienterror(fd, tx, "404", "Not Found",
+                  "Friendlist has no prepared transaction");
+  }
+  else if (starts_with("/cluster/abort", uri))
+  {
+    cluster_abort(tx);
+    WriteResponse(fd, "aborted");
+  }
+  else if (starts_with("/cluster/outcome", uri))
+  {
+    int outcome = cluster_outcome(tx);
+    WriteResponse(fd, (outcome == CLUSTER_COMMITTED ? "commit\n"
+                       : outcome == CLUSTER_ABORTED ? "abort\n" : "pending\n"));
+  }
+  else
+    clienterror(fd, uri, "404", "Not Found",
+                "Friendlist has no such cluster operation");
+}
+
+static int isWriteRequest(char *uri)
+{
+  return (starts_with("/befriend", uri) || starts_with("/unfriend", uri)
+          || starts_with("/introduce", uri));
+}
+
+/**
+ * @brief Report every half friendship to a new replica, and mark where
+ * in the change log the snapshot stands
+ *
+ * As for /export, the lock is held only to mark the log and copy out
+ * the users changed since the last snapshot, so writers go on while
+ * the replica is sent the rest.
+ */
+static void snapshotGraph(replication_add_t add, void *ctx, unsigned long *seq_p)
+{
+  snapshot_t *snap;
+  size_t count, j = 0;
+  exported_t *changed = pinGraph(&snap, &count, seq_p);
+  long users = (snap ? snapshot_count(snap) : 0), i = 0;
+
+  /* The snapshot's users and the changed ones, in name order; a
+     changed user supersedes the snapshot's entry */
+  while (i < users || j < count)
+  {
+    int c = (i == users ? 1 : j == count ? -1
+                                         : strcmp(snapshot_name(snap, i),
+                                                  changed[j].user));
+    if (c < 0)
+    {
+      const char *user = snapshot_name(snap, i);
+      const uint32_t *friends;
+      uint32_t degree = snapshot_friends(snap, i, &friends);
+      for (uint32_t k = 0; k < degree; k++)
+        add(ctx, user, snapshot_name(snap, friends[k]));
+    }
+    else
+    {
+      for (size_t k = 0; k < changed[j].count; k++)
+        add(ctx, changed[j].user, changed[j].friends[k]);
+    }
+    if (c <= 0)
+      i++;
+    if (c >= 0)
+      j++;
+  }
+
+  freeExported(changed, count);
+  if (snap)
+    snapshot_close(snap);
+}
+
+/**
+ * @brief Apply changes streamed from the primary; a snapshot replaces
+ * the whole graph
+ */
+static void applyReplicated(int reset, replication_op_t *ops, int count)
+{
+  pthread_mutex_lock(&mutex);
+  if (reset)
+  {
+    free_dictionary(AllClients);
+    AllClients = make_dictionary(COMPARE_CASE_SENS, freeClient);
+    rebuildGraph(0);
+    replication_reset();
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (ops[i].adding)
+      linkFriend(ops[i].user, ops[i].friend);
+    else
+      unlinkFriend(ops[i].user, ops[i].friend);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Stream changes to a replica (/replicate), or report this
+ * server's replication state (/replication)
+ */
+static void replicationRequest(int fd, char *uri, dictionary_t *query)
+{
+  if (starts_with("/replicate", uri))
+  {
+    const char *from = dictionary_get(query, "from");
+    const char *epoch = dictionary_get(query, "epoch");
+
+    replication_serve(fd, epoch, (from ? strtoul(from, NULL, 10) : 0));
+    keep_alive = 0;
+  }
+  else
+  {
+    char *body = replication_status();
+    WriteResponse(fd, body);
+    free(body);
+  }
+}
+
+/**
+ * @brief Find a user's friend list, copying it out of the snapshot the
+ * first time it is needed for a change; must be called with the mutex
+ * held
+ *
+ * @return the dictionary of the user, or NULL if the user is unknown
+ */
+static dictionary_t *lookupClient(const char *user)
+{
+  dictionary_t *user_Friends_Dictionary = dictionary_get(AllClients, user);
+  long i;
+
+  if (user_Friends_Dictionary == NULL && base != NULL
+      && (i = snapshot_find(base, user)) >= 0)
+  {
+    const uint32_t *friends;
+    uint32_t degree = snapshot_friends(base, i, &friends);
+
+    user_Friends_Dictionary = make_dictionary(COMPARE_CASE_SENS, free);
+    for (uint32_t j = 0; j < degree; j++)
+      dictionary_set(user_Friends_Dictionary, snapshot_name(base, friends[j]), NULL);
+    dictionary_set(AllClients, user, user_Friends_Dictionary);
+  }
+
+  return user_Friends_Dictionary;
+}
+
+/**
+ * @brief Free one user's friend list; AllClients' free_value, so that
+ * resetting AllClients frees every user's friends too
+ */
+static void freeClient(void *user_Friends_Dictionary)
+{
+  free_dictionary(user_Friends_Dictionary);
+}
+
+/**
+ * @brief Build a user's friend list for a response, reading the
+ * snapshot in place for a user that has not changed since it was
+ * written; must be called with the mutex held
+ */
+static char *friendsBody(const char *user)
+{
+  dictionary_t *user_Friends_Dictionary = dictionary_get(AllClients, user);
+  long i;
+
+  if (user_Friends_Dictionary == NULL && base != NULL
+      && (i = snapshot_find(base, user)) >= 0)
+  {
+    const uint32_t *friends;
+    uint32_t degree = snapshot_friends(base, i, &friends);
+    const char **names = malloc((degree + 1) * sizeof(char *));
+
+    for (uint32_t j = 0; j < degree; j++)
+      names[j] = snapshot_name(base, friends[j]);
+    names[degree] = NULL;
+    char *body = join_strings(names, '\n');
+    free(names);
+    return body;
+  }
+
+  return getBody(registerClient(AllClients, user));
+}
+
+static int compareNames(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * @brief Report every user with the user's friends: first the users
+ * held in AllClients, then the snapshot's users that have not changed;
+ * must be called with the mutex held
+ */
+static void walkGraph(void *walk_arg, snapshot_emit_t emit, void *ctx)
+{
+  size_t count = dictionary_count(AllClients);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    dictionary_t *user_Friends_Dictionary = dictionary_value(AllClients, i);
+    const char **keys = dictionary_keys(user_Friends_Dictionary);
+    emit(ctx, dictionary_key(AllClients, i), keys,
+         dictionary_count(user_Friends_Dictionary));
+    free(keys);
+  }
+
+  if (base == NULL)
+    return;
+
+  // AllClients is a plain list, so sort its names once for lookups
+  const char **changed = dictionary_keys(AllClients);
+  qsort(changed, count, sizeof(char *), compareNames);
+
+  for (long i = 0; i < snapshot_count(base); i++)
+  {
+    const char *user = snapshot_name(base, i);
+    if (bsearch(&user, changed, count, sizeof(char *), compareNames) != NULL)
+      continue;
+
+    const uint32_t *friends;
+    uint32_t degree = snapshot_friends(base, i, &friends);
+    const char **names = malloc((degree + 1) * sizeof(char *));
+    for (uint32_t j = 0; j < degree; j++)
+      names[j] = snapshot_name(base, friends[j]);
+    emit(ctx, user, names, degree);
+    free(names);
+  }
+  free(changed);
+}
+
+/**
+ * @brief Write the whole graph to a new snapshot and start over from
+ * it (/compact)
+ *
+ * The snapshot is written by a forked child, as for /bgsave, and this
+ * waits for it; changes go on meanwhile, and only those made since the
+ * fork stay in AllClients and the write-ahead log.
+ */
+static void compactGraph(int fd)
+{
+  struct timeval start, end;
+
+  if (snapshot_path == NULL)
+  {
+    clienterror(fd, "/compact", "400", "Bad Request",
+                "Friendlist was started without a snapshot file (-s) for");
+    return;
+  }
+
+  gettimeofday(&start, NULL);
+  pthread_mutex_lock(&mutex);
+  if (saving)
+  {
+    pthread_mutex_unlock(&mutex);
+    clienterror(fd, "/compact", "409", "Conflict",
+                "A background snapshot is still being written for");
+    return;
+  }
+  long users = 0, ticket = saves;
+  int ok = startSave();
+  if (ok)
+  {
+    while (saves == ticket)
+      pthread_cond_wait(&saved, &mutex);
+    ok = last_save.ok;
+    users = (base ? snapshot_count(base) : 0);
+  }
+  pthread_mutex_unlock(&mutex);
+  gettimeofday(&end, NULL);
+
+  if (!ok)
+  {
+    clienterror(fd, snapshot_path, "500", "Internal Server Error",
+                "Friendlist could not write the snapshot");
+    return;
+  }
+
+  char buf[MAXLINE];
+  snprintf(buf, sizeof(buf), "users %ld\nmillis %ld\n", users,
+           (end.tv_sec - start.tv_sec) * 1000L
+               + (end.tv_usec - start.tv_usec) / 1000);
+  WriteResponse(fd, buf);
+}
+
+/**
+ * @brief Start writing the graph to the snapshot file from a forked
+ * child, so requests go on being served meanwhile (/bgsave)
+ */
+static void saveGraph(int fd)
+{
+  if (snapshot_path == NULL)
+  {
+    clienterror(fd, "/bgsave", "400", "Bad Request",
+                "Friendlist was started without a snapshot file (-s) for");
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  int busy = saving, started = (!busy && startSave());
+  pthread_mutex_unlock(&mutex);
+
+  if (busy)
+    clienterror(fd, "/bgsave", "409", "Conflict",
+                "A background snapshot is already being written for");
+  else if (!started)
+    clienterror(fd, snapshot_path, "500", "Internal Server Error",
+                "Friendlist could not start writing the snapshot");
+  else
+    snapshotStatus(fd);
+}
+
+/**
+ * @brief Whether a user changed after the save forked; `arg` holds the
+ * sorted names of those who did and their count
+ */
+static int changedSinceFork(const char *user, void *user_Friends_Dictionary,
+                            void *arg)
+{
+  void **args = arg;
+  const char **changed = args[0];
+  size_t count = *(size_t *)args[1];
+
+  return (bsearch(&user, changed, count, sizeof(char *), compareNames) != NULL);
+}
+
+/**
+ * @brief Fork a child that writes the graph to the snapshot file; must
+ * be called with the mutex held and no save running
+ *
+ * @return 1 if the child was started, 0 otherwise
+ */
+static int startSave(void)
+{
+  save_mark = wal_mark();
+  save_resets = wal_failed();
+  if (snapshot_background(snapshot_path, walkGraph, NULL, finishSave, NULL) < 0)
+    return 0;
+  saving = 1;
+  changed_since_fork = make_dictionary(COMPARE_CASE_SENS, NULL);
+  return 1;
+}
+
+/**
+ * @brief Switch to the snapshot a background save wrote, and drop the
+ * changes it holds from the write-ahead log
+ *
+ * Users who have not changed since the fork are in the new snapshot
+ * just as they are now, so they are dropped from AllClients; those who
+ * have changed stay there. The rebuilt index keeps every user's
+ * version, so ETags and change logs carry on.
+ */
+static void finishSave(snapshot_stats_t *stats, void *done_arg)
+{
+  pthread_mutex_lock(&mutex);
+  if (stats->ok)
+  {
+    snapshot_t *fresh = snapshot_open(snapshot_path);
+    if (fresh != NULL)
+    {
+      if (base != NULL)
+        snapshot_close(base);
+      base = fresh;
+      // sorted once, so pruning is one pass over AllClients
+      size_t count = dictionary_count(changed_since_fork);
+      const char **changed = dictionary_keys(changed_since_fork);
+      void *args[2] = {changed, &count};
+      qsort(changed, count, sizeof(char *), compareNames);
+      dictionary_filter(AllClients, changedSinceFork, args);
+      free(changed);
+      rebuildGraph(1);
+      // no change is taken once the log has failed, so the snapshot
+      // has everything and the log can start over empty
+      if ((save_resets ? wal_reset() : wal_trim(save_mark)) < 0)
+        fprintf(stderr, "could not trim the write-ahead log\n");
+    }
+    else
+      stats->ok = 0;
+  }
+  free_dictionary(changed_since_fork);
+  changed_since_fork = NULL;
+  if (!stats->ok)
+    fprintf(stderr, "background snapshot to %s failed\n", snapshot_path);
+  last_save = *stats;
+  saves++;
+  saving = 0;
+  pthread_cond_broadcast(&saved);
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Report whether a background snapshot is running, and how the
+ * last one went (/snapshot)
+ */
+static void snapshotStatus(int fd)
+{
+  char buf[MAXLINE];
+
+  pthread_mutex_lock(&mutex);
+  snprintf(buf, sizeof(buf),
+           "users %ld\nsaving %d\nsaves %ld\nlast_ok %d\nlast_fork_usec %ld\n"
+           "last_millis %ld\nlast_cow_kb %ld\n",
+           (base ? snapshot_count(base) : 0), saving, saves, last_save.ok,
+           last_save.fork_micros, last_save.millis, last_save.cow_kb);
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, buf);
+}
+
+static int compareExported(const void *a, const void *b)
+{
+  return strcmp(((const exported_t *)a)->user, ((const exported_t *)b)->user);
+}
+
+/*
+ * flushExport - send what an export has buffered, as one chunk when
+ *   the response is chunked
+ */
+static void flushExport(export_out_t *out)
+{
+  char size[32];
+
+  if (out->failed || out->len == 0)
+    return;
+  if (out->chunked)
+  {
+    int n = snprintf(size, sizeof(size), "%zx\r\n", out->len);
+    memcpy(out->data + out->len, "\r\n", 2);
+    if (rio_writen(out->fd, size, n) < 0
+        || rio_writen(out->fd, out->data, out->len + 2) < 0)
+      out->failed = 1;
+  }
+  else if (rio_writen(out->fd, out->data, out->len) < 0)
+    out->failed = 1;
+  out->len = 0;
+}
+
+/*
+ * exportEdge - add one friendship to an export; each is sent once,
+ *   from the user whose name sorts first
+ */
+static void exportEdge(export_out_t *out, const char *user, const char *friend)
+{
+  size_t user_len, friend_len;
+
+  if (strcmp(user, friend) >= 0)
+    return;
+  user_len = strlen(user);
+  friend_len = strlen(friend);
+  if (out->len + user_len + friend_len + 2 > EXPORT_CHUNK - 2)
+    flushExport(out);
+  if (user_len + friend_len + 2 > EXPORT_CHUNK - 2)
+    return;
+  memcpy(out->data + out->len, user, user_len);
+  out->data[out->len + user_len] = '\t';
+  memcpy(out->data + out->len + user_len + 1, friend, friend_len);
+  out->data[out->len + user_len + 1 + friend_len] = '\n';
+  out->len += user_len + friend_len + 2;
+}
+
+/**
+ * @brief Stream every friendship as "user<TAB>friend" lines (/export)
+ *
+ * The lock is held only to copy out the users changed since the last
+ * snapshot; the snapshot itself is immutable and read in place, so the
+ * export is consistent without stopping writers while it is sent.
+ */
+static void exportGraph(int fd, const char *version)
+{
+  snapshot_t *snap;
+  size_t count;
+  exported_t *changed = pinGraph(&snap, &count, NULL);
+
+  /* HTTP/1.0 has no chunks; the end of the export is the end of the
+     connection instead */
+  export_out_t *out = malloc(sizeof(export_out_t));
+  out->fd = fd;
+  out->chunked = !strcasecmp(version, "HTTP/1.1");
+  out->failed = 0;
+  out->len = 0;
+  if (!out->chunked)
+    keep_alive = 0;
+  char *header = append_strings(
+      "HTTP/1.1 200 OK\r\n", "Server: Friendlist Web Server\r\n",
+      (keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n"),
+      (out->chunked ? "Transfer-Encoding: chunked\r\n" : ""),
+      "Content-type: text/tab-separated-values; charset=utf-8\r\n\r\n", NULL);
+  if (rio_writen(fd, header, strlen(header)) < 0)
+    out->failed = 1;
+  free(header);
+
+  /* Merge the snapshot's users with the changed ones, in name order */
+  long users = (snap ? snapshot_count(snap) : 0), i = 0;
+  size_t j = 0;
+  while (!out->failed && (i < users || j < count))
+  {
+    int c = (i == users ? 1 : j == count ? -1
+                                         : strcmp(snapshot_name(snap, i),
+                                                  changed[j].user));
+    if (c < 0)
+    {
+      const char *user = snapshot_name(snap, i);
+      const uint32_t *friends;
+      uint32_t degree = snapshot_friends(snap, i, &friends);
+      for (uint32_t k = 0; k < degree; k++)
+        exportEdge(out, user, snapshot_name(snap, friends[k]));
+    }
+    else
+    {
+      for (size_t k = 0; k < changed[j].count; k++)
+        exportEdge(out, changed[j].user, changed[j].friends[k]);
+    }
+    if (c <= 0)
+      i++;
+    if (c >= 0)
+      j++;
+  }
+  flushExport(out);
+  if (out->chunked && !out->failed && rio_writen(fd, "0\r\n\r\n", 5) < 0)
+    out->failed = 1;
+  if (out->failed)
+    keep_alive = 0;
+
+  freeExported(changed, count);
+  free(out);
+  if (snap)
+    snapshot_close(snap);
+}
+
+/**
+ * @brief Take a consistent view of the graph that can be read without
+ * the lock: a reference to the snapshot (NULL without one) and a copy
+ * of the users changed since, sorted by name with their friends sorted
+ * too
+ *
+ * @param seq_p: if not NULL, set to replication_mark() as of the view
+ */
+static exported_t *pinGraph(snapshot_t **snap_p, size_t *count_p,
+                            unsigned long *seq_p)
+{
+  pthread_mutex_lock(&mutex);
+  snapshot_t *snap = (base ? snapshot_retain(base) : NULL);
+  size_t count = dictionary_count(AllClients);
+  exported_t *changed = malloc((count + 1) * sizeof(exported_t));
+  for (size_t i = 0; i < count; i++)
+  {
+    dictionary_t *user_Friends_Dictionary = dictionary_value(AllClients, i);
+    changed[i].user = strdup(dictionary_key(AllClients, i));
+    changed[i].count = dictionary_count(user_Friends_Dictionary);
+    changed[i].friends = malloc((changed[i].count + 1) * sizeof(char *));
+    for (size_t j = 0; j < changed[i].count; j++)
+      changed[i].friends[j] = strdup(dictionary_key(user_Friends_Dictionary, j));
+  }
+  if (seq_p)
+    *seq_p = replication_mark();
+  pthread_mutex_unlock(&mutex);
+
+  qsort(changed, count, sizeof(exported_t), compareExported);
+  for (size_t i = 0; i < count; i++)
+    qsort(changed[i].friends, changed[i].count, sizeof(char *), compareNames);
+
+  *snap_p = snap;
+  *count_p = count;
+  return changed;
+}
+
+static void freeExported(exported_t *changed, size_t count)
+{
+  for (size_t k = 0; k < count; k++)
+  {
+    for (size_t m = 0; m < changed[k].count; m++)
+      free(changed[k].friends[m]);
+    free(changed[k].friends);
+    free(changed[k].user);
+  }
+  free(changed);
+}
+
+/**
+ * @brief Rebuild the graph index, and the trie of users registered
+ * since the snapshot, from the snapshot and the users in AllClients;
+ * must be called with the mutex held
+ *
+ * @param carry: whether the friend lists are the same as before, so
+ * every user keeps the version (and change log) they had
+ */
+/**
+ * @brief Keep the /is-friend filter built, off the request path and a
+ * slice at a time, so the lock is never held for a whole build; until
+ * a filter is ready, /is-friend looks both users up
+ */
+static void *filterMain(void *arg)
+{
+  while (1)
+  {
+    pthread_mutex_lock(&mutex);
+    int more = graph_filter_step(graph, FILTER_SLICE);
+    pthread_mutex_unlock(&mutex);
+    if (!more)
+      usleep(FILTER_IDLE_USEC);
+  }
+  return NULL;
+}
+
+static void rebuildGraph(int carry)
+{
+  graph_t *old = graph;
+
+  graph = graph_make(base);
+  trie_free(registered);
+  registered = trie_make();
+  for (size_t i = 0; i < dictionary_count(AllClients); i++)
+    if (base == NULL || snapshot_find(base, dictionary_key(AllClients, i)) < 0)
+      trie_insert(registered, dictionary_key(AllClients, i));
+  for (size_t i = 0; i < dictionary_count(AllClients); i++)
+  {
+    dictionary_t *user_Friends_Dictionary = dictionary_value(AllClients, i);
+    const char **keys = dictionary_keys(user_Friends_Dictionary);
+    graph_replace(graph, dictionary_key(AllClients, i), keys,
+                  dictionary_count(user_Friends_Dictionary));
+    free(keys);
+  }
+  if (old != NULL)
+  {
+    if (carry)
+      graph_carry(graph, old);
+    graph_free(old);
+  }
+}
+
+/**
+ * @brief Remember that a user no longer matches the background
+ * snapshot being written, if there is one; must be called with the
+ * mutex held
+ */
+static void noteChanged(const char *user)
+{
+  if (changed_since_fork != NULL && dictionary_get(changed_since_fork, user) == NULL)
+    dictionary_set(changed_since_fork, user, (void *)1);
+}
+
+/**
+ * @brief Ask the cluster node that owns a user for the user's friends
+ *
+ * @return a NULL-terminated array of names, or NULL if the node could
+ * not be asked
+ */
+static char **fetchFriends(int owner, const char *user)
+{
+  peer_response_t resp;
+  char **friends = NULL;
+
+  char *enc = query_encode(user);
+  char *path = append_strings("/friends?user=", enc, NULL);
+  if (peer_request(cluster_host(owner), cluster_port(owner), "GET", path,
+                   "X-Friendlist-Forwarded: 1\r\n", NULL, 0, &resp) == 0)
+  {
+    if (resp.status == 200)
+      friends = split_string(resp.body, '\n');
+    peer_response_free(&resp);
+  }
+
+  free(path);
+  free(enc);
+  return friends;
+}
+
+/**
+ * @brief List the friends that two users have in common (/mutual)
+ *
+ * Both friend lists are sorted arrays of ids in the graph index, so
+ * this is one intersection of them. In a cluster the request is served
+ * by the node that owns `user`, which asks for the other user's list
+ * if it is kept elsewhere.
+ */
+static void mutualFriends(int fd, dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  const char *other = dictionary_get(query, "other");
+  char **remote = NULL;
+
+  if (user == NULL || other == NULL)
+  {
+    clienterror(fd, "/mutual", "400", "Bad Request",
+                "Friendlist needs a user and an other user for");
+    return;
+  }
+  if (cluster_enabled() && cluster_owner(other) != cluster_self())
+  {
+    remote = fetchFriends(cluster_owner(other), other);
+    if (remote == NULL)
+    {
+      clienterror(fd, other, "502", "Bad Gateway",
+                  "Friendlist could not reach the server that owns");
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&mutex);
+  const uint32_t *friends = NULL, *others = NULL;
+  uint32_t *remote_ids = NULL, count = 0, other_count = 0;
+  long id = graph_find(graph, user);
+  if (id >= 0)
+    count = graph_friends(graph, id, &friends);
+  if (remote != NULL)
+  {
+    size_t n = 0;
+    while (remote[n] != NULL)
+      n++;
+    remote_ids = malloc((n + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++)
+    {
+      long friend = graph_find(graph, remote[i]);
+      if (friend >= 0)
+        remote_ids[other_count++] = friend;
+    }
+    qsort(remote_ids, other_count, sizeof(uint32_t), compareIds);
+    others = remote_ids;
+  }
+  else if ((id = graph_find(graph, other)) >= 0)
+    other_count = graph_friends(graph, id, &others);
+
+  uint32_t *common = malloc(((count < other_count ? count : other_count) + 1)
+                            * sizeof(uint32_t));
+  size_t n = graph_intersect(friends, count, others, other_count, common);
+  const char **names = malloc((n + 1) * sizeof(char *));
+  for (size_t i = 0; i < n; i++)
+    names[i] = graph_name(graph, common[i]);
+  names[n] = NULL;
+  char *body = join_strings(names, '\n');
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, body);
+
+  free(body);
+  free(names);
+  free(common);
+  free(remote_ids);
+  if (remote != NULL)
+  {
+    for (size_t i = 0; remote[i] != NULL; i++)
+      free(remote[i]);
+    free(remote);
+  }
+}
+
+static int compareIds(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Suggest new friends for a user: the users who share the most
+ * friends with the user, one "name<TAB>mutual friends" line each
+ * (/suggest)
+ */
+static void suggestFriends(int fd, dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  const char *k_str = dictionary_get(query, "k");
+  int k = (k_str ? atoi(k_str) : SUGGEST_DEFAULT);
+
+  if (user == NULL)
+  {
+    clienterror(fd, "/suggest", "400", "Bad Request",
+                "Friendlist needs a user for");
+    return;
+  }
+  if (cluster_enabled())
+  {
+    // friends of friends are spread over the nodes
+    clienterror(fd, "/suggest", "501", "Not Implemented",
+                "Friendlist does not implement this in a cluster:");
+    return;
+  }
+  if (k < 1)
+    k = 1;
+  if (k > SUGGEST_MAX)
+    k = SUGGEST_MAX;
+
+  uint32_t *ids = malloc(k * sizeof(uint32_t));
+  uint32_t *mutuals = malloc(k * sizeof(uint32_t));
+  char *body = strdup("");
+
+  pthread_mutex_lock(&mutex);
+  long id = graph_find(graph, user);
+  int n = (id >= 0 ? graph_suggest(graph, id, k, ids, mutuals) : 0);
+  for (int i = 0; i < n; i++)
+  {
+    char *old = body, *count = to_string(mutuals[i]);
+    body = append_strings(old, graph_name(graph, ids[i]), "\t", count, "\n", NULL);
+    free(old);
+    free(count);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, body);
+
+  free(body);
+  free(ids);
+  free(mutuals);
+}
+
+/**
+ * @brief Find a shortest chain of friends from one user to another, and
+ * list it one user per line, from first to last (/distance)
+ */
+static void findDistance(int fd, dictionary_t *query)
+{
+  const char *from = dictionary_get(query, "from");
+  const char *to = dictionary_get(query, "to");
+  const char *max_str = dictionary_get(query, "max");
+  int max = (max_str ? atoi(max_str) : DISTANCE_DEFAULT);
+
+  if (from == NULL || to == NULL)
+  {
+    clienterror(fd, "/distance", "400", "Bad Request",
+                "Friendlist needs a from and a to user for");
+    return;
+  }
+  if (cluster_enabled())
+  {
+    // the search would cross every node
+    clienterror(fd, "/distance", "501", "Not Implemented",
+                "Friendlist does not implement this in a cluster:");
+    return;
+  }
+  if (max < 0)
+    max = 0;
+  if (max > DISTANCE_MAX)
+    max = DISTANCE_MAX;
+
+  uint32_t *path = malloc((max + 1) * sizeof(uint32_t));
+  const char **names = malloc((max + 2) * sizeof(char *));
+  char *body = NULL;
+
+  pthread_mutex_lock(&mutex);
+  long from_id = graph_find(graph, from), to_id = graph_find(graph, to);
+  int n = 0;
+  if (from_id >= 0 && to_id >= 0)
+    n = graph_path(graph, from_id, to_id, max, path);
+  if (n > 0)
+  {
+    for (int i = 0; i < n; i++)
+      names[i] = graph_name(graph, path[i]);
+    names[n] = NULL;
+    body = join_strings(names, '\n');
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (body == NULL)
+    clienterror(fd, to, "404", "Not Found",
+                "Friendlist found no chain of friends that short to");
+  else
+    WriteResponse(fd, body);
+
+  free(body);
+  free(names);
+  free(path);
+}
+
+/**
+ * @brief Report how many friends users have: totals, a histogram by
+ * powers of two, and the k most connected users (/stats)
+ */
+static void degreeStats(int fd, dictionary_t *query)
+{
+  const char *k_str = dictionary_get(query, "k");
+  int k = (k_str ? atoi(k_str) : STATS_TOP_DEFAULT);
+  graph_stats_t stats;
+  char line[MAXLINE];
+
+  if (k < 0)
+    k = 0;
+  if (k > STATS_TOP_MAX)
+    k = STATS_TOP_MAX;
+  if (cluster_enabled())
+  {
+    // each node only counts the users it owns
+    clienterror(fd, "/stats", "501", "Not Implemented",
+                "Friendlist does not implement this in a cluster:");
+    return;
+  }
+  uint32_t *ids = malloc((k + 1) * sizeof(uint32_t));
+  uint32_t *degrees = malloc((k + 1) * sizeof(uint32_t));
+
+  pthread_mutex_lock(&mutex);
+  graph_stats(graph, &stats);
+  snprintf(line, sizeof(line), "users %ld\nfriendships %ld\nmax_degree %u\n",
+           stats.users, stats.halves / 2, stats.max_degree);
+  char *body = strdup(line);
+  for (int i = 0; i < 33; i++)
+  {
+    if (stats.histogram[i] == 0)
+      continue;
+    if (i <= 1)
+      snprintf(line, sizeof(line), "degree %d %ld\n", i, stats.histogram[i]);
+    else
+      snprintf(line, sizeof(line), "degree %lu-%lu %ld\n", 1UL << (i - 1),
+               (1UL << i) - 1, stats.histogram[i]);
+    char *old = body;
+    body = append_strings(old, line, NULL);
+    free(old);
+  }
+  int n = graph_top(graph, k, ids, degrees);
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(line, sizeof(line), " %u\n", degrees[i]);
+    char *old = body;
+    body = append_strings(old, "top ", graph_name(graph, ids[i]), line, NULL);
+    free(old);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, body);
+
+  free(body);
+  free(ids);
+  free(degrees);
+}
+
+/**
+ * @brief Report which connected component a user is in, named by one
+ * of its users, and how many users it has (/component)
+ */
+static void userComponent(int fd, dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  char line[MAXLINE];
+
+  if (user == NULL)
+  {
+    clienterror(fd, "/component", "400", "Bad Request",
+                "Friendlist needs a user for");
+    return;
+  }
+  if (cluster_enabled())
+  {
+    // a component can span every node
+    clienterror(fd, "/component", "501", "Not Implemented",
+                "Friendlist does not implement this in a cluster:");
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  long id = graph_find(graph, user), size = 1;
+  const char *name = user;
+  if (id >= 0)
+    name = graph_name(graph, graph_component(graph, id, &size));
+  snprintf(line, sizeof(line), "\nsize %ld\n", size);
+  char *body = append_strings("component ", name, line, NULL);
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, body);
+
+  free(body);
+}
+
+/**
+ * @brief Answer "yes" if two users are joined by some chain of friends,
+ * and "no" otherwise (/same-component)
+ */
+static void sameComponent(int fd, dictionary_t *query)
+{
+  const char *a = dictionary_get(query, "a");
+  const char *b = dictionary_get(query, "b");
+  int same;
+
+  if (a == NULL || b == NULL)
+  {
+    clienterror(fd, "/same-component", "400", "Bad Request",
+                "Friendlist needs users a and b for");
+    return;
+  }
+  if (cluster_enabled())
+  {
+    // a component can span every node
+    clienterror(fd, "/same-component", "501", "Not Implemented",
+                "Friendlist does not implement this in a cluster:");
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  long a_id = graph_find(graph, a), b_id = graph_find(graph, b);
+  if (a_id >= 0 && b_id >= 0)
+    same = (graph_component(graph, a_id, NULL) == graph_component(graph, b_id, NULL));
+  else
+    same = !strcmp(a, b);
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, same ? "yes\n" : "no\n");
+}
+
+/**
+ * @brief Answer "yes" if one user has another as a friend, and "no"
+ * otherwise (/is-friend)
+ */
+static void isFriend(int fd, dictionary_t *query)
+{
+  const char *user = dictionary_get(query, "user");
+  const char *friend = dictionary_get(query, "friend");
+  int is_friend;
+
+  if (user == NULL || friend == NULL)
+  {
+    clienterror(fd, "/is-friend", "400", "Bad Request",
+                "Friendlist needs a user and a friend for");
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  is_friend = graph_is_friend(graph, user, friend);
+  pthread_mutex_unlock(&mutex);
+
+  WriteResponse(fd, is_friend ? "yes\n" : "no\n");
+}
+
+/**
+ * @brief List the users whose names start with a prefix, in order, one
+ * per line (/search); in a cluster, every node's users
+ */
+static void searchUsers(int fd, dictionary_t *headers, dictionary_t *query)
+{
+  const char *prefix = dictionary_get(query, "prefix");
+  const char *limit_str = dictionary_get(query, "limit");
+  int limit = (limit_str ? atoi(limit_str) : SEARCH_DEFAULT);
+
+  if (prefix == NULL)
+  {
+    clienterror(fd, "/search", "400", "Bad Request",
+                "Friendlist needs a prefix for");
+    return;
+  }
+  if (limit < 0)
+    limit = 0;
+  if (limit > SEARCH_MAX)
+    limit = SEARCH_MAX;
+
+  int nodes = 1, n = 0, found = 0;
+  if (cluster_enabled() && dictionary_get(headers, "X-Friendlist-Forwarded") == NULL)
+    nodes = cluster_size();
+  char **names = malloc((nodes * limit + 1) * sizeof(char *));
+  const char **newer = malloc((limit + 1) * sizeof(char *));
+  size_t len = strlen(prefix);
+
+  /* Merge the snapshot's names with the newer ones; a user can be in
+     both after a background save */
+  pthread_mutex_lock(&mutex);
+  int count = trie_search(registered, prefix, limit, newer), j = 0;
+  long i = (base != NULL ? snapshot_lower_bound(base, prefix) : 0);
+  long end = (base != NULL ? snapshot_count(base) : 0);
+  while (found < limit)
+  {
+    const char *name = NULL;
+    if (i < end && strncmp(snapshot_name(base, i), prefix, len) != 0)
+      i = end;
+    if (i < end && (j == count || strcmp(snapshot_name(base, i), newer[j]) <= 0))
+    {
+      name = snapshot_name(base, i++);
+      if (j < count && !strcmp(name, newer[j]))
+        j++;
+    }
+    else if (j < count)
+      name = newer[j++];
+    else
+      break;
+    names[found++] = strdup(name);
+  }
+  pthread_mutex_unlock(&mutex);
+  n = found;
+
+  /* Ask every other node for its own */
+  for (int node = 0; nodes > 1 && node < nodes; node++)
+  {
+    peer_response_t resp;
+    if (node == cluster_self())
+      continue;
+    char *enc = query_encode(prefix), *lim = to_string(limit);
+    char *path = append_strings("/search?prefix=", enc, "&limit=", lim, NULL);
+    if (peer_request(cluster_host(node), cluster_port(node), "GET", path,
+                     "X-Friendlist-Forwarded: 1\r\n", NULL, 0, &resp) == 0)
+    {
+      if (resp.status == 200)
+      {
+        char **theirs = split_string(resp.body, '\n');
+        for (int k = 0; theirs[k] != NULL; k++)
+        {
+          if (theirs[k][0] != 0 && n < nodes * limit)
+            names[n++] = theirs[k];
+          else
+            free(theirs[k]);
+        }
+        free(theirs);
+      }
+      peer_response_free(&resp);
+    }
+    free(path);
+    free(lim);
+    free(enc);
+  }
+  if (nodes > 1)
+  {
+    /* A node may also know users it does not own */
+    qsort(names, n, sizeof(char *), compareNames);
+    int kept = 0;
+    for (int k = 0; k < n; k++)
+    {
+      if (kept > 0 && !strcmp(names[k], names[kept - 1]))
+        free(names[k]);
+      else
+        names[kept++] = names[k];
+    }
+    n = kept;
+  }
+  if (n > limit)
+  {
+    for (int k = limit; k < n; k++)
+      free(names[k]);
+    n = limit;
+  }
+  names[n] = NULL;
+
+  char *body = join_strings((const char *const *)names, '\n');
+  WriteResponse(fd, body);
+
+  free(body);
+  for (int k = 0; k < n; k++)
+    free(names[k]);
+  free(names);
+  free(newer);
+}
+
+/**
+ * @brief Apply a change replayed from the write-ahead log at startup
+ */
+static void replayChange(int adding, const char *user, const char *friend)
+{
+  pthread_mutex_lock(&mutex);
+  if (adding)
+    linkFriend(user, friend);
+  else
+    unlinkFriend(user, friend);
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Become a read replica of the server at primary ("host:port")
+ */
+static void followPrimary(const char *primary)
+{
+  const char *colon = strrchr(primary, ':');
+
+  if (colon == NULL || colon == primary || colon[1] == 0)
+  {
+    fprintf(stderr, "bad primary address: %s\n", primary);
+    exit(1);
+  }
+  char *host = strndup(primary, colon - primary);
+  replication_follow(host, colon + 1, applyReplicated);
+  free(host);
+}
+
+/**
+ * @brief Enter cluster mode, finding this server in the node list by
+ * its port and addresses
+ */
+static void joinCluster(const char *nodes)
+{
+  int count = cluster_configure(nodes, applyClusterOps);
+
+  if (count < 0)
+  {
+    fprintf(stderr, "bad cluster node list: %s\n", nodes);
+    exit(1);
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (isThisServer(cluster_host(i), cluster_port(i)))
+    {
+      cluster_set_self(i);
+      return;
+    }
+  }
+
+  fprintf(stderr, "this server (port %s) is not in the cluster: %s\n",
+          listen_port, nodes);
+  exit(1);
+}
+
+/**
+ * @brief Check whether host:port names this server
+ *
+ * The port is compared first, so an introduction to another server
+ * usually costs no name resolution at all. We listen on every
+ * interface, so any loopback or interface address counts as ours.
+ */
+static int isThisServer(const char *host, const char *port)
+{
+  struct addrinfo *listp, *p;
+  int found = 0;
+
+  if (atoi(port) != atoi(listen_port))
+    return 0;
+
+  if (resolver_lookup(host, port, &listp) != 0)
+    return 0;
+
+  for (p = listp; p && !found; p = p->ai_next)
+    found = isLocalAddress(p->ai_addr);
+
+  free(listp);
+  return found;
+}
+
+static int isLocalAddress(const struct sockaddr *addr)
+{
+  struct ifaddrs *ifa;
+
+  if (addr->sa_family == AF_INET)
+  {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    if ((ntohl(in->sin_addr.s_addr) >> 24) == 127)
+      return 1;
+  }
+  else if (addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    if (IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr))
+      return 1;
+  }
+  else
+    return 0;
+
+  for (ifa = local_addrs; ifa; ifa = ifa->ifa_next)
+  {
+    if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != addr->sa_family)
+      continue;
+    if (addr->sa_family == AF_INET
+        && ((const struct sockaddr_in *)addr)->sin_addr.s_addr
+           == ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr)
+      return 1;
+    if (addr->sa_family == AF_INET6
+        && !memcmp(&((const struct sockaddr_in6 *)addr)->sin6_addr,
+                   &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr,
+                   sizeof(struct in6_addr)))
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Introduce a user to the friends of a friend on this server;
+ * must be called with the mutex held
+ *
+ * @return the user's new friend list
+ */
+static char *introduceLocally(const char *user, const char *friend)
+{
+  dictionary_t *user_Friends_Dictionary = registerClient(AllClients, user);
+
+  // a peer's /friends would register the friend too
+  dictionary_t *friend_Friends = registerClient(AllClients, friend);
+
+  // adding friendships never removes keys, so these stay valid
+  const char **keys = dictionary_keys(friend_Friends);
+  for (int i = 0; keys[i] != NULL; i++)
+  {
+    if (strcmp(keys[i], user) != 0)
+      addFriendship(user, keys[i]);
+  }
+  free(keys);
+
+  return getBody(user_Friends_Dictionary);
+}
+
+/**
+ * @brief Record what an /introduce request needs once its thread is gone
+ *
+ * @param friends: the friend whose friends are being introduced
+ */
+static introduction_t *makeIntroduction(conn_t *conn, const char *user,
+                                        const char *host, const char *port,
+                                        const char *friends)
+{
+  introduction_t *intro = calloc(1, sizeof(introduction_t));
+  char *friend_encode = query_encode(friends);
+
+  intro->conn = conn;
+  intro->keep_alive = keep_alive;
+  intro->user = strdup(user);
+  intro->host = strdup(host);
+  intro->port = strdup(port);
+  intro->path = append_strings("/friends?user=", friend_encode, NULL);
+  intro->key = append_strings(host, ":", port, intro->path, NULL);
+
+  free(friend_encode);
+  return intro;
+}
+
+static void freeIntroduction(introduction_t *intro)
+{
+  free(intro->user);
+  free(intro->host);
+  free(intro->port);
+  free(intro->path);
+  free(intro->key);
+  free(intro->etag);
+  free(intro->FriFriends);
+  free(intro);
+}
+
+/**
+ * @brief Ask the peer for the friend list, revalidating a stale cached
+ * copy with If-None-Match when it has an ETag
+ */
+static void startIntroduction(introduction_t *intro)
+{
+  char *conditional = NULL;
+
+  if (intro->etag)
+    conditional = append_strings("If-None-Match: ", intro->etag, "\r\n", NULL);
+  peer_async_get(intro->host, intro->port, intro->path, conditional,
+                 introductionFetched, intro);
+  free(conditional);
+}
+
+/**
+ * @brief Resume a parked introduction; runs on the peer event loop, so
+ * the real work is queued for an introduction worker
+ */
+static void introductionFetched(peer_response_t *response, void *arg)
+{
+  introduction_t *intro = arg;
+
+  intro->response = response;
+  if (queueIntroduction(intro) < 0)
+    refuseIntroduction(intro);
+}
+
+static void resumeIntroduction(introduction_t *intro)
+{
+  peer_response_t *response = intro->response;
+  char *FriFriends = NULL;
+
+  if (response)
+  {
+    if (response->status == 200)
+    {
+      peer_cache_store(intro->key, response->body, response->len,
+                       dictionary_get(response->headers, "ETag"));
+      FriFriends = response->body;
+      response->body = NULL;
+    }
+    else if (response->status == 304)
+      FriFriends = peer_cache_revalidated(intro->key);
+    peer_response_free(response);
+    free(response);
+    intro->response = NULL;
+  }
+
+  /* The entry can be evicted while it is being revalidated */
+  if (FriFriends == NULL && intro->etag)
+  {
+    free(intro->etag);
+    intro->etag = NULL;
+    startIntroduction(intro);
+    return;
+  }
+
+  if (FriFriends == NULL)
+    FriFriends = strdup("");
+
+  shareFriendList(intro, FriFriends);
+  intro->FriFriends = FriFriends;
+  completeIntroduction(intro);
+}
+
+/**
+ * @brief Wait for an identical fetch that is already in progress
+ *
+ * @return 1 if the introduction joined another one's fetch, 0 if it
+ * must start the fetch itself
+ */
+static int joinIntroduction(introduction_t *intro)
+{
+  introduction_t *leader;
+
+  pthread_mutex_lock(&inflight_lock);
+  leader = dictionary_get(inflight, intro->key);
+  if (leader)
+  {
+    intro->waiter = 1;
+    intro->next = leader->next;
+    leader->next = intro;
+  }
+  else
+    dictionary_set(inflight, intro->key, intro);
+  pthread_mutex_unlock(&inflight_lock);
+
+  return (leader != NULL);
+}
+
+/**
+ * @brief Hand a fetched friend list to every introduction that was
+ * waiting on the same fetch, queueing each for an introduction worker;
+ * with no list, every waiter is refused instead
+ */
+static void shareFriendList(introduction_t *intro, const char *FriFriends)
+{
+  introduction_t *waiter, *next;
+
+  pthread_mutex_lock(&inflight_lock);
+  dictionary_remove(inflight, intro->key);
+  waiter = intro->next;
+  intro->next = NULL;
+  pthread_mutex_unlock(&inflight_lock);
+
+  for (; waiter; waiter = next)
+  {
+    next = waiter->next;
+    waiter->next = NULL;
+    if (FriFriends == NULL)
+      refuseIntroduction(waiter);
+    else
+    {
+      waiter->FriFriends = strdup(FriFriends);
+      if (queueIntroduction(waiter) < 0)
+        refuseIntroduction(waiter);
+    }
+  }
+}
+
+/**
+ * @brief Answer a resumed introduction, then give a connection that
+ * stays open back to a thread of its own so the worker is free again
+ */
+static void completeIntroduction(introduction_t *intro)
+{
+  conn_t *conn = intro->conn;
+  pthread_t tid;
+
+  keep_alive = intro->keep_alive;
+  finishIntroduction(conn->fd, intro->user, intro->FriFriends);
+  freeIntroduction(intro);
+
+  if (keep_alive && pthread_create(&tid, NULL, continueConnection, conn) == 0)
+    pthread_detach(tid);
+  else
+  {
+    close(conn->fd);
+    free(conn);
+  }
+}
+
+/**
+ * @brief Answer 503 to a parked introduction that no worker can take,
+ * along with everything waiting on its fetch, and close its connection
+ */
+static void refuseIntroduction(introduction_t *intro)
+{
+  conn_t *conn = intro->conn;
+
+  if (!intro->waiter)
+    shareFriendList(intro, NULL);
+  if (intro->response)
+  {
+    peer_response_free(intro->response);
+    free(intro->response);
+  }
+
+  keep_alive = 0;
+  clienterror(conn->fd, intro->user, "503", "Service Unavailable",
+              "Friendlist is too busy to introduce");
+  close(conn->fd);
+  free(conn);
+  freeIntroduction(intro);
+}
+
+/**
+ * @brief Queue an introduction for the workers
+ *
+ * @return 0, or -1 if INTRO_BACKLOG introductions are already waiting
+ */
+static int queueIntroduction(introduction_t *intro)
+{
+  pthread_mutex_lock(&intro_lock);
+  if (intro_queued >= INTRO_BACKLOG)
+  {
+    pthread_mutex_unlock(&intro_lock);
+    return -1;
+  }
+  intro->queued = NULL;
+  if (intro_tail)
+    intro_tail->queued = intro;
+  else
+    intro_head = intro;
+  intro_tail = intro;
+  intro_queued++;
+  pthread_cond_signal(&intro_ready);
+  pthread_mutex_unlock(&intro_lock);
+  return 0;
+}
+
+static void *introductionWorker(void *arg)
+{
+  introduction_t *intro;
+
+  while (1)
+  {
+    pthread_mutex_lock(&intro_lock);
+    while (intro_head == NULL)
+      pthread_cond_wait(&intro_ready, &intro_lock);
+    intro = intro_head;
+    intro_head = intro->queued;
+    if (intro_head == NULL)
+      intro_tail = NULL;
+    intro_queued--;
+    pthread_mutex_unlock(&intro_lock);
+
+    if (intro->waiter)
+      completeIntroduction(intro);
+    else
+      resumeIntroduction(intro);
+  }
+  return NULL;
+}
+
+static void startIntroductionWorkers(void)
+{
+  pthread_t tid;
+  int err;
+
+  for (int i = 0; i < INTRO_WORKERS; i++)
+  {
+    if ((err = pthread_create(&tid, NULL, introductionWorker, NULL)) != 0)
+    {
+      fprintf(stderr, "cannot start introduction workers: %s\n",
+              strerror(err));
+      exit(1);
+    }
+    pthread_detach(tid);
+  }
+}
+
+/*
+ * continueConnection - keep serving a connection whose parked request
+ *   has been answered
+ */
+static void *continueConnection(void *arg)
+{
+  serveConnection(arg, CONN_KEEP);
+  return NULL;
+}
+
+/**
+ * @brief Befriend a user with a friend's friends and respond with the
+ * user's new friend list
+ */
+static void finishIntroduction(int fd, const char *user, char *FriFriends)
+{
+  char *body = changeFriends(user, FriFriends, 1);
+  if (body == NULL)
+  {
+    clienterror(fd, user, "503", "Service Unavailable",
+                "Friendlist could not complete the change for");
+    return;
+  }
+
+  WriteResponse(fd, body);
+
+  free(body);
+}
+
+static char *getBody(dictionary_t *user_Friends_Dictionary)
+{
+  char *body = join_strings(dictionary_keys(user_Friends_Dictionary), '\n');
+  return body;
+}
+
+/*
+ * read_requesthdrs - read HTTP request headers
+ */
+dictionary_t *read_requesthdrs(rio_t *rp)
 {
   char buf[MAXLINE];
   dictionary_t *d = make_dictionary(COMPARE_CASE_INSENS, free);
 
-  Rio_readlineb(rp, buf, MAXLINE);
+  if (Rio_readlineb(rp, buf, MAXLINE) <= 0)
+    return d;
   printf("%s", buf);
   while (strcmp(buf, "\r\n"))
   {
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
     parse_header_line(buf, d);
+    if (Rio_readlineb(rp, buf, MAXLINE) <= 0)
+      break;
+    printf("%s", buf);
   }
 
   return d;
@@ -440,15 +2974,18 @@ void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest)
   free(buffer);
 }
 
-static char *ok_header(size_t len, const char *content_type)
+static char *ok_header(size_t len, const char *content_type,
+                       const char *extra_headers)
 {
   char *len_str, *header;
 
-  header = append_strings("HTTP/1.0 200 OK\r\n",
+  header = append_strings("HTTP/1.1 200 OK\r\n",
                           "Server: Friendlist Web Server\r\n",
-                          "Connection: close\r\n",
+                          (keep_alive ? "Connection: keep-alive\r\n"
+                                      : "Connection: close\r\n"),
                           "Content-length: ", len_str = to_string(len), "\r\n",
-                          "Content-type: ", content_type, "\r\n\r\n",
+                          "Content-type: ", content_type, "\r\n",
+                          (extra_headers ? extra_headers : ""), "\r\n",
                           NULL);
   free(len_str);
 
@@ -468,7 +3005,7 @@ static void serve_request(int fd, dictionary_t *query)
   len = strlen(body);
 
   /* Send response headers to client */
-  header = ok_header(len, "text/html; charset=utf-8");
+  header = ok_header(len, "text/html; charset=utf-8", NULL);
   Rio_writen(fd, header, strlen(header));
   printf("Response headers:\n");
   printf("%s", header);
@@ -484,7 +3021,7 @@ static void serve_request(int fd, dictionary_t *query)
 /*
  * clienterror - returns an error message to the client
  */
-void clienterror(int fd, char *cause, char *errnum,
+void clienterror(int fd, const char *cause, char *errnum,
                  char *shortmsg, char *longmsg)
 {
   size_t len;
@@ -500,8 +3037,12 @@ void clienterror(int fd, char *cause, char *errnum,
                         NULL);
   len = strlen(body);
 
-  /* Print the HTTP response */
-  header = append_strings("HTTP/1.0 ", errnum, " ", shortmsg, "\r\n",
+  /* Print the HTTP response; like ok_header, keep the connection open
+     only if the request asked for that */
+  header = append_strings("HTTP/1.1 ", errnum, " ", shortmsg, "\r\n",
+                          "Server: Friendlist Web Server\r\n",
+                          (keep_alive ? "Connection: keep-alive\r\n"
+                                      : "Connection: close\r\n"),
                           "Content-type: text/html; charset=utf-8\r\n",
                           "Content-length: ", len_str = to_string(len), "\r\n\r\n",
                           NULL);
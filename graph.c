@@ -0,0 +1,2021 @@
+/*
+ * graph.c - friend graph indexed by number
+ *
+ * Ids below the snapshot's count are snapshot indices; a name for a
+ * later id is kept here and found through an open-addressing hash
+ * table. A user's friend array is read from the snapshot until the
+ * user first changes, when it is copied into an array of our own.
+ *
+ * graph_intersect() merges four ids at a time with SSE2 compares where
+ * the lists are of similar length, and gallops through the longer list
+ * where one is much shorter than the other.
+ *
+ * Queries that walk a lot of the graph split the work among a pool of
+ * worker threads, which only read the graph while the caller holds the
+ * graph lock. Each part counts into its own array, one counter per id,
+ * which is kept between queries and cleared entry by entry afterwards.
+ *
+ * Degree statistics are built the first time they are asked for, and
+ * kept up to date from then on. Users are kept in a bucket per degree,
+ * and the buckets in use are linked in order of degree. A change of
+ * one friend moves a user to the next bucket up or down, so the most
+ * connected users are always the first ones in the top buckets.
+ *
+ * Connected components are likewise found the first time they are
+ * asked for, by a union-find over every friendship that the workers
+ * build together, joining roots with compare-and-swap. New friendships
+ * join components as they are made. A removed friendship can split a
+ * component, so unless its two users still share a friend, the
+ * components are found again from scratch on the next question.
+ *
+ * Triangles are counted on a copy of the graph in which each
+ * friendship points one way only, from the user with fewer friends to
+ * the one with more. Every triangle is then found exactly once, by
+ * intersecting the lists at the two ends of its lowest edge, and no
+ * list is longer than about the square root of twice the number of
+ * friendships.
+ *
+ * Whether one user has another as a friend is first asked of a Bloom
+ * filter keyed by the hashes of the two names, so most "no" answers
+ * cost two string hashes and one cache line, and never look either
+ * user up. Each key sets bits within a single 64-byte block. A removed
+ * friendship cannot be taken out of the filter; it only makes false
+ * positives more likely, so the filter is built again once enough
+ * friendships have been removed, or once it holds more than it was
+ * sized for. Building is never left to a query: the server calls
+ * graph_filter_step() to build a new filter a slice at a time, while
+ * the old one (or, before the first, an exact lookup) answers.
+ *
+ * Friends are paged through in name order. A snapshot's friend arrays
+ * are already in name order, since its ids are; a user's own array is
+ * in id order, and new users' ids come after the snapshot's, so an
+ * owned list keeps a second array of the same ids in name order. It
+ * starts as a copy of the snapshot's array when the list becomes
+ * owned, and every link and unlink moves it along with the first.
+ *
+ * Every change to a user's friends stamps the user with the next
+ * number from a counter shared by every index, so a version is never
+ * reused, even by the index that replaces this one. Users who have not
+ * changed share the number the index was made with. An index rebuilt
+ * from the same lists can take over the old one's versions instead. A
+ * user's last changes are kept in a log, with their versions, so the
+ * changes since a recent version can be told instead of every friend;
+ * once the log is full, its older half is forgotten.
+ */
+#include "csapp.h"
+#include "snapshot.h"
+#include "graph.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Gallop once the longer list is this many times the shorter: */
+#define GALLOP_RATIO 32
+
+/* At most this many threads work on one query: */
+#define GRAPH_WORKERS 8
+
+/* A suggestion, or one step of a search, takes another thread for each
+   this many ids it reads: */
+#define SUGGEST_PART_WORK 65536
+#define SEARCH_PART_WORK 65536
+
+/* Finding components, or counting triangles, takes another thread for
+   each this many ids read: */
+#define COMPONENT_PART_WORK 262144
+#define TRIANGLE_PART_WORK 262144
+
+/* Bits of Bloom filter per half friendship, bits set per half, and the
+   share of halves that may be removed before the filter is rebuilt: */
+#define FILTER_BITS_PER_KEY 10
+#define FILTER_HASHES 7
+#define FILTER_STALE_SHARE 8 /* one in this many */
+
+/* One change to a user's friends: */
+typedef struct
+{
+  uint64_t version; /* the user's version after it */
+  uint32_t id;
+  uint32_t added;   /* 1 if the friend was added, 0 if removed */
+} change_t;
+
+/* A user's friends, once they are no longer the snapshot's: */
+typedef struct
+{
+  uint32_t *ids;
+  uint32_t *by_name; /* the same ids in name order */
+  uint32_t count, alloc;
+  int owned;
+  uint64_t version;  /* of the last change, or 0 */
+  change_t *changes; /* the last ones, oldest first */
+  uint32_t change_count, change_alloc;
+  uint64_t logged;   /* every change since this version is in changes, or 0
+                        if every change since the index was made is */
+} adj_t;
+
+/* Users with one degree, linked through degrees_t's next and prev: */
+typedef struct
+{
+  uint32_t degree;
+  long users;
+  uint32_t head;    /* NO_ID if none */
+  long prev, next;  /* buckets of lower and higher degree, or -1 */
+} bucket_t;
+
+#define NO_ID UINT32_MAX
+
+/* Every user's degree, by bucket: */
+typedef struct
+{
+  long *bucket;         /* per id */
+  uint32_t *next, *prev; /* per id, within its bucket */
+  long alloc;
+  bucket_t *buckets;
+  long bucket_count, bucket_alloc;
+  long lowest, highest, free; /* buckets; free ones are linked by next */
+  long halves;
+  long histogram[33];
+} degrees_t;
+
+/* Every user's connected component, as a forest of ids: */
+typedef struct
+{
+  uint32_t *parent; /* per id; a root is its own parent */
+  uint32_t *size;   /* per root, the users under it */
+  long alloc;
+  int stale;        /* a friendship was removed since they were found */
+} components_t;
+
+/* The graph with every friendship pointing up, by rank, toward the user
+   with more friends; users are numbered by rank here: */
+typedef struct
+{
+  graph_t *g;
+  uint32_t *id;       /* per rank */
+  uint32_t *rank;     /* per id */
+  uint64_t *start;    /* per rank, where its list starts in up; one more */
+  uint32_t *up;       /* each list in increasing order */
+  uint32_t *bounds;   /* part p handles ranks bounds[p] .. bounds[p + 1] - 1 */
+  uint64_t *per_user; /* per id, or NULL */
+  uint64_t *found;    /* per part */
+  int pass;           /* orient_friends: 0 counts lists, 1 fills them */
+} oriented_t;
+
+/* For ordering ids by degree: */
+static const uint32_t *rank_degrees;
+
+/* A blocked Bloom filter of half friendships, by name: */
+typedef struct
+{
+  uint64_t *blocks;  /* 8 words, one cache line, per block */
+  uint64_t block_mask;
+  long capacity;     /* keys it was sized for */
+  long keys, removed;
+  /* While it is being built: the next id to read, first to count the
+     halves (before there are blocks), then to add them */
+  long next, halves;
+} filter_t;
+
+struct graph_t
+{
+  snapshot_t *base;
+  long base_count;
+  long count, alloc;
+  adj_t *adj;        /* per id */
+  char **names;      /* per id from base_count on */
+  long *table;       /* ids from base_count on, by name hash; -1 is empty */
+  size_t table_size; /* a power of two */
+  degrees_t *degrees; /* once asked for */
+  components_t *components; /* once asked for */
+  filter_t *filter;   /* once built */
+  filter_t *pending;  /* being built to replace it */
+  uint64_t version;   /* of every user who has not changed since */
+};
+
+/* The last version given out, by any index: */
+static uint64_t versions;
+
+/* A count per id, and the ids that are not zero: */
+typedef struct
+{
+  uint32_t *counts;
+  long size;
+  uint32_t *touched;
+  size_t touched_count, touched_alloc;
+} counter_t;
+
+/* One counter per part of a query; queries run one at a time, under
+   the graph lock: */
+static counter_t counters[GRAPH_WORKERS];
+
+/* What each part of a suggestion counts: */
+typedef struct
+{
+  graph_t *g;
+  const uint32_t *friends;
+  uint32_t *bounds; /* part p counts friends[bounds[p] .. bounds[p + 1]) */
+} suggest_t;
+
+/* A list of ids: */
+typedef struct
+{
+  uint32_t *ids;
+  size_t count, alloc;
+} list_t;
+
+/* One side of a two-sided search for a path: the ids it has reached,
+   how each was reached, and the ones reached last: */
+typedef struct
+{
+  uint64_t *visited; /* a bit per id */
+  uint32_t *parent;  /* per visited id, but the start */
+  long size;
+  list_t frontier;
+  int level; /* steps from the start to the frontier */
+} side_t;
+
+/* A search for a path between the starts of two sides, growing `near`: */
+typedef struct
+{
+  graph_t *g;
+  side_t *near, *far;
+  uint32_t *bounds; /* part p grows near->frontier.ids[bounds[p] .. bounds[p + 1]) */
+  int met;
+  uint32_t meet_near, meet_far; /* adjacent ids where the sides touch */
+} search_t;
+
+/* The sides of the search, and what each part of a step reaches: */
+static side_t sides[2];
+static list_t lists[GRAPH_WORKERS];
+
+/* The worker pool, and the query it is running: */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_size, pool_parts, pool_left;
+static unsigned long pool_gen;
+static void (*pool_fn)(int part, void *arg);
+static void *pool_arg;
+
+static long intern(graph_t *g, const char *name);
+static void grow_table(graph_t *g);
+static uint64_t hash_name(const char *name);
+static adj_t *own(graph_t *g, long id);
+static void log_change(adj_t *a, uint32_t id, int added);
+static int compare_changes(const void *a, const void *b);
+static long lower_bound(const uint32_t *ids, long n, uint32_t id);
+static size_t intersect_gallop(const uint32_t *a, size_t na, const uint32_t *b,
+                               size_t nb, uint32_t *out);
+static size_t intersect_merge(const uint32_t *a, size_t na, const uint32_t *b,
+                              size_t nb, uint32_t *out);
+static void run_parallel(int parts, void (*fn)(int part, void *arg), void *arg);
+static void *pool_main(void *arg);
+static int graph_workers(void);
+static void stats_build(graph_t *g);
+static long bucket_make(degrees_t *d, long below, uint32_t degree);
+static void bucket_add(degrees_t *d, long b, uint32_t id);
+static void bucket_remove(degrees_t *d, uint32_t id);
+static void stats_step(graph_t *g, uint32_t id, int up);
+static void stats_add(graph_t *g, uint32_t id);
+static int histogram_slot(uint32_t degree);
+static void components_build(graph_t *g);
+static void join_friends(int part, void *arg);
+static uint32_t find_root(uint32_t *parent, uint32_t id);
+static void components_add(graph_t *g, uint32_t id);
+static void components_join(graph_t *g, uint32_t a, uint32_t b);
+static int share_friend(graph_t *g, uint32_t a, uint32_t b);
+static int compare_ranks(const void *a, const void *b);
+static int compare_ids(const void *a, const void *b);
+static void orient_friends(int part, void *arg);
+static void count_triangles(int part, void *arg);
+static void filter_size(filter_t *f, long halves);
+static void filter_free(filter_t *f);
+static void filter_link(graph_t *g, long u, const char *user, const char *friend);
+static void filter_unlink(graph_t *g, long u, long count);
+static uint64_t filter_key(uint64_t user_hash, uint64_t friend_hash);
+static void filter_add(filter_t *f, uint64_t key);
+static int filter_test(filter_t *f, uint64_t key);
+static long name_bound(graph_t *g, const uint32_t *ids, long n, const char *name);
+
+graph_t *graph_make(snapshot_t *base)
+{
+  graph_t *g = calloc(1, sizeof(graph_t));
+
+  if (base != NULL)
+  {
+    g->base = snapshot_retain(base);
+    g->base_count = snapshot_count(base);
+  }
+  g->count = g->base_count;
+  g->alloc = g->count + 1024;
+  g->adj = calloc(g->alloc, sizeof(adj_t));
+  g->names = malloc((g->alloc - g->base_count) * sizeof(char *));
+  g->table_size = 1024;
+  g->table = malloc(g->table_size * sizeof(long));
+  memset(g->table, -1, g->table_size * sizeof(long));
+  g->version = ++versions;
+  return g;
+}
+
+void graph_free(graph_t *g)
+{
+  long i;
+
+  for (i = 0; i < g->count; i++)
+  {
+    free(g->adj[i].ids);
+    free(g->adj[i].by_name);
+    free(g->adj[i].changes);
+  }
+  for (i = g->base_count; i < g->count; i++)
+    free(g->names[i - g->base_count]);
+  free(g->adj);
+  free(g->names);
+  free(g->table);
+  if (g->degrees != NULL)
+  {
+    free(g->degrees->bucket);
+    free(g->degrees->next);
+    free(g->degrees->prev);
+    free(g->degrees->buckets);
+    free(g->degrees);
+  }
+  if (g->components != NULL)
+  {
+    free(g->components->parent);
+    free(g->components->size);
+    free(g->components);
+  }
+  filter_free(g->filter);
+  filter_free(g->pending);
+  if (g->base != NULL)
+    snapshot_close(g->base);
+  free(g);
+}
+
+long graph_count(graph_t *g)
+{
+  return g->count;
+}
+
+long graph_find(graph_t *g, const char *name)
+{
+  size_t mask = g->table_size - 1, slot;
+  long id;
+
+  if (g->base != NULL && (id = snapshot_find(g->base, name)) >= 0)
+    return id;
+  for (slot = hash_name(name) & mask; g->table[slot] >= 0; slot = (slot + 1) & mask)
+    if (!strcmp(g->names[g->table[slot] - g->base_count], name))
+      return g->table[slot];
+  return -1;
+}
+
+long graph_add(graph_t *g, const char *name)
+{
+  return intern(g, name);
+}
+
+const char *graph_name(graph_t *g, long id)
+{
+  if (id < g->base_count)
+    return snapshot_name(g->base, id);
+  return g->names[id - g->base_count];
+}
+
+uint32_t graph_friends(graph_t *g, long id, const uint32_t **friends_p)
+{
+  if (g->adj[id].owned)
+  {
+    *friends_p = g->adj[id].ids;
+    return g->adj[id].count;
+  }
+  if (id < g->base_count)
+    return snapshot_friends(g->base, id, friends_p);
+  *friends_p = NULL;
+  return 0;
+}
+
+void graph_link(graph_t *g, const char *user, const char *friend)
+{
+  long u = intern(g, user), f = intern(g, friend);
+  adj_t *a = own(g, u);
+  long at = lower_bound(a->ids, a->count, f);
+
+  if (at < a->count && a->ids[at] == f)
+    return;
+  a->version = ++versions;
+  if (a->count == a->alloc)
+  {
+    a->alloc = (a->alloc ? a->alloc * 2 : 8);
+    a->ids = realloc(a->ids, a->alloc * sizeof(uint32_t));
+    a->by_name = realloc(a->by_name, a->alloc * sizeof(uint32_t));
+  }
+  memmove(a->ids + at + 1, a->ids + at, (a->count - at) * sizeof(uint32_t));
+  a->ids[at] = f;
+  log_change(a, f, 1);
+  at = name_bound(g, a->by_name, a->count, friend);
+  memmove(a->by_name + at + 1, a->by_name + at, (a->count - at) * sizeof(uint32_t));
+  a->by_name[at] = f;
+  a->count++;
+  if (g->degrees != NULL)
+    stats_step(g, u, 1);
+  if (g->components != NULL && !g->components->stale)
+    components_join(g, u, f);
+  filter_link(g, u, user, friend);
+}
+
+void graph_unlink(graph_t *g, const char *user, const char *friend)
+{
+  long u = graph_find(g, user), f = graph_find(g, friend);
+  adj_t *a;
+  long at;
+
+  if (u < 0 || f < 0)
+    return;
+  a = own(g, u);
+  at = lower_bound(a->ids, a->count, f);
+  if (at < a->count && a->ids[at] == f)
+  {
+    memmove(a->ids + at, a->ids + at + 1, (a->count - at - 1) * sizeof(uint32_t));
+    a->version = ++versions;
+    log_change(a, f, 0);
+    at = name_bound(g, a->by_name, a->count, friend);
+    memmove(a->by_name + at, a->by_name + at + 1,
+            (a->count - at - 1) * sizeof(uint32_t));
+    a->count--;
+    if (g->degrees != NULL)
+      stats_step(g, u, 0);
+    if (g->components != NULL && !g->components->stale && !share_friend(g, u, f))
+      g->components->stale = 1;
+    filter_unlink(g, u, 1);
+  }
+}
+
+void graph_replace(graph_t *g, const char *user, const char **friends, int count)
+{
+  long u = intern(g, user);
+  adj_t *a = own(g, u);
+  uint32_t i;
+
+  if (g->degrees != NULL)
+    for (i = 0; i < a->count; i++)
+      stats_step(g, u, 0);
+  if (g->components != NULL && a->count > 0)
+    g->components->stale = 1;
+  filter_unlink(g, u, a->count);
+  a->count = 0;
+  a->version = ++versions;
+  for (i = 0; i < count; i++)
+    graph_link(g, user, friends[i]);
+  /* What was there before is not known, so neither is any change */
+  a->change_count = 0;
+  a->logged = a->version;
+}
+
+/*
+ * intern - the id of `name`, which is given the next id if it is new
+ */
+static long intern(graph_t *g, const char *name)
+{
+  long id = graph_find(g, name);
+  size_t mask, slot;
+
+  if (id >= 0)
+    return id;
+
+  if (g->count == g->alloc)
+  {
+    g->alloc *= 2;
+    g->adj = realloc(g->adj, g->alloc * sizeof(adj_t));
+    g->names = realloc(g->names, (g->alloc - g->base_count) * sizeof(char *));
+  }
+  memset(&g->adj[g->count], 0, sizeof(adj_t));
+  g->names[g->count - g->base_count] = strdup(name);
+  id = g->count++;
+
+  if ((size_t)(g->count - g->base_count) * 2 > g->table_size)
+    grow_table(g);
+  mask = g->table_size - 1;
+  for (slot = hash_name(name) & mask; g->table[slot] >= 0; slot = (slot + 1) & mask)
+    ;
+  g->table[slot] = id;
+  if (g->degrees != NULL)
+    stats_add(g, id);
+  if (g->components != NULL)
+    components_add(g, id);
+  return id;
+}
+
+static void grow_table(graph_t *g)
+{
+  long id;
+
+  g->table_size *= 2;
+  g->table = realloc(g->table, g->table_size * sizeof(long));
+  memset(g->table, -1, g->table_size * sizeof(long));
+  for (id = g->base_count; id < g->count - 1; id++)
+  {
+    size_t mask = g->table_size - 1, slot;
+    for (slot = hash_name(g->names[id - g->base_count]) & mask; g->table[slot] >= 0;
+         slot = (slot + 1) & mask)
+      ;
+    g->table[slot] = id;
+  }
+}
+
+/* FNV-1a */
+static uint64_t hash_name(const char *name)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+  return h;
+}
+
+/*
+ * own - a user's friend array, first copying it out of the snapshot if
+ *   it is still there
+ */
+static adj_t *own(graph_t *g, long id)
+{
+  adj_t *a = &g->adj[id];
+
+  if (!a->owned)
+  {
+    const uint32_t *friends = NULL;
+    uint32_t count = (id < g->base_count ? snapshot_friends(g->base, id, &friends) : 0);
+
+    a->alloc = (count ? count : 8);
+    a->ids = malloc(a->alloc * sizeof(uint32_t));
+    a->by_name = malloc(a->alloc * sizeof(uint32_t));
+    /* A snapshot's ids are in name order, so one copy serves both */
+    if (count)
+    {
+      memcpy(a->ids, friends, count * sizeof(uint32_t));
+      memcpy(a->by_name, friends, count * sizeof(uint32_t));
+    }
+    a->count = count;
+    a->owned = 1;
+  }
+  return a;
+}
+
+/*
+ * log_change - add a change, made at the user's current version, to the
+ *   user's log, forgetting the older half of the log if it is full
+ */
+static void log_change(adj_t *a, uint32_t id, int added)
+{
+  if (a->change_count == GRAPH_CHANGES_MAX)
+  {
+    uint32_t half = GRAPH_CHANGES_MAX / 2;
+
+    a->logged = a->changes[half - 1].version;
+    memmove(a->changes, a->changes + half, half * sizeof(change_t));
+    a->change_count = half;
+  }
+  if (a->change_count == a->change_alloc)
+  {
+    a->change_alloc = (a->change_alloc ? a->change_alloc * 2 : 4);
+    a->changes = realloc(a->changes, a->change_alloc * sizeof(change_t));
+  }
+  a->changes[a->change_count].version = a->version;
+  a->changes[a->change_count].id = id;
+  a->changes[a->change_count].added = added;
+  a->change_count++;
+}
+
+static long lower_bound(const uint32_t *ids, long n, uint32_t id)
+{
+  long lo = 0, hi = n;
+
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo) / 2;
+    if (ids[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+size_t graph_intersect(const uint32_t *a, size_t na, const uint32_t *b, size_t nb,
+                       uint32_t *out)
+{
+  if (na > nb)
+    return graph_intersect(b, nb, a, na, out);
+  if (na == 0)
+    return 0;
+  if (na * GALLOP_RATIO < nb)
+    return intersect_gallop(a, na, b, nb, out);
+  return intersect_merge(a, na, b, nb, out);
+}
+
+/*
+ * intersect_gallop - look each id of the short list up in the long
+ *   one, stepping ahead by doubling strides before a binary search
+ */
+static size_t intersect_gallop(const uint32_t *a, size_t na, const uint32_t *b,
+                               size_t nb, uint32_t *out)
+{
+  size_t i, j = 0, n = 0;
+
+  for (i = 0; i < na && j < nb; i++)
+  {
+    size_t step = 1, hi;
+
+    while (j + step < nb && b[j + step] < a[i])
+      step *= 2;
+    hi = (j + step < nb ? j + step + 1 : nb);
+    j += lower_bound(b + j, hi - j, a[i]);
+    if (j < nb && b[j] == a[i])
+      out[n++] = b[j++];
+  }
+  return n;
+}
+
+/*
+ * intersect_merge - walk both lists together; with SSE2, compare a
+ *   block of four from each against all four rotations of the other,
+ *   then advance past whichever block ends lower
+ */
+static size_t intersect_merge(const uint32_t *a, size_t na, const uint32_t *b,
+                              size_t nb, uint32_t *out)
+{
+  size_t i = 0, j = 0, n = 0;
+
+#ifdef __SSE2__
+  while (i + 4 <= na && j + 4 <= nb)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+    __m128i eq = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+        _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+    uint32_t a_max = a[i + 3], b_max = b[j + 3];
+
+    while (mask)
+    {
+      out[n++] = a[i + __builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+    if (a_max <= b_max)
+      i += 4;
+    if (b_max <= a_max)
+      j += 4;
+  }
+#endif
+
+  while (i < na && j < nb)
+  {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else
+    {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return n;
+}
+
+/*
+ * run_parallel - run fn(part, arg) for each of `parts` parts, part 0
+ *   on the calling thread and the others on the workers
+ */
+static void run_parallel(int parts, void (*fn)(int part, void *arg), void *arg)
+{
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  if (parts > pool_size)
+  {
+    for (i = (pool_size ? pool_size : 1); i < parts; i++)
+    {
+      pthread_t tid;
+      pthread_create(&tid, NULL, pool_main, (void *)(long)i);
+      pthread_detach(tid);
+    }
+    pool_size = parts;
+  }
+  pool_fn = fn;
+  pool_arg = arg;
+  pool_parts = parts;
+  pool_left = parts - 1;
+  pool_gen++;
+  pthread_cond_broadcast(&pool_work);
+  pthread_mutex_unlock(&pool_lock);
+
+  fn(0, arg);
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_left > 0)
+    pthread_cond_wait(&pool_done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void *pool_main(void *arg)
+{
+  int part = (long)arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  while (1)
+  {
+    while (pool_gen == seen)
+      pthread_cond_wait(&pool_work, &pool_lock);
+    seen = pool_gen;
+    if (part >= pool_parts)
+      continue;
+
+    void (*fn)(int, void *) = pool_fn;
+    void *fn_arg = pool_arg;
+    pthread_mutex_unlock(&pool_lock);
+    fn(part, fn_arg);
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_left == 0)
+      pthread_cond_signal(&pool_done);
+  }
+  return NULL;
+}
+
+/*
+ * counter_reserve - make a counter big enough for every id, zeroing
+ *   the new part
+ */
+static void counter_reserve(counter_t *c, long size)
+{
+  if (c->size < size)
+  {
+    c->counts = realloc(c->counts, size * sizeof(uint32_t));
+    memset(c->counts + c->size, 0, (size - c->size) * sizeof(uint32_t));
+    c->size = size;
+  }
+}
+
+static void counter_add(counter_t *c, uint32_t id, uint32_t n)
+{
+  if (c->counts[id] == 0)
+  {
+    if (c->touched_count == c->touched_alloc)
+    {
+      c->touched_alloc = (c->touched_alloc ? c->touched_alloc * 2 : 1024);
+      c->touched = realloc(c->touched, c->touched_alloc * sizeof(uint32_t));
+    }
+    c->touched[c->touched_count++] = id;
+  }
+  c->counts[id] += n;
+}
+
+/*
+ * count_two_hops - count, for every friend of a friend in this part of
+ *   the user's friends, how many of them lead there
+ */
+static void count_two_hops(int part, void *arg)
+{
+  suggest_t *s = arg;
+  counter_t *c = &counters[part];
+  uint32_t i, j;
+
+  counter_reserve(c, s->g->count);
+  for (i = s->bounds[part]; i < s->bounds[part + 1]; i++)
+  {
+    const uint32_t *hop;
+    uint32_t n = graph_friends(s->g, s->friends[i], &hop);
+    for (j = 0; j < n; j++)
+      counter_add(c, hop[j], 1);
+  }
+}
+
+/* Orders candidates worst first, for the heap of the best k: */
+static int worse(uint32_t *counts, uint32_t a, uint32_t b)
+{
+  return (counts[a] < counts[b] || (counts[a] == counts[b] && a > b));
+}
+
+static void sift_down(uint32_t *heap, int n, int i, uint32_t *counts)
+{
+  while (1)
+  {
+    int least = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && worse(counts, heap[l], heap[least]))
+      least = l;
+    if (r < n && worse(counts, heap[r], heap[least]))
+      least = r;
+    if (least == i)
+      return;
+    uint32_t t = heap[i];
+    heap[i] = heap[least];
+    heap[least] = t;
+    i = least;
+  }
+}
+
+int graph_suggest(graph_t *g, long id, int k, uint32_t *ids, uint32_t *mutuals)
+{
+  const uint32_t *friends;
+  uint32_t count = graph_friends(g, id, &friends), bounds[GRAPH_WORKERS + 1];
+  uint64_t work = 0, done = 0;
+  counter_t *total = &counters[0];
+  suggest_t s = {g, friends, bounds};
+  int parts, p, n = 0;
+  uint32_t i;
+
+  if (k <= 0 || count == 0)
+    return 0;
+
+  /* Split the friends so each part walks about as many lists */
+  for (i = 0; i < count; i++)
+  {
+    const uint32_t *hop;
+    work += graph_friends(g, friends[i], &hop);
+  }
+  parts = (int)(work / SUGGEST_PART_WORK) + 1;
+  if (parts > graph_workers())
+    parts = graph_workers();
+  bounds[0] = 0;
+  for (i = 0, p = 1; i < count && p < parts; i++)
+  {
+    const uint32_t *hop;
+    done += graph_friends(g, friends[i], &hop);
+    if (done * parts >= work * p)
+      bounds[p++] = i + 1;
+  }
+  while (p <= parts)
+    bounds[p++] = count;
+
+  if (parts > 1)
+    run_parallel(parts, count_two_hops, &s);
+  else
+    count_two_hops(0, &s);
+
+  /* Fold the other parts into the first */
+  for (p = 1; p < parts; p++)
+  {
+    counter_t *c = &counters[p];
+    for (size_t t = 0; t < c->touched_count; t++)
+    {
+      counter_add(total, c->touched[t], c->counts[c->touched[t]]);
+      c->counts[c->touched[t]] = 0;
+    }
+    c->touched_count = 0;
+  }
+
+  /* Friends and the user are not suggestions */
+  total->counts[id] = 0;
+  for (i = 0; i < count; i++)
+    total->counts[friends[i]] = 0;
+
+  for (size_t t = 0; t < total->touched_count; t++)
+  {
+    uint32_t c = total->touched[t];
+    if (total->counts[c] == 0)
+      continue;
+    if (n < k)
+    {
+      ids[n++] = c;
+      if (n == k)
+        for (p = k / 2 - 1; p >= 0; p--)
+          sift_down(ids, n, p, total->counts);
+    }
+    else if (worse(total->counts, ids[0], c))
+    {
+      ids[0] = c;
+      sift_down(ids, n, 0, total->counts);
+    }
+  }
+
+  /* Best first */
+  if (n < k)
+    for (p = n / 2 - 1; p >= 0; p--)
+      sift_down(ids, n, p, total->counts);
+  for (p = n - 1; p > 0; p--)
+  {
+    uint32_t t = ids[0];
+    ids[0] = ids[p];
+    ids[p] = t;
+    sift_down(ids, p, 0, total->counts);
+  }
+  for (p = 0; p < n; p++)
+    mutuals[p] = total->counts[ids[p]];
+
+  for (size_t t = 0; t < total->touched_count; t++)
+    total->counts[total->touched[t]] = 0;
+  total->touched_count = 0;
+  return n;
+}
+
+static void list_push(list_t *l, uint32_t id)
+{
+  if (l->count == l->alloc)
+  {
+    l->alloc = (l->alloc ? l->alloc * 2 : 1024);
+    l->ids = realloc(l->ids, l->alloc * sizeof(uint32_t));
+  }
+  l->ids[l->count++] = id;
+}
+
+/*
+ * side_reset - clear one side of a search over `size` ids, and start it
+ *   from `start`
+ */
+static void side_reset(side_t *side, long size, uint32_t start)
+{
+  size_t words = (size + 63) / 64;
+
+  if (side->size < size)
+  {
+    side->visited = realloc(side->visited, words * sizeof(uint64_t));
+    side->parent = realloc(side->parent, size * sizeof(uint32_t));
+    side->size = size;
+  }
+  memset(side->visited, 0, words * sizeof(uint64_t));
+  side->visited[start / 64] |= 1ULL << (start % 64);
+  side->frontier.count = 0;
+  list_push(&side->frontier, start);
+  side->level = 0;
+}
+
+static int is_visited(side_t *side, uint32_t id)
+{
+  return (side->visited[id / 64] >> (id % 64)) & 1;
+}
+
+/*
+ * expand_frontier - visit everyone next to this part of one side's
+ *   frontier, unless the other side got there first, which ends the
+ *   search
+ */
+static void expand_frontier(int part, void *arg)
+{
+  search_t *s = arg;
+  list_t *next = &lists[part];
+  uint32_t i, j;
+
+  next->count = 0;
+  for (i = s->bounds[part]; i < s->bounds[part + 1]; i++)
+  {
+    uint32_t u = s->near->frontier.ids[i];
+    const uint32_t *hop;
+    uint32_t n = graph_friends(s->g, u, &hop);
+
+    if (__atomic_load_n(&s->met, __ATOMIC_RELAXED))
+      return;
+    for (j = 0; j < n; j++)
+    {
+      uint32_t v = hop[j];
+      uint64_t bit = 1ULL << (v % 64);
+
+      if (is_visited(s->far, v))
+      {
+        int no = 0;
+        if (__atomic_compare_exchange_n(&s->met, &no, 1, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        {
+          s->meet_near = u;
+          s->meet_far = v;
+        }
+        return;
+      }
+      if (!(__atomic_fetch_or(&s->near->visited[v / 64], bit, __ATOMIC_RELAXED) & bit))
+      {
+        s->near->parent[v] = u;
+        list_push(next, v);
+      }
+    }
+  }
+}
+
+/*
+ * frontier_work - how many ids expanding a frontier will read
+ */
+static uint64_t frontier_work(graph_t *g, list_t *frontier)
+{
+  uint64_t work = 0;
+  size_t i;
+
+  for (i = 0; i < frontier->count; i++)
+  {
+    const uint32_t *hop;
+    work += graph_friends(g, frontier->ids[i], &hop);
+  }
+  return work;
+}
+
+int graph_path(graph_t *g, long from, long to, int max, uint32_t *path)
+{
+  search_t s;
+  side_t *a = &sides[0], *b = &sides[1];
+  uint32_t bounds[GRAPH_WORKERS + 1];
+  int n, p;
+
+  if (from == to)
+  {
+    path[0] = from;
+    return 1;
+  }
+  side_reset(a, g->count, from);
+  side_reset(b, g->count, to);
+  s.g = g;
+  s.bounds = bounds;
+  s.met = 0;
+
+  while (a->level + b->level < max && a->frontier.count > 0 && b->frontier.count > 0)
+  {
+    /* Grow the side that is cheaper to grow */
+    uint64_t work_a = frontier_work(g, &a->frontier);
+    uint64_t work_b = frontier_work(g, &b->frontier);
+    uint64_t work = (work_a <= work_b ? work_a : work_b), done = 0;
+    s.near = (work_a <= work_b ? a : b);
+    s.far = (work_a <= work_b ? b : a);
+
+    int parts = (int)(work / SEARCH_PART_WORK) + 1;
+    if (parts > graph_workers())
+      parts = graph_workers();
+    bounds[0] = 0;
+    size_t i;
+    for (i = 0, p = 1; i < s.near->frontier.count && p < parts; i++)
+    {
+      const uint32_t *hop;
+      done += graph_friends(g, s.near->frontier.ids[i], &hop);
+      if (done * parts >= work * p)
+        bounds[p++] = i + 1;
+    }
+    while (p <= parts)
+      bounds[p++] = s.near->frontier.count;
+
+    if (parts > 1)
+      run_parallel(parts, expand_frontier, &s);
+    else
+      expand_frontier(0, &s);
+
+    if (s.met)
+    {
+      /* near's chain back to its start, then far's chain to its own */
+      uint32_t id = s.meet_near;
+      side_t *start_side = s.near;
+      n = start_side->level + 1;
+      for (p = n - 1; p >= 0; p--)
+      {
+        path[p] = id;
+        id = start_side->parent[id];
+      }
+      id = s.meet_far;
+      for (p = 0; p <= s.far->level; p++)
+      {
+        path[n++] = id;
+        id = s.far->parent[id];
+      }
+      if (s.near == b)
+      {
+        /* The path was built from `to` */
+        for (p = 0; p < n / 2; p++)
+        {
+          uint32_t t = path[p];
+          path[p] = path[n - 1 - p];
+          path[n - 1 - p] = t;
+        }
+      }
+      return n;
+    }
+
+    s.near->frontier.count = 0;
+    for (p = 0; p < parts; p++)
+      for (i = 0; i < lists[p].count; i++)
+        list_push(&s.near->frontier, lists[p].ids[i]);
+    s.near->level++;
+  }
+  return 0;
+}
+
+/*
+ * stats_build - put every user in the bucket for the user's degree,
+ *   from scratch; later changes keep the buckets up to date
+ */
+static void stats_build(graph_t *g)
+{
+  degrees_t *d = calloc(1, sizeof(degrees_t));
+  uint32_t max = 0;
+  long id, *bucket_of;
+
+  d->alloc = g->alloc;
+  d->bucket = malloc(d->alloc * sizeof(long));
+  d->next = malloc(d->alloc * sizeof(uint32_t));
+  d->prev = malloc(d->alloc * sizeof(uint32_t));
+  d->lowest = d->highest = d->free = -1;
+  g->degrees = d;
+
+  for (id = 0; id < g->count; id++)
+  {
+    const uint32_t *friends;
+    uint32_t degree = graph_friends(g, id, &friends);
+    if (degree > max)
+      max = degree;
+    d->halves += degree;
+  }
+
+  /* One bucket per degree in use, made in increasing order */
+  bucket_of = malloc((max + 1) * sizeof(long));
+  for (id = 0; id <= max; id++)
+    bucket_of[id] = -1;
+  for (id = 0; id < g->count; id++)
+  {
+    const uint32_t *friends;
+    bucket_of[graph_friends(g, id, &friends)] = -2; /* in use */
+  }
+  for (id = 0; id <= max; id++)
+    if (bucket_of[id] == -2)
+      bucket_of[id] = bucket_make(d, d->highest, (uint32_t)id);
+  for (id = 0; id < g->count; id++)
+  {
+    const uint32_t *friends;
+    bucket_add(d, bucket_of[graph_friends(g, id, &friends)], id);
+  }
+  free(bucket_of);
+}
+
+/*
+ * bucket_make - a new, empty bucket for `degree`, just above bucket
+ *   `below` (or lowest of all if `below` is -1)
+ */
+static long bucket_make(degrees_t *d, long below, uint32_t degree)
+{
+  long b;
+
+  if (d->free >= 0)
+  {
+    b = d->free;
+    d->free = d->buckets[b].next;
+  }
+  else
+  {
+    if (d->bucket_count == d->bucket_alloc)
+    {
+      d->bucket_alloc = (d->bucket_alloc ? d->bucket_alloc * 2 : 64);
+      d->buckets = realloc(d->buckets, d->bucket_alloc * sizeof(bucket_t));
+    }
+    b = d->bucket_count++;
+  }
+
+  d->buckets[b].degree = degree;
+  d->buckets[b].users = 0;
+  d->buckets[b].head = NO_ID;
+  d->buckets[b].prev = below;
+  d->buckets[b].next = (below >= 0 ? d->buckets[below].next : d->lowest);
+  if (d->buckets[b].next >= 0)
+    d->buckets[d->buckets[b].next].prev = b;
+  else
+    d->highest = b;
+  if (below >= 0)
+    d->buckets[below].next = b;
+  else
+    d->lowest = b;
+  return b;
+}
+
+static void bucket_add(degrees_t *d, long b, uint32_t id)
+{
+  uint32_t head = d->buckets[b].head;
+
+  d->bucket[id] = b;
+  d->prev[id] = NO_ID;
+  d->next[id] = head;
+  if (head != NO_ID)
+    d->prev[head] = id;
+  d->buckets[b].head = id;
+  d->buckets[b].users++;
+  d->histogram[histogram_slot(d->buckets[b].degree)]++;
+}
+
+/*
+ * bucket_remove - take a user out of the user's bucket, dropping the
+ *   bucket if it is left empty
+ */
+static void bucket_remove(degrees_t *d, uint32_t id)
+{
+  long b = d->bucket[id];
+  bucket_t *bucket = &d->buckets[b];
+
+  if (d->prev[id] != NO_ID)
+    d->next[d->prev[id]] = d->next[id];
+  else
+    bucket->head = d->next[id];
+  if (d->next[id] != NO_ID)
+    d->prev[d->next[id]] = d->prev[id];
+  d->histogram[histogram_slot(bucket->degree)]--;
+
+  if (--bucket->users == 0)
+  {
+    if (bucket->prev >= 0)
+      d->buckets[bucket->prev].next = bucket->next;
+    else
+      d->lowest = bucket->next;
+    if (bucket->next >= 0)
+      d->buckets[bucket->next].prev = bucket->prev;
+    else
+      d->highest = bucket->prev;
+    bucket->next = d->free;
+    d->free = b;
+  }
+}
+
+/*
+ * stats_step - move a user whose degree just went up or down by one to
+ *   the neighbouring bucket
+ */
+static void stats_step(graph_t *g, uint32_t id, int up)
+{
+  degrees_t *d = g->degrees;
+  long b = d->bucket[id], to;
+  uint32_t degree = d->buckets[b].degree + (up ? 1 : -1);
+
+  to = (up ? d->buckets[b].next : d->buckets[b].prev);
+  if (to < 0 || d->buckets[to].degree != degree)
+    to = bucket_make(d, (up ? b : d->buckets[b].prev), degree);
+  bucket_remove(d, id);
+  bucket_add(d, to, id);
+  d->halves += (up ? 1 : -1);
+}
+
+/*
+ * stats_add - a new user, with no friends yet
+ */
+static void stats_add(graph_t *g, uint32_t id)
+{
+  degrees_t *d = g->degrees;
+  long b = d->lowest;
+
+  if (d->alloc < g->alloc)
+  {
+    d->alloc = g->alloc;
+    d->bucket = realloc(d->bucket, d->alloc * sizeof(long));
+    d->next = realloc(d->next, d->alloc * sizeof(uint32_t));
+    d->prev = realloc(d->prev, d->alloc * sizeof(uint32_t));
+  }
+  if (b < 0 || d->buckets[b].degree != 0)
+    b = bucket_make(d, -1, 0);
+  bucket_add(d, b, id);
+}
+
+/*
+ * histogram_slot - 0 for no friends, and n for 2^(n-1) to 2^n - 1
+ */
+static int histogram_slot(uint32_t degree)
+{
+  return (degree == 0 ? 0 : 32 - __builtin_clz(degree));
+}
+
+void graph_stats(graph_t *g, graph_stats_t *stats)
+{
+  degrees_t *d;
+
+  if (g->degrees == NULL)
+    stats_build(g);
+  d = g->degrees;
+
+  memset(stats, 0, sizeof(graph_stats_t));
+  stats->users = g->count;
+  stats->halves = d->halves;
+  stats->max_degree = (d->highest >= 0 ? d->buckets[d->highest].degree : 0);
+  memcpy(stats->histogram, d->histogram, sizeof(stats->histogram));
+}
+
+int graph_top(graph_t *g, int k, uint32_t *ids, uint32_t *degrees)
+{
+  degrees_t *d;
+  long b;
+  int n = 0;
+
+  if (g->degrees == NULL)
+    stats_build(g);
+  d = g->degrees;
+
+  for (b = d->highest; b >= 0 && n < k; b = d->buckets[b].prev)
+    for (uint32_t id = d->buckets[b].head; id != NO_ID && n < k; id = d->next[id])
+    {
+      ids[n] = id;
+      degrees[n] = d->buckets[b].degree;
+      n++;
+    }
+  return n;
+}
+
+/*
+ * graph_workers - how many threads a query may use: one per processor,
+ *   up to GRAPH_WORKERS
+ */
+static int graph_workers(void)
+{
+  static int workers;
+
+  if (workers == 0)
+  {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = (n < 1 ? 1 : n > GRAPH_WORKERS ? GRAPH_WORKERS : n);
+  }
+  return workers;
+}
+
+/*
+ * components_build - find every user's component from scratch: each
+ *   part joins the users at either end of its share of the friendships
+ */
+static void components_build(graph_t *g)
+{
+  components_t *c = g->components;
+  uint32_t bounds[GRAPH_WORKERS + 1];
+  uint64_t work = 0, done = 0;
+  int parts, p;
+  long id;
+
+  if (c == NULL)
+  {
+    c = g->components = calloc(1, sizeof(components_t));
+    c->alloc = g->alloc;
+    c->parent = malloc(c->alloc * sizeof(uint32_t));
+    c->size = malloc(c->alloc * sizeof(uint32_t));
+  }
+  c->stale = 0;
+  for (id = 0; id < g->count; id++)
+  {
+    const uint32_t *friends;
+    c->parent[id] = id;
+    c->size[id] = 0;
+    work += graph_friends(g, id, &friends) + 1;
+  }
+
+  /* Split the ids so each part reads about as many friends */
+  parts = (int)(work / COMPONENT_PART_WORK) + 1;
+  if (parts > graph_workers())
+    parts = graph_workers();
+  bounds[0] = 0;
+  for (id = 0, p = 1; id < g->count && p < parts; id++)
+  {
+    const uint32_t *friends;
+    done += graph_friends(g, id, &friends) + 1;
+    if (done * parts >= work * p)
+      bounds[p++] = id + 1;
+  }
+  while (p <= parts)
+    bounds[p++] = g->count;
+
+  void *args[2] = {g, bounds};
+  if (parts > 1)
+    run_parallel(parts, join_friends, args);
+  else
+    join_friends(0, args);
+
+  /* Roots were always joined to lower ids, so one pass upwards flattens
+     every tree */
+  for (id = 0; id < g->count; id++)
+  {
+    c->parent[id] = c->parent[c->parent[id]];
+    c->size[c->parent[id]]++;
+  }
+}
+
+/*
+ * join_friends - join each user in this part to the user's friends
+ *   with higher ids; concurrent joins always hang the higher root under
+ *   the lower, so no two can make a cycle
+ */
+static void join_friends(int part, void *arg)
+{
+  graph_t *g = ((void **)arg)[0];
+  uint32_t *bounds = ((void **)arg)[1];
+  uint32_t *parent = g->components->parent;
+  uint32_t u;
+
+  for (u = bounds[part]; u < bounds[part + 1]; u++)
+  {
+    const uint32_t *friends;
+    uint32_t n = graph_friends(g, u, &friends), i;
+
+    for (i = lower_bound(friends, n, u + 1); i < n; i++)
+    {
+      while (1)
+      {
+        uint32_t a = find_root(parent, u), b = find_root(parent, friends[i]);
+        if (a == b)
+          break;
+        if (a < b)
+        {
+          uint32_t t = a;
+          a = b;
+          b = t;
+        }
+        if (__atomic_compare_exchange_n(&parent[a], &a, b, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+          break;
+      }
+    }
+  }
+}
+
+/*
+ * find_root - the root of an id's tree, halving the path on the way;
+ *   safe while other parts join trees, since a parent is only ever
+ *   replaced by one of its ancestors
+ */
+static uint32_t find_root(uint32_t *parent, uint32_t id)
+{
+  while (1)
+  {
+    uint32_t up = __atomic_load_n(&parent[id], __ATOMIC_ACQUIRE);
+    if (up == id)
+      return id;
+    uint32_t next = __atomic_load_n(&parent[up], __ATOMIC_ACQUIRE);
+    if (next != up)
+      __atomic_store_n(&parent[id], next, __ATOMIC_RELEASE);
+    id = next;
+  }
+}
+
+/*
+ * components_add - a new user, alone in a component
+ */
+static void components_add(graph_t *g, uint32_t id)
+{
+  components_t *c = g->components;
+
+  if (c->alloc < g->alloc)
+  {
+    c->alloc = g->alloc;
+    c->parent = realloc(c->parent, c->alloc * sizeof(uint32_t));
+    c->size = realloc(c->size, c->alloc * sizeof(uint32_t));
+  }
+  c->parent[id] = id;
+  c->size[id] = 1;
+}
+
+/*
+ * components_join - put two users in one component, hanging the smaller
+ *   tree under the larger
+ */
+static void components_join(graph_t *g, uint32_t a, uint32_t b)
+{
+  components_t *c = g->components;
+
+  a = find_root(c->parent, a);
+  b = find_root(c->parent, b);
+  if (a == b)
+    return;
+  if (c->size[a] < c->size[b])
+  {
+    uint32_t t = a;
+    a = b;
+    b = t;
+  }
+  c->parent[b] = a;
+  c->size[a] += c->size[b];
+}
+
+/*
+ * share_friend - whether two users have a friend in common, in which
+ *   case a friendship between them can go without splitting anything
+ */
+static int share_friend(graph_t *g, uint32_t a, uint32_t b)
+{
+  const uint32_t *x, *y;
+  uint32_t nx = graph_friends(g, a, &x), ny = graph_friends(g, b, &y);
+  uint32_t i = 0, j = 0;
+
+  while (i < nx && j < ny)
+  {
+    if (x[i] == y[j])
+      return 1;
+    if (x[i] < y[j])
+      i++;
+    else
+      j++;
+  }
+  return 0;
+}
+
+long graph_component(graph_t *g, long id, long *size_p)
+{
+  uint32_t root;
+
+  if (g->components == NULL || g->components->stale)
+    components_build(g);
+  root = find_root(g->components->parent, id);
+  if (size_p != NULL)
+    *size_p = g->components->size[root];
+  return root;
+}
+
+/*
+ * compare_ranks - order ids by degree, then by id
+ */
+static int compare_ranks(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  if (rank_degrees[x] != rank_degrees[y])
+    return (rank_degrees[x] < rank_degrees[y] ? -1 : 1);
+  return (x < y ? -1 : x > y);
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x < y ? -1 : x > y);
+}
+
+/*
+ * orient_friends - for this part's ranks, count the friends that rank
+ *   higher (pass 0), or store them in increasing order (pass 1)
+ */
+static void orient_friends(int part, void *arg)
+{
+  oriented_t *o = arg;
+  uint32_t r;
+
+  for (r = o->bounds[part]; r < o->bounds[part + 1]; r++)
+  {
+    const uint32_t *friends;
+    uint32_t n = graph_friends(o->g, o->id[r], &friends), i, count = 0;
+    uint32_t *list = o->up + (o->pass ? o->start[r] : 0);
+
+    for (i = 0; i < n; i++)
+      if (o->rank[friends[i]] > r)
+      {
+        if (o->pass)
+          list[count] = o->rank[friends[i]];
+        count++;
+      }
+    if (!o->pass)
+      o->start[r + 1] = count;
+    else /* friends come in id order, and are wanted in rank order */
+      qsort(list, count, sizeof(uint32_t), compare_ids);
+  }
+}
+
+/*
+ * count_triangles - find the triangles whose lowest-ranked user is in
+ *   this part, crediting each of the three users
+ */
+static void count_triangles(int part, void *arg)
+{
+  oriented_t *o = arg;
+  uint32_t r, *common = NULL;
+  size_t alloc = 0;
+  uint64_t found = 0;
+
+  for (r = o->bounds[part]; r < o->bounds[part + 1]; r++)
+  {
+    const uint32_t *a = o->up + o->start[r];
+    size_t na = o->start[r + 1] - o->start[r], i, j;
+
+    if (na > alloc)
+    {
+      alloc = na;
+      free(common);
+      common = malloc(alloc * sizeof(uint32_t));
+    }
+    for (i = 0; i < na; i++)
+    {
+      const uint32_t *b = o->up + o->start[a[i]];
+      size_t nb = o->start[a[i] + 1] - o->start[a[i]];
+      size_t n = graph_intersect(a, na, b, nb, common);
+
+      found += n;
+      if (o->per_user != NULL && n > 0)
+      {
+        __atomic_fetch_add(&o->per_user[o->id[r]], n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&o->per_user[o->id[a[i]]], n, __ATOMIC_RELAXED);
+        for (j = 0; j < n; j++)
+          __atomic_fetch_add(&o->per_user[o->id[common[j]]], 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  o->found[part] = found;
+  free(common);
+}
+
+uint64_t graph_triangles(graph_t *g, int threads, uint64_t *per_user)
+{
+  oriented_t o = {g};
+  uint32_t *degrees = malloc((g->count + 1) * sizeof(uint32_t));
+  uint64_t work = 0, done = 0, total = 0;
+  long r;
+  int parts, p;
+
+  if (threads <= 0)
+    threads = graph_workers();
+  o.id = malloc((g->count + 1) * sizeof(uint32_t));
+  o.rank = malloc((g->count + 1) * sizeof(uint32_t));
+  o.start = calloc(g->count + 1, sizeof(uint64_t));
+  o.bounds = malloc((threads + 1) * sizeof(uint32_t));
+  o.found = calloc(threads, sizeof(uint64_t));
+  o.per_user = per_user;
+  if (per_user != NULL)
+    memset(per_user, 0, g->count * sizeof(uint64_t));
+
+  /* Rank users by degree */
+  for (r = 0; r < g->count; r++)
+  {
+    const uint32_t *friends;
+    degrees[r] = graph_friends(g, r, &friends);
+    o.id[r] = r;
+    work += degrees[r] + 1;
+  }
+  rank_degrees = degrees;
+  qsort(o.id, g->count, sizeof(uint32_t), compare_ranks);
+  for (r = 0; r < g->count; r++)
+    o.rank[o.id[r]] = r;
+
+  /* Split the ranks so each part reads about as many friends */
+  parts = (int)(work / TRIANGLE_PART_WORK) + 1;
+  if (parts > threads)
+    parts = threads;
+  o.bounds[0] = 0;
+  for (r = 0, p = 1; r < g->count && p < parts; r++)
+  {
+    done += degrees[o.id[r]] + 1;
+    if (done * parts >= work * p)
+      o.bounds[p++] = r + 1;
+  }
+  while (p <= parts)
+    o.bounds[p++] = g->count;
+
+  /* Point every friendship up */
+  for (o.pass = 0; o.pass < 2; o.pass++)
+  {
+    if (parts > 1)
+      run_parallel(parts, orient_friends, &o);
+    else
+      orient_friends(0, &o);
+    if (o.pass == 0)
+    {
+      for (r = 0; r < g->count; r++)
+        o.start[r + 1] += o.start[r];
+      o.up = malloc((o.start[g->count] + 1) * sizeof(uint32_t));
+    }
+  }
+
+  /* Split again by the work of intersecting, which is about each
+     list's length times the length of the lists it points to */
+  work = done = 0;
+  for (r = 0; r < g->count; r++)
+    work += (o.start[r + 1] - o.start[r]) * (o.start[r + 1] - o.start[r]) + 1;
+  for (r = 0, p = 1; r < g->count && p < parts; r++)
+  {
+    done += (o.start[r + 1] - o.start[r]) * (o.start[r + 1] - o.start[r]) + 1;
+    if (done * parts >= work * p)
+      o.bounds[p++] = r + 1;
+  }
+  while (p <= parts)
+    o.bounds[p++] = g->count;
+
+  if (parts > 1)
+    run_parallel(parts, count_triangles, &o);
+  else
+    count_triangles(0, &o);
+  for (p = 0; p < parts; p++)
+    total += o.found[p];
+
+  free(degrees);
+  free(o.id);
+  free(o.rank);
+  free(o.start);
+  free(o.up);
+  free(o.bounds);
+  free(o.found);
+  return total;
+}
+
+int graph_filter_step(graph_t *g, long work)
+{
+  filter_t *f = g->filter, *p = g->pending;
+  const uint32_t *friends;
+  long id;
+
+  if (p == NULL)
+  {
+    if (f != NULL && f->keys <= f->capacity
+        && f->removed * FILTER_STALE_SHARE <= f->keys)
+      return 0;
+    p = g->pending = calloc(1, sizeof(filter_t));
+  }
+
+  /* Count the halves, to size the filter for twice as many... */
+  if (p->blocks == NULL)
+  {
+    for (id = p->next; id < g->count && work > 0; id++)
+    {
+      uint32_t n = graph_friends(g, id, &friends);
+      p->halves += n;
+      work -= n + 1;
+    }
+    p->next = id;
+    if (id < g->count)
+      return 1;
+    filter_size(p, p->halves);
+    p->next = 0;
+  }
+
+  /* ...then add them; changes to users already read are added as they
+     are made, by filter_link() */
+  for (id = p->next; id < g->count && work > 0; id++)
+  {
+    uint32_t n = graph_friends(g, id, &friends), i;
+    uint64_t hash = hash_name(graph_name(g, id));
+    for (i = 0; i < n; i++)
+      filter_add(p, filter_key(hash, hash_name(graph_name(g, friends[i]))));
+    p->keys += n;
+    work -= n + 1;
+  }
+  p->next = id;
+  if (id < g->count)
+    return 1;
+
+  filter_free(f);
+  g->filter = p;
+  g->pending = NULL;
+  return 0;
+}
+
+/*
+ * filter_size - give a filter room for twice `halves` keys
+ */
+static void filter_size(filter_t *f, long halves)
+{
+  uint64_t blocks = 64;
+
+  while (blocks * 512 < (uint64_t)halves * 2 * FILTER_BITS_PER_KEY)
+    blocks *= 2;
+  f->blocks = aligned_alloc(64, blocks * 64);
+  memset(f->blocks, 0, blocks * 64);
+  f->block_mask = blocks - 1;
+  f->capacity = blocks * 512 / FILTER_BITS_PER_KEY;
+}
+
+static void filter_free(filter_t *f)
+{
+  if (f == NULL)
+    return;
+  free(f->blocks);
+  free(f);
+}
+
+/*
+ * filter_link - add a new half friendship of user `u` to the filter in
+ *   use, and to one being built if it has read `u` already
+ */
+static void filter_link(graph_t *g, long u, const char *user, const char *friend)
+{
+  filter_t *f = g->filter, *p = g->pending;
+  int building = (p != NULL && p->blocks != NULL && u < p->next);
+  uint64_t key;
+
+  if (f == NULL && !building)
+    return;
+  key = filter_key(hash_name(user), hash_name(friend));
+  if (f != NULL)
+  {
+    filter_add(f, key);
+    f->keys++;
+  }
+  if (building)
+  {
+    filter_add(p, key);
+    p->keys++;
+  }
+}
+
+/*
+ * filter_unlink - count `count` halves of user `u` as removed, where
+ *   they have been added
+ */
+static void filter_unlink(graph_t *g, long u, long count)
+{
+  filter_t *p = g->pending;
+
+  if (g->filter != NULL)
+    g->filter->removed += count;
+  if (p != NULL && p->blocks != NULL && u < p->next)
+    p->removed += count;
+}
+
+/*
+ * filter_key - mix the hashes of a user and a friend into one key
+ *   (the finalizer of SplitMix64)
+ */
+static uint64_t filter_key(uint64_t user_hash, uint64_t friend_hash)
+{
+  uint64_t k = user_hash ^ (friend_hash * 0x9E3779B97F4A7C15ULL);
+
+  k = (k ^ (k >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  k = (k ^ (k >> 27)) * 0x94D049BB133111EBULL;
+  return k ^ (k >> 31);
+}
+
+/*
+ * filter_add - set the key's bits: the low bits of the key pick a
+ *   block, and each 9 bits of its remix pick one of the block's 512
+ */
+static void filter_add(filter_t *f, uint64_t key)
+{
+  uint64_t *block = f->blocks + (key & f->block_mask) * 8;
+  uint64_t bits = filter_key(key, 0);
+  int i;
+
+  for (i = 0; i < FILTER_HASHES; i++, bits >>= 9)
+    block[(bits >> 6) & 7] |= 1ULL << (bits & 63);
+}
+
+static int filter_test(filter_t *f, uint64_t key)
+{
+  const uint64_t *block = f->blocks + (key & f->block_mask) * 8;
+  uint64_t bits = filter_key(key, 0);
+  int i;
+
+  for (i = 0; i < FILTER_HASHES; i++, bits >>= 9)
+    if (!(block[(bits >> 6) & 7] & (1ULL << (bits & 63))))
+      return 0;
+  return 1;
+}
+
+int graph_is_friend(graph_t *g, const char *user, const char *friend)
+{
+  filter_t *f = g->filter;
+  const uint32_t *friends;
+  long u, v, at;
+  uint32_t n;
+
+  /* A filter that is due to be rebuilt is still right about "no" */
+  if (f != NULL && !filter_test(f, filter_key(hash_name(user), hash_name(friend))))
+    return 0;
+
+  if ((u = graph_find(g, user)) < 0 || (v = graph_find(g, friend)) < 0)
+    return 0;
+  n = graph_friends(g, u, &friends);
+  at = lower_bound(friends, n, v);
+  return (at < n && friends[at] == v);
+}
+
+/*
+ * name_bound - the index of the first of `ids`, in name order, whose
+ *   name is not less than `name`
+ */
+static long name_bound(graph_t *g, const uint32_t *ids, long n, const char *name)
+{
+  long lo = 0, hi = n;
+
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo) / 2;
+    if (strcmp(graph_name(g, ids[mid]), name) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int graph_friends_after(graph_t *g, long id, const char *after, int limit,
+                        uint32_t *ids)
+{
+  adj_t *a = &g->adj[id];
+  const uint32_t *friends;
+  long n, at = 0;
+
+  if (a->owned)
+  {
+    friends = a->by_name;
+    n = a->count;
+  }
+  else
+    n = graph_friends(g, id, &friends); /* in name order, as ids */
+
+  if (after != NULL)
+  {
+    at = name_bound(g, friends, n, after);
+    if (at < n && !strcmp(graph_name(g, friends[at]), after))
+      at++;
+  }
+  if (limit > n - at)
+    limit = n - at;
+  memcpy(ids, friends + at, limit * sizeof(uint32_t));
+  return limit;
+}
+
+uint64_t graph_version(graph_t *g, const char *user)
+{
+  long id = graph_find(g, user);
+
+  if (id < 0 || g->adj[id].version == 0)
+    return g->version;
+  return g->adj[id].version;
+}
+
+int graph_changes(graph_t *g, const char *user, uint64_t since,
+                  graph_change_t *changes)
+{
+  long id = graph_find(g, user);
+  adj_t *a;
+  change_t *recent;
+  uint32_t first, i, j;
+  int found = 0;
+
+  if (id < 0 || g->adj[id].version == 0)
+    return (since >= g->version ? 0 : -1);
+  a = &g->adj[id];
+  if (since < (a->logged ? a->logged : g->version))
+    return -1;
+
+  /* The changes after `since` are the end of the log; sort a copy of
+     them by friend, and then by when they were made */
+  for (first = a->change_count; first > 0 && a->changes[first - 1].version > since; first--)
+    ;
+  recent = malloc((a->change_count - first + 1) * sizeof(change_t));
+  memcpy(recent, a->changes + first, (a->change_count - first) * sizeof(change_t));
+  qsort(recent, a->change_count - first, sizeof(change_t), compare_changes);
+
+  /* A friend changed more than once was only gained (or lost) if the
+     first change and the last were both adds (or both removes) */
+  for (i = 0; i < a->change_count - first; i = j)
+  {
+    for (j = i + 1; j < a->change_count - first && recent[j].id == recent[i].id; j++)
+      ;
+    if (recent[i].added == recent[j - 1].added)
+    {
+      changes[found].id = recent[i].id;
+      changes[found].added = recent[i].added;
+      found++;
+    }
+  }
+  free(recent);
+  return found;
+}
+
+static int compare_changes(const void *a, const void *b)
+{
+  const change_t *x = a, *y = b;
+
+  if (x->id != y->id)
+    return (x->id < y->id ? -1 : 1);
+  return (x->version < y->version ? -1 : x->version > y->version);
+}
+
+void graph_carry(graph_t *to, graph_t *from)
+{
+  long id, other;
+  uint32_t i;
+
+  /* Users whose lists were replaced while `to` was built were stamped
+     afresh; start them from the old index's version like the rest */
+  to->version = from->version;
+  for (id = 0; id < to->count; id++)
+  {
+    to->adj[id].version = 0;
+    to->adj[id].change_count = 0;
+    to->adj[id].logged = 0;
+  }
+
+  for (id = 0; id < from->count; id++)
+  {
+    adj_t *f = &from->adj[id], *a;
+
+    if (f->version == 0 || (other = graph_find(to, graph_name(from, id))) < 0)
+      continue;
+    a = &to->adj[other];
+    a->version = f->version;
+    a->logged = f->logged;
+    free(a->changes);
+    a->changes = f->changes;
+    a->change_count = f->change_count;
+    a->change_alloc = f->change_alloc;
+    f->changes = NULL;
+    f->change_count = f->change_alloc = 0;
+
+    /* The same friends may have other ids here */
+    for (i = 0; i < a->change_count; i++)
+    {
+      long friend = graph_find(to, graph_name(from, a->changes[i].id));
+      if (friend < 0)
+      {
+        a->change_count = 0;
+        a->logged = a->version;
+        break;
+      }
+      a->changes[i].id = friend;
+    }
+  }
+
+  /* The filter is keyed by names, so it holds for `to` as it is */
+  filter_free(to->filter);
+  to->filter = from->filter;
+  from->filter = NULL;
+}
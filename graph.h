@@ -0,0 +1,151 @@
+/* An index of the friend graph by number. Every user has an id, and
+   each user's friends are kept as an array of ids in increasing order,
+   so graph queries work on integers instead of names. Users in the
+   snapshot keep their snapshot index as their id, and their friend
+   arrays are read from the snapshot until they change; users added
+   since get the ids after those.
+
+   Like the friend lists it mirrors, an index is not locked itself; the
+   caller holds the graph lock around every use. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct graph_t graph_t;
+
+/* Makes an index that starts out as the graph in `base` (which may be
+   NULL). The index keeps a reference to the snapshot. */
+graph_t *graph_make(snapshot_t *base);
+
+void graph_free(graph_t *g);
+
+/* Returns the number of ids, which are 0 to graph_count() - 1. */
+long graph_count(graph_t *g);
+
+/* Returns the id of `name`, or -1 if the index has no such user. */
+long graph_find(graph_t *g, const char *name);
+
+/* Returns the id of `name`, giving it the next id, as a user with no
+   friends, if the index has no such user yet. */
+long graph_add(graph_t *g, const char *name);
+
+/* Returns the name with id `id`. */
+const char *graph_name(graph_t *g, long id);
+
+/* Returns the number of friends of user `id`, and sets `*friends_p` to
+   their ids, in increasing order. The array is valid until the index
+   next changes. */
+uint32_t graph_friends(graph_t *g, long id, const uint32_t **friends_p);
+
+/* Records or removes one half of a friendship. */
+void graph_link(graph_t *g, const char *user, const char *friend);
+void graph_unlink(graph_t *g, const char *user, const char *friend);
+
+/* Replaces a user's friends with `friends`. */
+void graph_replace(graph_t *g, const char *user, const char **friends, int count);
+
+/* Stores the ids found in both `a` and `b`, both in increasing order,
+   into `out` (which must have room for the shorter of the two), and
+   returns how many there are. */
+size_t graph_intersect(const uint32_t *a, size_t na, const uint32_t *b, size_t nb,
+                       uint32_t *out);
+
+/* Ranks the users who are not friends of user `id` by how many friends
+   they share with the user, and stores the best `k` in `ids` and their
+   counts of mutual friends in `mutuals`, best first, ties going to the
+   lower id. Returns how many were stored. Large searches are split
+   across worker threads. */
+int graph_suggest(graph_t *g, long id, int k, uint32_t *ids, uint32_t *mutuals);
+
+/* Finds a shortest path of at most `max` steps from user `from` to
+   user `to`, searching from both ends at once, and stores its ids in
+   `path` (which must have room for `max` + 1). Returns the number of
+   ids on the path, or 0 if there is no such path. Large steps are
+   split across worker threads. */
+int graph_path(graph_t *g, long from, long to, int max, uint32_t *path);
+
+/* Counts of users by number of friends: */
+typedef struct
+{
+  long users;
+  long halves;         /* half friendships, two per friendship */
+  uint32_t max_degree;
+  long histogram[33];  /* [0] have no friends; [n] have 2^(n-1) to 2^n - 1 */
+} graph_stats_t;
+
+/* Fills in `stats`. The first call counts every user's friends; the
+   counts are kept up to date from then on. */
+void graph_stats(graph_t *g, graph_stats_t *stats);
+
+/* Stores the `k` users with the most friends in `ids`, and how many
+   friends each has in `degrees`, most first. Returns how many were
+   stored. Takes time in proportion to `k`, once graph_stats() or this
+   has been called. */
+int graph_top(graph_t *g, int k, uint32_t *ids, uint32_t *degrees);
+
+/* Returns a user in the same connected component as user `id`, which
+   is the same user for everyone in the component until the index next
+   changes, and sets `*size_p` (unless it is NULL) to the number of
+   users in the component. After a friendship has been removed, the
+   next call finds every component again, splitting that work across
+   worker threads; otherwise this takes about constant time. */
+long graph_component(graph_t *g, long id, long *size_p);
+
+/* Counts the triangles of friends: three users who are all friends of
+   each other. If `per_user` is not NULL, it must have room for
+   graph_count() counts, and each user's count of triangles is stored
+   there. The work is split across `threads` threads, or one per
+   processor if that is 0. */
+uint64_t graph_triangles(graph_t *g, int threads, uint64_t *per_user);
+
+/* Returns whether `friend` is a friend of `user`. Once the Bloom
+   filter has been built, most users who are not are ruled out by it
+   without looking either name up; the rest are checked against the
+   user's friends. */
+int graph_is_friend(graph_t *g, const char *user, const char *friend);
+
+/* Does about `work` steps of building graph_is_friend()'s filter, which
+   is due when there is none yet, or once removals have made the one in
+   use say "maybe" too often or it has outgrown its size. Returns 1
+   while there is more to do, and 0 once the filter is up to date; the
+   lock may be let go between calls, and changes go on meanwhile. */
+int graph_filter_step(graph_t *g, long work);
+
+/* Stores in `ids` up to `limit` friends of user `id` whose names come
+   after `after` (or from the first, if `after` is NULL), in name
+   order, and returns how many. Takes time in proportion to `limit`
+   and the log of the number of friends. */
+int graph_friends_after(graph_t *g, long id, const char *after, int limit,
+                        uint32_t *ids);
+
+/* Returns a version of `user`'s friends, which changes whenever they
+   do. Versions are never reused within a process, even by a later
+   index that replaces this one; a new index starts every user at a new
+   version of its own, unless graph_carry() is used. */
+uint64_t graph_version(graph_t *g, const char *user);
+
+/* Gives every user in `to` the version and change log they have in
+   `from`, for when `to` was built from the same friend lists, so that
+   neither changes for users whose friends have not; `from`'s filter
+   for graph_is_friend() comes along too. The change logs are moved,
+   not copied; `from` is only fit to be freed afterwards. */
+void graph_carry(graph_t *to, graph_t *from);
+
+/* A friend added or removed: */
+typedef struct
+{
+  uint32_t id;
+  int added;
+} graph_change_t;
+
+/* The most changes kept for a user, and so the most that
+   graph_changes() stores: */
+#define GRAPH_CHANGES_MAX 128
+
+/* Stores in `changes` the friends that `user` has gained or lost since
+   version `since` of their friends, each friend once, in id order, and
+   returns how many there are. Only a user's last few changes are kept,
+   so if `since` is older than those (or older than the index itself),
+   returns -1 instead. */
+int graph_changes(graph_t *g, const char *user, uint64_t since,
+                  graph_change_t *changes);
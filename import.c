@@ -0,0 +1,409 @@
+/*
+ * import.c - build a friend-graph snapshot from an edge-list file
+ *
+ *   friendlist-import [-t threads] <edges> <snapshot>
+ *
+ * Each line of the edge list is "user<TAB>friend", and records a
+ * friendship in both directions, as /befriend does. The file is mapped
+ * copy-on-write and cut into one piece per thread at line boundaries;
+ * each thread ends names in place with NULs, collects the half
+ * friendships it finds and sorts them. The sorted runs are then merged,
+ * dropping duplicates: keys sampled from every run cut the merged order
+ * into one range per thread, and each thread merges its range of every
+ * run with a heap. The result is written with snapshot_write(), so the
+ * server can start from it with -s.
+ */
+#include "csapp.h"
+#include "snapshot.h"
+
+#define MAX_THREADS 64
+
+/* One half of a friendship: */
+typedef struct
+{
+  const char *user, *friend;
+} half_t;
+
+/* A piece of the file, and the sorted half friendships found in it: */
+typedef struct
+{
+  char *start, *end;
+  half_t *halves;
+  size_t count, alloc;
+  long lines, skipped;
+} piece_t;
+
+/* One thread's share of the merge: the part of each piece from
+   at[i] to end[i], merged into `out` (a slice of the whole list) with
+   a heap of the pieces whose parts are not used up: */
+typedef struct
+{
+  piece_t *pieces;
+  size_t at[MAX_THREADS], end[MAX_THREADS];
+  int heap[MAX_THREADS], size;
+  half_t *out;
+  size_t count;
+} range_t;
+
+/* The merged graph, handed to snapshot_write(): */
+typedef struct
+{
+  half_t *halves;
+  size_t count;
+} graph_t;
+
+static void *parse_piece(void *arg);
+static void add_half(piece_t *p, const char *user, const char *friend);
+static int compare_halves(const void *a, const void *b);
+static graph_t merge_pieces(piece_t *pieces, int n);
+static size_t lower_bound(piece_t *p, const half_t *key);
+static void *merge_range(void *arg);
+static int heap_less(range_t *r, int a, int b);
+static void heap_down(range_t *r, int i);
+static void start_thread(pthread_t *tid, void *(*run)(void *), void *arg);
+static void walk_graph(void *walk_arg, snapshot_emit_t emit, void *ctx);
+static long millis_since(struct timeval *start);
+
+int main(int argc, char **argv)
+{
+  struct timeval start;
+  piece_t pieces[MAX_THREADS];
+  pthread_t tids[MAX_THREADS];
+  struct stat st;
+  char *data;
+  graph_t graph;
+  long lines = 0, skipped = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt, fd, i;
+
+  while ((opt = getopt(argc, argv, "t:")) != -1)
+  {
+    if (opt == 't')
+      threads = atoi(optarg);
+    else
+      break;
+  }
+  if (optind + 2 != argc)
+  {
+    fprintf(stderr, "usage: %s [-t threads] <edges> <snapshot>\n", argv[0]);
+    exit(1);
+  }
+  if (threads < 1)
+    threads = 1;
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  gettimeofday(&start, NULL);
+  if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+  {
+    fprintf(stderr, "cannot read %s: %s\n", argv[optind], strerror(errno));
+    exit(1);
+  }
+  /* One spare byte past the end, so the last name can be ended too */
+  data = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    fprintf(stderr, "cannot map %s: %s\n", argv[optind], strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  if (st.st_size % sysconf(_SC_PAGESIZE) == 0)
+  {
+    /* ...unless the file fills its last page, so there is no spare */
+    munmap(data, st.st_size + 1);
+    data = malloc(st.st_size + 1);
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || read(fd, data, st.st_size) != st.st_size)
+    {
+      fprintf(stderr, "cannot read %s\n", argv[optind]);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  /* Cut the file into pieces that each end after a newline */
+  char *at = data, *end = data + st.st_size;
+  if (end > data && end[-1] != '\n')
+    *end++ = '\n';
+  for (i = 0; i < threads; i++)
+  {
+    char *cut = (i == threads - 1 ? end : data + st.st_size / threads * (i + 1));
+    if (cut < at)
+      cut = at;
+    while (cut > data && cut < end && cut[-1] != '\n')
+      cut++;
+    memset(&pieces[i], 0, sizeof(piece_t));
+    pieces[i].start = at;
+    pieces[i].end = cut;
+    at = cut;
+    start_thread(&tids[i], parse_piece, &pieces[i]);
+  }
+  for (i = 0; i < threads; i++)
+  {
+    pthread_join(tids[i], NULL);
+    lines += pieces[i].lines;
+    skipped += pieces[i].skipped;
+  }
+  long parse_ms = millis_since(&start);
+
+  graph = merge_pieces(pieces, threads);
+  long merge_ms = millis_since(&start);
+
+  if (snapshot_write(argv[optind + 1], walk_graph, &graph) < 0)
+  {
+    fprintf(stderr, "cannot write %s: %s\n", argv[optind + 1], strerror(errno));
+    exit(1);
+  }
+
+  printf("%ld lines (%ld skipped), %zu half friendships, %d threads\n", lines,
+         skipped, graph.count, threads);
+  printf("parsed in %ld ms, merged in %ld ms, written in %ld ms\n", parse_ms,
+         merge_ms - parse_ms, millis_since(&start) - merge_ms);
+  return 0;
+}
+
+/*
+ * parse_piece - split one piece of the file into half friendships, and
+ *   sort them
+ */
+static void *parse_piece(void *arg)
+{
+  piece_t *p = arg;
+  char *line = p->start;
+
+  while (line < p->end)
+  {
+    char *nl = memchr(line, '\n', p->end - line);
+    char *tab = memchr(line, '\t', nl - line);
+    char *next = nl + 1;
+
+    if (nl > line && nl[-1] == '\r')
+      nl--;
+    if (nl > line)
+    {
+      p->lines++;
+      if (tab == NULL || tab == line || tab + 1 == nl
+          || memchr(tab + 1, '\t', nl - tab - 1) != NULL)
+        p->skipped++;
+      else
+      {
+        *tab = 0;
+        *nl = 0;
+        if (strcmp(line, tab + 1) != 0)
+        {
+          add_half(p, line, tab + 1);
+          add_half(p, tab + 1, line);
+        }
+      }
+    }
+    line = next;
+  }
+
+  qsort(p->halves, p->count, sizeof(half_t), compare_halves);
+  return NULL;
+}
+
+static void add_half(piece_t *p, const char *user, const char *friend)
+{
+  if (p->count == p->alloc)
+  {
+    p->alloc = (p->alloc ? p->alloc * 2 : 1024);
+    p->halves = realloc(p->halves, p->alloc * sizeof(half_t));
+  }
+  p->halves[p->count].user = user;
+  p->halves[p->count].friend = friend;
+  p->count++;
+}
+
+static int compare_halves(const void *a, const void *b)
+{
+  const half_t *x = a, *y = b;
+  int c = strcmp(x->user, y->user);
+  return (c ? c : strcmp(x->friend, y->friend));
+}
+
+/*
+ * merge_pieces - merge the sorted pieces into one sorted list without
+ *   duplicates, on one thread per piece
+ */
+static graph_t merge_pieces(piece_t *pieces, int n)
+{
+  graph_t graph = {NULL, 0};
+  range_t *ranges = calloc(n, sizeof(range_t));
+  pthread_t tids[MAX_THREADS];
+  half_t *samples = malloc(n * n * sizeof(half_t));
+  size_t total = 0, sampled = 0, offset = 0;
+  int i, k;
+
+  /* Sample each piece evenly; the sorted samples split the merged
+     order into ranges of about the same size */
+  for (i = 0; i < n; i++)
+  {
+    total += pieces[i].count;
+    for (k = 0; k < n && pieces[i].count > 0; k++)
+      samples[sampled++] = pieces[i].halves[pieces[i].count * k / n];
+  }
+  qsort(samples, sampled, sizeof(half_t), compare_halves);
+  graph.halves = malloc((total + 1) * sizeof(half_t));
+
+  /* Equal halves fall on the same side of every cut, so each range
+     drops its own duplicates */
+  for (i = 0; i < n; i++)
+  {
+    size_t cut = 0;
+    for (k = 0; k < n; k++)
+    {
+      ranges[k].at[i] = cut;
+      cut = (k == n - 1 || sampled == 0
+                 ? pieces[i].count
+                 : lower_bound(&pieces[i], &samples[sampled * (k + 1) / n]));
+      ranges[k].end[i] = cut;
+    }
+  }
+  for (k = 0; k < n; k++)
+  {
+    ranges[k].pieces = pieces;
+    ranges[k].out = graph.halves + offset;
+    for (i = 0; i < n; i++)
+    {
+      offset += ranges[k].end[i] - ranges[k].at[i];
+      if (ranges[k].at[i] < ranges[k].end[i])
+        ranges[k].heap[ranges[k].size++] = i;
+    }
+    start_thread(&tids[k], merge_range, &ranges[k]);
+  }
+
+  /* Close the gaps the dropped duplicates left between ranges */
+  for (k = 0; k < n; k++)
+  {
+    pthread_join(tids[k], NULL);
+    memmove(graph.halves + graph.count, ranges[k].out,
+            ranges[k].count * sizeof(half_t));
+    graph.count += ranges[k].count;
+  }
+
+  for (i = 0; i < n; i++)
+    free(pieces[i].halves);
+  free(samples);
+  free(ranges);
+  return graph;
+}
+
+/*
+ * lower_bound - the first half in a piece that is not less than `key`
+ */
+static size_t lower_bound(piece_t *p, const half_t *key)
+{
+  size_t lo = 0, hi = p->count;
+
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compare_halves(&p->halves[mid], key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * merge_range - merge one range of every piece, taking the least head
+ *   from the heap each time
+ */
+static void *merge_range(void *arg)
+{
+  range_t *r = arg;
+  int i;
+
+  for (i = r->size / 2 - 1; i >= 0; i--)
+    heap_down(r, i);
+  while (r->size > 0)
+  {
+    int top = r->heap[0];
+    half_t *h = &r->pieces[top].halves[r->at[top]++];
+
+    if (r->count == 0 || compare_halves(h, &r->out[r->count - 1]))
+      r->out[r->count++] = *h;
+    if (r->at[top] == r->end[top])
+      r->heap[0] = r->heap[--r->size];
+    heap_down(r, 0);
+  }
+  return NULL;
+}
+
+static int heap_less(range_t *r, int a, int b)
+{
+  return compare_halves(&r->pieces[a].halves[r->at[a]],
+                        &r->pieces[b].halves[r->at[b]]) < 0;
+}
+
+static void heap_down(range_t *r, int i)
+{
+  while (1)
+  {
+    int least = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < r->size && heap_less(r, r->heap[left], r->heap[least]))
+      least = left;
+    if (right < r->size && heap_less(r, r->heap[right], r->heap[least]))
+      least = right;
+    if (least == i)
+      return;
+    int swap = r->heap[i];
+    r->heap[i] = r->heap[least];
+    r->heap[least] = swap;
+    i = least;
+  }
+}
+
+/*
+ * start_thread - start a worker, giving up on the import if it cannot
+ */
+static void start_thread(pthread_t *tid, void *(*run)(void *), void *arg)
+{
+  int err = pthread_create(tid, NULL, run, arg);
+
+  if (err != 0)
+  {
+    fprintf(stderr, "cannot start a thread: %s\n", strerror(err));
+    exit(1);
+  }
+}
+
+/*
+ * walk_graph - report each user with the user's friends; the list is
+ *   sorted by user, so each user's halves are together
+ */
+static void walk_graph(void *walk_arg, snapshot_emit_t emit, void *ctx)
+{
+  graph_t *graph = walk_arg;
+  const char **friends = NULL;
+  size_t i = 0, alloc = 0;
+
+  while (i < graph->count)
+  {
+    const char *user = graph->halves[i].user;
+    size_t n = 0;
+
+    for (; i < graph->count && !strcmp(graph->halves[i].user, user); i++)
+    {
+      if (n == alloc)
+      {
+        alloc = (alloc ? alloc * 2 : 64);
+        friends = realloc(friends, alloc * sizeof(char *));
+      }
+      friends[n++] = graph->halves[i].friend;
+    }
+    emit(ctx, user, friends, n);
+  }
+  free(friends);
+}
+
+static long millis_since(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000L
+         + (now.tv_usec - start->tv_usec) / 1000;
+}
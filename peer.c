@@ -0,0 +1,500 @@
+/*
+ * peer.c - pooled HTTP/1.1 connections to other friendlist servers
+ *
+ * Idle connections are kept per "host:port" and handed out newest
+ * first, since those are the least likely to have been closed by the
+ * peer. Before a connection is reused it gets a zero-timeout poll():
+ * a healthy idle connection has nothing to read, so readability means
+ * the peer closed it (or sent something we did not ask for).
+ */
+#include <poll.h>
+#include <time.h>
+#include "csapp.h"
+#include "dictionary.h"
+#include "more_string.h"
+#include "peer.h"
+#include "resolver.h"
+
+/* Idle connections kept for each peer: */
+#define PEER_MAX_IDLE 8
+/* Seconds before an idle connection is evicted; kept below the
+   server's own keep-alive timeout so that we usually close first: */
+#define PEER_IDLE_TIMEOUT 10
+/* Seconds a request may wait on a peer that has stopped answering: */
+#define PEER_REQUEST_TIMEOUT 10
+
+typedef struct
+{
+  int fd;
+  time_t last_used;
+} idle_conn_t;
+
+typedef struct
+{
+  int count;
+  idle_conn_t idle[PEER_MAX_IDLE]; /* oldest first */
+} peer_pool_t;
+
+static dictionary_t *pools; /* "host:port" -> peer_pool_t* */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void evict_idle(time_t now);
+static int is_healthy(int fd);
+static int acquire_conn(const char *host, const char *port, int *reused);
+static int connect_peer(const char *host, const char *port);
+static int exchange(int fd, const char *request, size_t request_len,
+                    peer_response_t *resp, int *keep_p, int *sent_p);
+static int read_head(rio_t *rio, char **version_p, int *status_p,
+                     dictionary_t **headers_p);
+static int read_chunked(rio_t *rio, char **body_p, size_t *len_p);
+static int read_to_close(rio_t *rio, char **body_p, size_t *len_p);
+
+int peer_request(const char *host, const char *port,
+                 const char *method, const char *path,
+                 const char *extra_headers,
+                 const char *body, size_t body_len,
+                 peer_response_t *resp)
+{
+  char *request;
+  size_t request_len;
+  int attempt, fd, reused, keep, sent, rc = -1;
+  struct timeval timeout = {PEER_REQUEST_TIMEOUT, 0};
+
+  request = peer_format_request(host, port, method, path, extra_headers,
+                                body, body_len, &request_len);
+
+  for (attempt = 0; attempt < 2; attempt++)
+  {
+    /* The retry always uses a fresh connection */
+    if (attempt == 0)
+      fd = acquire_conn(host, port, &reused);
+    else
+    {
+      fd = connect_peer(host, port);
+      reused = 0;
+    }
+    if (fd < 0)
+      break;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (exchange(fd, request, request_len, resp, &keep, &sent) == 0)
+    {
+      if (keep)
+        peer_pool_give(host, port, fd);
+      else
+        close(fd);
+      rc = 0;
+      break;
+    }
+
+    close(fd);
+    /* The peer may have acted on a request it got before the
+       connection broke, so only a GET is sent twice */
+    if (!reused || (sent && strcasecmp(method, "GET")))
+      break;
+  }
+
+  free(request);
+  return rc;
+}
+
+char *peer_format_request(const char *host, const char *port,
+                          const char *method, const char *path,
+                          const char *extra_headers,
+                          const char *body, size_t body_len,
+                          size_t *len_p)
+{
+  char *request, *len_str;
+  size_t len;
+
+  request = append_strings(method, " ", path, " HTTP/1.1\r\n",
+                           "Host: ", host, ":", port, "\r\n",
+                           (extra_headers ? extra_headers : ""),
+                           "Content-Length: ", len_str = to_string(body_len), "\r\n\r\n",
+                           NULL);
+  free(len_str);
+  len = strlen(request);
+  if (body_len > 0)
+  {
+    request = realloc(request, len + body_len);
+    memcpy(request + len, body, body_len);
+    len += body_len;
+  }
+
+  *len_p = len;
+  return request;
+}
+
+/*
+ * peer_body_length - a response to a request (never HEAD) has no body
+ *   if it is interim (1xx), 204 or 304; otherwise Transfer-Encoding
+ *   overrides Content-Length, and without either the body runs to the
+ *   end of the connection
+ */
+long peer_body_length(int status, dictionary_t *headers)
+{
+  const char *coding = dictionary_get(headers, "Transfer-Encoding");
+  const char *len_str = dictionary_get(headers, "Content-Length");
+  const char *last;
+  char *end;
+  unsigned long len;
+
+  if ((status >= 100 && status < 200) || status == 204 || status == 304)
+    return 0;
+
+  if (coding != NULL)
+  {
+    /* Only a body whose last coding is chunked ends before the connection */
+    last = strrchr(coding, ',');
+    last = (last ? last + 1 : coding);
+    last += strspn(last, " \t");
+    if (!strncasecmp(last, "chunked", 7)
+        && strspn(last + 7, " \t") == strlen(last + 7))
+      return PEER_BODY_CHUNKED;
+    return PEER_BODY_TO_CLOSE;
+  }
+
+  if (len_str == NULL)
+    return PEER_BODY_TO_CLOSE;
+  if (!isdigit((unsigned char)len_str[0]))
+    return PEER_BODY_BAD;
+  errno = 0;
+  len = strtoul(len_str, &end, 10);
+  if (errno != 0 || strspn(end, " \t") != strlen(end) || len > PEER_MAX_BODY)
+    return PEER_BODY_BAD;
+  return len;
+}
+
+void peer_response_free(peer_response_t *resp)
+{
+  free_dictionary(resp->headers);
+  free(resp->body);
+}
+
+int peer_pool_take(const char *host, const char *port)
+{
+  char *key = append_strings(host, ":", port, NULL);
+  peer_pool_t *pool;
+  int fd;
+
+  while (1)
+  {
+    fd = -1;
+    pthread_mutex_lock(&pools_lock);
+    evict_idle(time(NULL));
+    pool = (pools ? dictionary_get(pools, key) : NULL);
+    if (pool && pool->count > 0)
+      fd = pool->idle[--pool->count].fd;
+    pthread_mutex_unlock(&pools_lock);
+
+    if (fd < 0 || is_healthy(fd))
+      break;
+    close(fd);
+  }
+
+  free(key);
+  return fd;
+}
+
+/*
+ * peer_pool_give - closes the oldest idle connection if the pool is
+ *   already full
+ */
+void peer_pool_give(const char *host, const char *port, int fd)
+{
+  char *key = append_strings(host, ":", port, NULL);
+  peer_pool_t *pool;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&pools_lock);
+  evict_idle(now);
+  if (!pools)
+    pools = make_dictionary(COMPARE_CASE_INSENS, free);
+  pool = dictionary_get(pools, key);
+  if (!pool)
+  {
+    pool = calloc(1, sizeof(peer_pool_t));
+    dictionary_set(pools, key, pool);
+  }
+
+  if (pool->count == PEER_MAX_IDLE)
+  {
+    close(pool->idle[0].fd);
+    memmove(pool->idle, pool->idle + 1, (PEER_MAX_IDLE - 1) * sizeof(idle_conn_t));
+    pool->count--;
+  }
+  pool->idle[pool->count].fd = fd;
+  pool->idle[pool->count].last_used = now;
+  pool->count++;
+  pthread_mutex_unlock(&pools_lock);
+
+  free(key);
+}
+
+/*
+ * evict_idle - close every pooled connection that has been idle for
+ *   too long; must be called with `pools_lock` held
+ */
+static void evict_idle(time_t now)
+{
+  size_t i;
+  int j, kept;
+
+  if (!pools)
+    return;
+
+  for (i = 0; i < dictionary_count(pools); i++)
+  {
+    peer_pool_t *pool = dictionary_value(pools, i);
+    kept = 0;
+    for (j = 0; j < pool->count; j++)
+    {
+      if (now - pool->idle[j].last_used >= PEER_IDLE_TIMEOUT)
+        close(pool->idle[j].fd);
+      else
+        pool->idle[kept++] = pool->idle[j];
+    }
+    pool->count = kept;
+  }
+}
+
+static int is_healthy(int fd)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) == 0;
+}
+
+/*
+ * acquire_conn - take the newest healthy idle connection to a peer,
+ *   or open a new one if there is none
+ */
+static int acquire_conn(const char *host, const char *port, int *reused)
+{
+  int fd = peer_pool_take(host, port);
+
+  *reused = (fd >= 0);
+  if (fd < 0)
+    fd = connect_peer(host, port);
+  return fd;
+}
+
+/*
+ * connect_peer - like open_clientfd(), but resolves the host through
+ *   the shared resolver cache
+ */
+static int connect_peer(const char *host, const char *port)
+{
+  struct addrinfo *listp, *p;
+  int fd = -1;
+
+  if (resolver_lookup(host, port, &listp) != 0)
+    return -1;
+
+  for (p = listp; p; p = p->ai_next)
+  {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+
+  free(listp);
+  return fd;
+}
+
+/*
+ * exchange - send one request and read its response, reporting in
+ *   `*keep_p` whether the connection can carry another request, and in
+ *   `*sent_p` whether any of the request was written before a failure
+ */
+static int exchange(int fd, const char *request, size_t request_len,
+                    peer_response_t *resp, int *keep_p, int *sent_p)
+{
+  char *version = NULL, *connection, *body = NULL;
+  rio_t rio;
+  dictionary_t *headers = NULL;
+  int status, rc;
+  long framing;
+  size_t len = 0;
+  ssize_t first;
+
+  *sent_p = 0;
+  if ((first = write(fd, request, request_len)) < 0)
+    return -1;
+  *sent_p = 1;
+  if (rio_writen(fd, (void *)(request + first), request_len - first) < 0)
+    return -1;
+
+  /* An interim 1xx response may come before the real one */
+  rio_readinitb(&rio, fd);
+  do
+  {
+    if (headers != NULL)
+    {
+      free_dictionary(headers);
+      free(version);
+    }
+    if (read_head(&rio, &version, &status, &headers) < 0)
+      return -1;
+  } while (status >= 100 && status < 200);
+
+  connection = dictionary_get(headers, "Connection");
+  if (connection)
+    *keep_p = !strcasecmp(connection, "keep-alive");
+  else
+    *keep_p = !strcasecmp(version, "HTTP/1.1");
+
+  framing = peer_body_length(status, headers);
+  if (framing == PEER_BODY_CHUNKED)
+    rc = read_chunked(&rio, &body, &len);
+  else if (framing == PEER_BODY_TO_CLOSE)
+  {
+    rc = read_to_close(&rio, &body, &len);
+    *keep_p = 0;
+  }
+  else if (framing >= 0)
+  {
+    len = framing;
+    body = malloc(len + 1);
+    rc = (rio_readnb(&rio, body, len) == (ssize_t)len ? 0 : -1);
+  }
+  else
+    rc = -1;
+  free(version);
+  if (rc < 0)
+  {
+    free(body);
+    free_dictionary(headers);
+    return -1;
+  }
+  body[len] = 0;
+
+  /* Anything left in the buffer would be mistaken for the next response */
+  if (rio.rio_cnt > 0)
+    *keep_p = 0;
+
+  resp->status = status;
+  resp->headers = headers;
+  resp->body = body;
+  resp->len = len;
+  return 0;
+}
+
+/*
+ * read_head - read a status line and headers, storing the HTTP version
+ *   in `*version_p` and the status in `*status_p`; on failure nothing
+ *   is left allocated
+ */
+static int read_head(rio_t *rio, char **version_p, int *status_p,
+                     dictionary_t **headers_p)
+{
+  char buf[MAXLINE], *status;
+  dictionary_t *headers;
+
+  if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+    return -1;
+  if (!parse_status_line(buf, version_p, &status, NULL))
+    return -1;
+  *status_p = atoi(status);
+  free(status);
+
+  headers = make_dictionary(COMPARE_CASE_INSENS, free);
+  while (1)
+  {
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+    {
+      free_dictionary(headers);
+      free(*version_p);
+      return -1;
+    }
+    if (!strcmp(buf, "\r\n"))
+      break;
+    parse_header_line(buf, headers);
+  }
+
+  *headers_p = headers;
+  return 0;
+}
+
+/*
+ * read_chunked - read a chunked body into a malloced buffer with room
+ *   for a NUL, skipping chunk extensions and trailers
+ */
+static int read_chunked(rio_t *rio, char **body_p, size_t *len_p)
+{
+  char buf[MAXLINE], *end;
+  size_t len = 0, alloc = MAXBUF;
+  char *body = malloc(alloc + 1);
+  unsigned long size;
+
+  *body_p = body;
+  while (1)
+  {
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0 || !isxdigit((unsigned char)buf[0]))
+      return -1;
+    errno = 0;
+    size = strtoul(buf, &end, 16);
+    if (errno != 0 || (*end != ';' && *end != '\r')
+        || size > PEER_MAX_BODY - len)
+      return -1;
+    if (size == 0)
+      break;
+
+    if (len + size > alloc)
+    {
+      while (len + size > alloc)
+        alloc *= 2;
+      *body_p = body = realloc(body, alloc + 1);
+    }
+    if (rio_readnb(rio, body + len, size) != (ssize_t)size)
+      return -1;
+    len += size;
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0 || strcmp(buf, "\r\n"))
+      return -1;
+  }
+
+  /* Trailers end with an empty line */
+  do
+  {
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+      return -1;
+  } while (strcmp(buf, "\r\n"));
+
+  *len_p = len;
+  return 0;
+}
+
+/*
+ * read_to_close - read a body that runs to the end of the connection
+ *   into a malloced buffer with room for a NUL
+ */
+static int read_to_close(rio_t *rio, char **body_p, size_t *len_p)
+{
+  size_t len = 0, alloc = MAXBUF;
+  char *body = malloc(alloc + 1);
+  ssize_t n;
+
+  *body_p = body;
+  while ((n = rio_readnb(rio, body + len, alloc - len)) > 0)
+  {
+    len += n;
+    if (len == alloc)
+    {
+      if (alloc >= PEER_MAX_BODY)
+        return -1;
+      *body_p = body = realloc(body, (alloc *= 2) + 1);
+    }
+  }
+  if (n < 0)
+    return -1;
+
+  *len_p = len;
+  return 0;
+}
@@ -0,0 +1,64 @@
+/* A small HTTP/1.1 client for talking to other friendlist servers.
+   Connections are kept in a pool per (host, port), so repeated
+   requests to the same peer reuse a warm socket instead of paying for
+   a new TCP handshake each time. */
+
+/* A response from a peer. `headers` maps each (case-insensitive)
+   header name to its value, and `body` is a `malloc`ed,
+   NUL-terminated copy of the `len`-byte body. */
+typedef struct peer_response_t {
+  int status;
+  dictionary_t *headers;
+  char *body;
+  size_t len;
+} peer_response_t;
+
+/* Sends a `method` request for `path` to `host`:`port` and reads the
+   response into `resp`. `extra_headers` can be NULL or a string of
+   complete "\r\n"-terminated header lines, and `body` can be NULL
+   when `body_len` is 0. A pooled connection that turns out to be
+   stale is retried once on a fresh connection, but for a method other
+   than GET only if none of the request had been written, since the
+   peer may already have acted on it. Returns 0 on success
+   and -1 if no response could be read, in which case `resp` is left
+   untouched. */
+int peer_request(const char *host, const char *port,
+                 const char *method, const char *path,
+                 const char *extra_headers,
+                 const char *body, size_t body_len,
+                 peer_response_t *resp);
+
+/* Returns a freshly allocated request as peer_request() would send
+   it, storing its length (which includes the body) in `*len_p`. */
+char *peer_format_request(const char *host, const char *port,
+                          const char *method, const char *path,
+                          const char *extra_headers,
+                          const char *body, size_t body_len,
+                          size_t *len_p);
+
+/* The largest response body accepted from a peer: */
+#define PEER_MAX_BODY (64L << 20)
+
+/* How peer_body_length() says the body is framed, when it does not
+   have a length: chunked, running to the end of the connection, or
+   framed by a Content-Length that is malformed or over PEER_MAX_BODY. */
+#define PEER_BODY_CHUNKED (-1)
+#define PEER_BODY_TO_CLOSE (-2)
+#define PEER_BODY_BAD (-3)
+
+/* Returns the length of the body that follows a response head with
+   `status` and `headers` (0 for 1xx, 204 and 304, which have none),
+   or one of the PEER_BODY_ values above. */
+long peer_body_length(int status, dictionary_t *headers);
+
+/* Releases everything owned by a response filled in by
+   peer_request(). */
+void peer_response_free(peer_response_t *resp);
+
+/* Takes the newest healthy idle connection to `host`:`port` out of
+   the pool, returning -1 if there is none. */
+int peer_pool_take(const char *host, const char *port);
+
+/* Returns a (blocking) connection that can carry another request to
+   `host`:`port` to the pool. */
+void peer_pool_give(const char *host, const char *port, int fd);
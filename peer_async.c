@@ -0,0 +1,673 @@
+/*
+ * peer_async.c - event-loop driven GET requests to peer servers
+ *
+ * One thread runs an epoll loop over every outstanding request. A
+ * request that can reuse a pooled connection starts out sending;
+ * otherwise it connects without blocking, trying each resolved
+ * address in turn. Addresses come from the resolver cache; only a
+ * host that is not cached yet sends the request to a resolver thread
+ * first (getaddrinfo() has no non-blocking form). New and resolved
+ * requests reach the loop through a queue, with an eventfd to wake it
+ * up.
+ *
+ * A job is on exactly one of the ready queue, the resolve queue, or
+ * the loop's active list, so they share the `next` link.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include "csapp.h"
+#include "dictionary.h"
+#include "more_string.h"
+#include "peer.h"
+#include "peer_async.h"
+#include "resolver.h"
+
+/* Seconds a request may take from start to finish: */
+#define ASYNC_TIMEOUT 10
+#define RESOLVER_THREADS 4
+#define MAX_EVENTS 64
+
+typedef enum
+{
+  STATE_RESOLVE,
+  STATE_CONNECT,
+  STATE_SEND,
+  STATE_RECV
+} job_state_t;
+
+/* What a chunked body expects on its next line: */
+typedef enum
+{
+  CHUNK_SIZE,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER
+} chunk_state_t;
+
+typedef struct async_job_t
+{
+  job_state_t state;
+  char *host, *port;
+  char *request;
+  size_t request_len, sent;
+  int fd, reused, watched;
+  struct addrinfo *addrs, *next_addr;
+
+  char *buf; /* response bytes so far */
+  size_t len, alloc;
+  size_t head_len; /* through the blank line, or 0 if not seen yet */
+  long body_len;   /* or PEER_BODY_CHUNKED or PEER_BODY_TO_CLOSE */
+  int status;
+
+  /* A chunked body is decoded in place, down to just after the head: */
+  size_t chunk_at;   /* next byte not decoded yet */
+  size_t chunk_left; /* of the current chunk's data */
+  size_t decoded;    /* body bytes so far */
+  chunk_state_t chunk_state;
+  dictionary_t *headers;
+
+  time_t deadline;
+  peer_callback_t done;
+  void *arg;
+  struct async_job_t *next, *prev;
+} async_job_t;
+
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static int epfd, wakefd;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_ready = PTHREAD_COND_INITIALIZER;
+static async_job_t *ready_head, *ready_tail;
+static async_job_t *resolve_head, *resolve_tail;
+
+/* Only touched by the loop thread: */
+static async_job_t *active;
+
+static void start_threads(void);
+static void *loop_main(void *arg);
+static void *resolver_main(void *arg);
+static void enqueue(async_job_t **head, async_job_t **tail, async_job_t *job);
+static async_job_t *dequeue(async_job_t **head, async_job_t **tail);
+static void enqueue_ready(async_job_t *job);
+static void enqueue_resolve(async_job_t *job);
+static void activate(async_job_t *job);
+static void deactivate(async_job_t *job);
+static void watch(async_job_t *job, unsigned int events);
+static void drop_fd(async_job_t *job);
+static void try_connect(async_job_t *job);
+static void advance(async_job_t *job);
+static int parse_head(async_job_t *job);
+static int body_complete(async_job_t *job);
+static int decode_chunks(async_job_t *job);
+static void retry_or_fail(async_job_t *job);
+static void complete(async_job_t *job);
+static void fail(async_job_t *job);
+static void free_job(async_job_t *job);
+
+void peer_async_get(const char *host, const char *port, const char *path,
+                    const char *extra_headers,
+                    peer_callback_t done, void *arg)
+{
+  async_job_t *job;
+
+  pthread_once(&start_once, start_threads);
+
+  job = calloc(1, sizeof(async_job_t));
+  job->host = strdup(host);
+  job->port = strdup(port);
+  job->request = peer_format_request(host, port, "GET", path, extra_headers,
+                                     NULL, 0, &job->request_len);
+  job->body_len = PEER_BODY_TO_CLOSE;
+  job->deadline = time(NULL) + ASYNC_TIMEOUT;
+  job->done = done;
+  job->arg = arg;
+
+  job->fd = peer_pool_take(host, port);
+  if (job->fd >= 0)
+  {
+    fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) | O_NONBLOCK);
+    job->reused = 1;
+    job->state = STATE_SEND;
+    enqueue_ready(job);
+  }
+  else if (resolver_cached(host, port, &job->addrs) == 0)
+  {
+    job->next_addr = job->addrs;
+    job->state = STATE_CONNECT;
+    enqueue_ready(job);
+  }
+  else
+  {
+    job->state = STATE_RESOLVE;
+    enqueue_resolve(job);
+  }
+}
+
+static void start_threads(void)
+{
+  struct epoll_event ev;
+  pthread_t tid;
+  int i;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+  pthread_create(&tid, NULL, loop_main, NULL);
+  pthread_detach(tid);
+  for (i = 0; i < RESOLVER_THREADS; i++)
+  {
+    pthread_create(&tid, NULL, resolver_main, NULL);
+    pthread_detach(tid);
+  }
+}
+
+static void *loop_main(void *arg)
+{
+  struct epoll_event events[MAX_EVENTS];
+  async_job_t *job, *next;
+  uint64_t count;
+  time_t now;
+  int i, n;
+
+  while (1)
+  {
+    n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    for (i = 0; i < n; i++)
+    {
+      if (events[i].data.ptr == NULL)
+      {
+        if (read(wakefd, &count, sizeof(count)) < 0)
+          continue;
+      }
+      else
+        advance(events[i].data.ptr);
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    while ((job = dequeue(&ready_head, &ready_tail)) != NULL)
+    {
+      pthread_mutex_unlock(&queue_lock);
+      activate(job);
+      if (job->state == STATE_CONNECT)
+        try_connect(job);
+      else
+        advance(job);
+      pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    now = time(NULL);
+    for (job = active; job; job = next)
+    {
+      next = job->next;
+      if (now >= job->deadline)
+        fail(job);
+    }
+  }
+
+  return NULL;
+}
+
+static void *resolver_main(void *arg)
+{
+  async_job_t *job;
+
+  while (1)
+  {
+    pthread_mutex_lock(&queue_lock);
+    while (resolve_head == NULL)
+      pthread_cond_wait(&resolve_ready, &queue_lock);
+    job = dequeue(&resolve_head, &resolve_tail);
+    pthread_mutex_unlock(&queue_lock);
+
+    if (resolver_lookup(job->host, job->port, &job->addrs) != 0)
+      job->addrs = NULL;
+    job->next_addr = job->addrs;
+    job->state = STATE_CONNECT;
+    enqueue_ready(job);
+  }
+
+  return NULL;
+}
+
+static void enqueue(async_job_t **head, async_job_t **tail, async_job_t *job)
+{
+  job->next = NULL;
+  if (*tail)
+    (*tail)->next = job;
+  else
+    *head = job;
+  *tail = job;
+}
+
+static async_job_t *dequeue(async_job_t **head, async_job_t **tail)
+{
+  async_job_t *job = *head;
+
+  if (job)
+  {
+    *head = job->next;
+    if (*head == NULL)
+      *tail = NULL;
+    job->next = NULL;
+  }
+  return job;
+}
+
+static void enqueue_ready(async_job_t *job)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&queue_lock);
+  enqueue(&ready_head, &ready_tail, job);
+  pthread_mutex_unlock(&queue_lock);
+  if (write(wakefd, &one, sizeof(one)) < 0)
+    unix_error("peer_async wakeup");
+}
+
+static void enqueue_resolve(async_job_t *job)
+{
+  pthread_mutex_lock(&queue_lock);
+  enqueue(&resolve_head, &resolve_tail, job);
+  pthread_cond_signal(&resolve_ready);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static void activate(async_job_t *job)
+{
+  job->prev = NULL;
+  job->next = active;
+  if (active)
+    active->prev = job;
+  active = job;
+}
+
+static void deactivate(async_job_t *job)
+{
+  if (job->prev)
+    job->prev->next = job->next;
+  else
+    active = job->next;
+  if (job->next)
+    job->next->prev = job->prev;
+  job->next = job->prev = NULL;
+}
+
+static void watch(async_job_t *job, unsigned int events)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = job;
+  epoll_ctl(epfd, (job->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), job->fd, &ev);
+  job->watched = 1;
+}
+
+/*
+ * drop_fd - stop watching the job's connection, leaving it open
+ */
+static void drop_fd(async_job_t *job)
+{
+  if (job->watched)
+    epoll_ctl(epfd, EPOLL_CTL_DEL, job->fd, NULL);
+  job->watched = 0;
+}
+
+/*
+ * try_connect - start a non-blocking connect to the next resolved
+ *   address, failing the job once every address has been tried
+ */
+static void try_connect(async_job_t *job)
+{
+  struct addrinfo *p;
+  int fd;
+
+  while ((p = job->next_addr) != NULL)
+  {
+    job->next_addr = p->ai_next;
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                p->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS)
+    {
+      job->fd = fd;
+      job->state = STATE_CONNECT;
+      watch(job, EPOLLOUT);
+      return;
+    }
+    close(fd);
+  }
+
+  fail(job);
+}
+
+/*
+ * advance - make as much progress as the connection allows without
+ *   blocking
+ */
+static void advance(async_job_t *job)
+{
+  ssize_t n;
+
+  if (job->state == STATE_CONNECT)
+  {
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    getsockopt(job->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    if (err == EINPROGRESS)
+      return;
+    if (err != 0)
+    {
+      drop_fd(job);
+      close(job->fd);
+      job->fd = -1;
+      try_connect(job);
+      return;
+    }
+    job->state = STATE_SEND;
+  }
+
+  if (job->state == STATE_SEND)
+  {
+    while (job->sent < job->request_len)
+    {
+      n = send(job->fd, job->request + job->sent, job->request_len - job->sent,
+               MSG_NOSIGNAL);
+      if (n < 0)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          watch(job, EPOLLOUT);
+          return;
+        }
+        if (errno != EINTR)
+        {
+          retry_or_fail(job);
+          return;
+        }
+      }
+      else
+        job->sent += n;
+    }
+    job->state = STATE_RECV;
+    watch(job, EPOLLIN);
+  }
+
+  /* STATE_RECV */
+  while (1)
+  {
+    int rc;
+
+    if (job->len == job->alloc)
+    {
+      job->alloc = (job->alloc ? 2 * job->alloc : MAXBUF);
+      job->buf = realloc(job->buf, job->alloc + 1);
+    }
+    n = read(job->fd, job->buf + job->len, job->alloc - job->len);
+    if (n > 0)
+    {
+      job->len += n;
+      job->buf[job->len] = 0;
+      if (job->head_len == 0 && (rc = parse_head(job)) <= 0)
+      {
+        if (rc == 0)
+          continue;
+        fail(job);
+        return;
+      }
+      if ((rc = body_complete(job)) != 0)
+      {
+        if (rc > 0)
+          complete(job);
+        else
+          fail(job);
+        return;
+      }
+    }
+    else if (n == 0)
+    {
+      /* The peer closed the connection */
+      if (job->head_len > 0 && job->body_len == PEER_BODY_TO_CLOSE)
+        complete(job);
+      else
+        retry_or_fail(job);
+      return;
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return;
+    else if (errno != EINTR)
+    {
+      retry_or_fail(job);
+      return;
+    }
+  }
+}
+
+/*
+ * parse_head - parse the status line and headers once the blank line
+ *   that ends them has arrived, skipping interim (1xx) responses;
+ *   returns 0 if it has not arrived yet and -1 if the body's framing
+ *   is unusable
+ */
+static int parse_head(async_job_t *job)
+{
+  char *end, *line, *eol, *status;
+
+  while (1)
+  {
+    end = strstr(job->buf, "\r\n\r\n");
+    if (end == NULL)
+      return 0;
+    job->head_len = (end - job->buf) + 4;
+
+    job->headers = make_dictionary(COMPARE_CASE_INSENS, free);
+    for (line = job->buf; line < end + 2; line = eol + 2)
+    {
+      char *copy;
+
+      eol = strstr(line, "\r\n");
+      copy = strndup(line, eol + 2 - line);
+      if (line == job->buf)
+      {
+        if (parse_status_line(copy, NULL, &status, NULL))
+        {
+          job->status = atoi(status);
+          free(status);
+        }
+      }
+      else
+        parse_header_line(copy, job->headers);
+      free(copy);
+    }
+
+    if (job->status < 100 || job->status >= 200)
+      break;
+    free_dictionary(job->headers);
+    job->headers = NULL;
+    job->len -= job->head_len;
+    memmove(job->buf, job->buf + job->head_len, job->len + 1);
+    job->head_len = 0;
+  }
+
+  job->body_len = peer_body_length(job->status, job->headers);
+  return (job->body_len == PEER_BODY_BAD ? -1 : 1);
+}
+
+/*
+ * body_complete - returns 1 once the whole body has arrived, 0 if
+ *   more is needed, and -1 if it is malformed or over PEER_MAX_BODY
+ */
+static int body_complete(async_job_t *job)
+{
+  if (job->body_len == PEER_BODY_CHUNKED)
+    return decode_chunks(job);
+  if (job->body_len == PEER_BODY_TO_CLOSE)
+    return (job->len - job->head_len > PEER_MAX_BODY ? -1 : 0);
+  return (job->len >= job->head_len + job->body_len);
+}
+
+/*
+ * decode_chunks - decode whatever of a chunked body has arrived,
+ *   skipping chunk extensions and trailers; returns 1 once the last
+ *   chunk and the trailers are in, 0 if more is needed, and -1 if the
+ *   framing is broken or the body is over PEER_MAX_BODY
+ */
+static int decode_chunks(async_job_t *job)
+{
+  char *line, *eol, *end;
+  unsigned long size;
+  size_t n;
+
+  if (job->chunk_at == 0)
+    job->chunk_at = job->head_len;
+  while (1)
+  {
+    line = job->buf + job->chunk_at;
+    n = job->len - job->chunk_at;
+    if (job->chunk_left > 0)
+    {
+      if (n == 0)
+        return 0;
+      if (n > job->chunk_left)
+        n = job->chunk_left;
+      memmove(job->buf + job->head_len + job->decoded, line, n);
+      job->decoded += n;
+      job->chunk_at += n;
+      job->chunk_left -= n;
+      continue;
+    }
+
+    eol = memchr(line, '\n', n);
+    if (eol == NULL)
+      return (n > MAXLINE ? -1 : 0);
+    if (eol == line || eol[-1] != '\r')
+      return -1;
+    job->chunk_at += eol + 1 - line;
+
+    if (job->chunk_state == CHUNK_SIZE)
+    {
+      if (!isxdigit((unsigned char)line[0]))
+        return -1;
+      errno = 0;
+      size = strtoul(line, &end, 16);
+      if (errno != 0 || (*end != ';' && *end != '\r')
+          || size > PEER_MAX_BODY - job->decoded)
+        return -1;
+      job->chunk_left = size;
+      job->chunk_state = (size == 0 ? CHUNK_TRAILER : CHUNK_DATA_END);
+    }
+    else if (job->chunk_state == CHUNK_DATA_END)
+    {
+      if (eol != line + 1)
+        return -1;
+      job->chunk_state = CHUNK_SIZE;
+    }
+    else if (eol == line + 1)
+      return 1; /* the blank line after the trailers */
+  }
+}
+
+/*
+ * retry_or_fail - a pooled connection that breaks before any of the
+ *   response arrives was most likely closed by the peer while idle,
+ *   so start over on a fresh connection
+ */
+static void retry_or_fail(async_job_t *job)
+{
+  if (job->reused && job->len == 0)
+  {
+    drop_fd(job);
+    close(job->fd);
+    job->fd = -1;
+    job->reused = 0;
+    job->sent = 0;
+    if (resolver_cached(job->host, job->port, &job->addrs) == 0)
+    {
+      job->next_addr = job->addrs;
+      try_connect(job);
+    }
+    else
+    {
+      job->state = STATE_RESOLVE;
+      deactivate(job);
+      enqueue_resolve(job);
+    }
+  }
+  else
+    fail(job);
+}
+
+static void complete(async_job_t *job)
+{
+  peer_response_t *resp = malloc(sizeof(peer_response_t));
+  char *connection;
+  size_t used;
+  int keep;
+
+  if (job->body_len == PEER_BODY_CHUNKED)
+  {
+    resp->len = job->decoded;
+    used = job->chunk_at;
+  }
+  else if (job->body_len == PEER_BODY_TO_CLOSE)
+    resp->len = used = job->len - job->head_len;
+  else
+  {
+    resp->len = job->body_len;
+    used = job->head_len + job->body_len;
+  }
+
+  /* Anything past the body would be mistaken for the next response */
+  connection = dictionary_get(job->headers, "Connection");
+  keep = (job->body_len != PEER_BODY_TO_CLOSE && job->len == used
+          && connection != NULL && !strcasecmp(connection, "keep-alive"));
+
+  resp->status = job->status;
+  resp->headers = job->headers;
+  resp->body = malloc(resp->len + 1);
+  memcpy(resp->body, job->buf + job->head_len, resp->len);
+  resp->body[resp->len] = 0;
+  job->headers = NULL;
+
+  drop_fd(job);
+  if (keep)
+  {
+    fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) & ~O_NONBLOCK);
+    peer_pool_give(job->host, job->port, job->fd);
+  }
+  else
+    close(job->fd);
+  job->fd = -1;
+
+  job->done(resp, job->arg);
+  free_job(job);
+}
+
+static void fail(async_job_t *job)
+{
+  if (job->fd >= 0)
+  {
+    drop_fd(job);
+    close(job->fd);
+  }
+  job->done(NULL, job->arg);
+  free_job(job);
+}
+
+static void free_job(async_job_t *job)
+{
+  deactivate(job);
+  free(job->addrs);
+  if (job->headers)
+    free_dictionary(job->headers);
+  free(job->host);
+  free(job->port);
+  free(job->request);
+  free(job->buf);
+  free(job);
+}
@@ -0,0 +1,22 @@
+/* Asynchronous GET requests to peer servers. Each request runs as a
+   small state machine (resolve, connect, send, receive) on a shared
+   event-loop thread, so no caller's thread waits on a slow peer.
+   Host names come from the resolver cache; a host that is not cached
+   yet is resolved on one of a few resolver threads, since name
+   resolution has no non-blocking interface. Requests reuse idle
+   connections from the peer pool and return reusable ones to it when
+   they finish. */
+
+/* Called exactly once when an asynchronous request finishes. On
+   success `resp` points to the response, which the callback takes
+   ownership of (see peer_response_free()); on failure or timeout
+   `resp` is NULL. The callback runs on the event-loop thread, so it
+   must not block. */
+typedef void (*peer_callback_t)(peer_response_t *resp, void *arg);
+
+/* Starts a GET request for `path` to `host`:`port` and returns
+   immediately; `done` is later called with `arg`. `extra_headers` is
+   as for peer_request(). */
+void peer_async_get(const char *host, const char *port, const char *path,
+                    const char *extra_headers,
+                    peer_callback_t done, void *arg);
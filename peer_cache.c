@@ -0,0 +1,204 @@
+/*
+ * peer_cache.c - TTL cache of friend lists fetched from peers
+ *
+ * Entries live in a chained hash table for lookup and on a doubly
+ * linked list in least-recently-used order for eviction. Every entry
+ * is charged for its struct, key, body, and ETag, and the oldest
+ * entries are dropped whenever the total exceeds the budget.
+ */
+#include <time.h>
+#include "csapp.h"
+#include "peer_cache.h"
+
+/* Seconds an entry is served without asking the peer: */
+#define PEER_CACHE_TTL 5
+/* Total bytes the cache may account for: */
+#define PEER_CACHE_MAX_BYTES (16 * 1024 * 1024)
+/* Bodies larger than this share of the budget are not cached: */
+#define PEER_CACHE_MAX_ENTRY (PEER_CACHE_MAX_BYTES / 8)
+#define PEER_CACHE_BUCKETS 1024
+
+typedef struct cache_entry_t
+{
+  char *key;
+  char *body;
+  size_t len;
+  char *etag;
+  time_t stored;
+  size_t cost;
+  struct cache_entry_t *bucket_next;
+  struct cache_entry_t *lru_prev, *lru_next; /* most recent at head */
+} cache_entry_t;
+
+static cache_entry_t *buckets[PEER_CACHE_BUCKETS];
+static cache_entry_t *lru_head, *lru_tail;
+static size_t used_bytes;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hash_key(const char *key);
+static cache_entry_t *find_entry(const char *key);
+static void lru_unlink(cache_entry_t *e);
+static void lru_push(cache_entry_t *e);
+static void remove_entry(cache_entry_t *e);
+static char *copy_body(cache_entry_t *e);
+
+char *peer_cache_lookup(const char *key, char **etag_p)
+{
+  cache_entry_t *e;
+  char *body = NULL;
+
+  *etag_p = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  e = find_entry(key);
+  if (e)
+  {
+    if (time(NULL) - e->stored < PEER_CACHE_TTL)
+    {
+      lru_unlink(e);
+      lru_push(e);
+      body = copy_body(e);
+    }
+    else if (e->etag)
+      *etag_p = strdup(e->etag);
+    else
+      remove_entry(e);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  return body;
+}
+
+void peer_cache_store(const char *key, const char *body, size_t len,
+                      const char *etag)
+{
+  cache_entry_t *e;
+  size_t cost;
+
+  cost = sizeof(cache_entry_t) + strlen(key) + 1 + len + 1
+         + (etag ? strlen(etag) + 1 : 0);
+
+  pthread_mutex_lock(&cache_lock);
+  e = find_entry(key);
+  if (e)
+    remove_entry(e);
+
+  if (cost <= PEER_CACHE_MAX_ENTRY)
+  {
+    unsigned long h = hash_key(key);
+
+    while (used_bytes + cost > PEER_CACHE_MAX_BYTES)
+      remove_entry(lru_tail);
+
+    e = calloc(1, sizeof(cache_entry_t));
+    e->key = strdup(key);
+    e->body = malloc(len + 1);
+    memcpy(e->body, body, len);
+    e->body[len] = 0;
+    e->len = len;
+    e->etag = (etag ? strdup(etag) : NULL);
+    e->stored = time(NULL);
+    e->cost = cost;
+
+    e->bucket_next = buckets[h];
+    buckets[h] = e;
+    lru_push(e);
+    used_bytes += cost;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+char *peer_cache_revalidated(const char *key)
+{
+  cache_entry_t *e;
+  char *body = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  e = find_entry(key);
+  if (e)
+  {
+    e->stored = time(NULL);
+    lru_unlink(e);
+    lru_push(e);
+    body = copy_body(e);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  return body;
+}
+
+/* FNV-1a */
+static unsigned long hash_key(const char *key)
+{
+  unsigned long h = 2166136261UL;
+
+  while (*key)
+  {
+    h ^= (unsigned char)*key++;
+    h *= 16777619UL;
+  }
+  return h % PEER_CACHE_BUCKETS;
+}
+
+static cache_entry_t *find_entry(const char *key)
+{
+  cache_entry_t *e;
+
+  for (e = buckets[hash_key(key)]; e; e = e->bucket_next)
+  {
+    if (!strcmp(e->key, key))
+      return e;
+  }
+  return NULL;
+}
+
+static void lru_unlink(cache_entry_t *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(cache_entry_t *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = e;
+  else
+    lru_tail = e;
+  lru_head = e;
+}
+
+/*
+ * remove_entry - unlink and free an entry; must be called with
+ *   `cache_lock` held
+ */
+static void remove_entry(cache_entry_t *e)
+{
+  cache_entry_t **p;
+
+  for (p = &buckets[hash_key(e->key)]; *p != e; p = &(*p)->bucket_next)
+    ;
+  *p = e->bucket_next;
+  lru_unlink(e);
+  used_bytes -= e->cost;
+
+  free(e->key);
+  free(e->body);
+  free(e->etag);
+  free(e);
+}
+
+static char *copy_body(cache_entry_t *e)
+{
+  char *body = malloc(e->len + 1);
+  memcpy(body, e->body, e->len + 1);
+  return body;
+}
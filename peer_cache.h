@@ -0,0 +1,24 @@
+/* A bounded cache of friend lists fetched from peer servers, keyed by
+   a string that names the (host, port, friend) triple. Entries are
+   fresh for a fixed time after they are stored; a stale entry that
+   came with an ETag is kept around so that it can be revalidated with
+   If-None-Match instead of being downloaded again. The cache accounts
+   for the memory of every entry and evicts the least recently used
+   ones to stay under its budget. All functions are thread-safe. */
+
+/* Returns a freshly allocated copy of the cached body for `key` if
+   there is a fresh entry, and NULL otherwise. When the result is NULL
+   and a stale entry with an ETag exists, `*etag_p` is set to a
+   freshly allocated copy of that ETag; otherwise it is set to NULL. */
+char *peer_cache_lookup(const char *key, char **etag_p);
+
+/* Stores `body` (of `len` bytes) for `key`, replacing any existing
+   entry. `etag` can be NULL. Bodies too large for the cache's budget
+   are not stored. */
+void peer_cache_store(const char *key, const char *body, size_t len,
+                      const char *etag);
+
+/* Marks the entry for `key` as fresh again after the peer confirmed
+   that it has not changed, and returns a freshly allocated copy of
+   its body, or NULL if the entry has been evicted in the meantime. */
+char *peer_cache_revalidated(const char *key);
@@ -0,0 +1,522 @@
+/*
+ * replication.c - streaming friend-list changes from a primary to its
+ *   read replicas
+ *
+ * The log is a ring of formatted records indexed by sequence number,
+ * so serving a replica is just copying lines out under a lock. Each
+ * replica connection is served by its own (HTTP connection) thread,
+ * which sleeps on a condition variable until the log grows.
+ *
+ * The stream is line-oriented, with names query-encoded:
+ *   snapshot <seq> <epoch>      the graph as of change <seq> follows,
+ *   + <user> <friend>           one line per half friendship,
+ *   end                         up to here;
+ *   <seq> <ms> +|- <user> <friend>   a change made at time <ms>;
+ *   head <seq> <ms>             heartbeat: nothing newer than <seq>.
+ */
+#include <time.h>
+#include "csapp.h"
+#include "dictionary.h"
+#include "more_string.h"
+#include "replication.h"
+
+/* Changes kept for replicas that reconnect: */
+#define REPL_LOG_SIZE 65536
+/* Most changes sent in one write, or applied under one lock: */
+#define REPL_BATCH 1024
+/* Seconds between heartbeats on an idle stream: */
+#define REPL_HEARTBEAT 1
+/* Seconds of silence after which a stream is considered broken: */
+#define REPL_TIMEOUT 5
+/* Seconds a replica waits before reconnecting: */
+#define REPL_RETRY 1
+
+typedef struct
+{
+  char *text;
+  size_t len, alloc;
+} buffer_t;
+
+/* A snapshot on its way to a replica, written out in batches as the
+   server reports it: */
+typedef struct
+{
+  int fd, started, failed;
+  unsigned long *seq_p;
+  buffer_t out;
+} snapshot_out_t;
+
+/* Primary side, all under log_lock: */
+static replication_snapshot_t take_snapshot;
+static char *log_lines[REPL_LOG_SIZE]; /* record `seq` at seq % size */
+static unsigned long head, oldest = 1;  /* newest and oldest records kept */
+static int logging, generation, replicas;
+static char epoch[64];
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_grew = PTHREAD_COND_INITIALIZER;
+
+/* Replica side, all under follow_lock: */
+static char *primary_host, *primary_port;
+static replication_apply_t apply_changes;
+static int connected;
+static unsigned long applied, primary_seq;
+static char *primary_epoch;
+static long long lag_ms, last_contact;
+static pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ms(void);
+static void buffer_add(buffer_t *b, const char *s, size_t len);
+static void add_to_snapshot(void *ctx, const char *user, const char *friend);
+static void start_snapshot(snapshot_out_t *s);
+static void flush_snapshot(snapshot_out_t *s);
+static int send_snapshot(int fd, unsigned long *next_p);
+static void *follow_main(void *arg);
+static void follow_once(void);
+static int parse_op(char **parts, replication_op_t *op);
+static void apply_batch(int reset, replication_op_t *ops, int *count_p);
+static void flush_changes(replication_op_t *ops, int *count_p,
+                          unsigned long seq, long long sent);
+
+void replication_init(replication_snapshot_t snapshot)
+{
+  take_snapshot = snapshot;
+  snprintf(epoch, sizeof(epoch), "%lx.%lx", (long)time(NULL), (long)getpid());
+}
+
+void replication_log(int adding, const char *user, const char *friend)
+{
+  char prefix[64], *user_enc, *friend_enc, *line;
+
+  if (!logging)
+    return;
+
+  user_enc = query_encode(user);
+  friend_enc = query_encode(friend);
+
+  pthread_mutex_lock(&log_lock);
+  head++;
+  snprintf(prefix, sizeof(prefix), "%lu %lld %c ", head, now_ms(),
+           adding ? '+' : '-');
+  line = append_strings(prefix, user_enc, " ", friend_enc, "\n", NULL);
+  free(log_lines[head % REPL_LOG_SIZE]);
+  log_lines[head % REPL_LOG_SIZE] = line;
+  if (head - oldest >= REPL_LOG_SIZE)
+    oldest = head - REPL_LOG_SIZE + 1;
+  pthread_cond_broadcast(&log_grew);
+  pthread_mutex_unlock(&log_lock);
+
+  free(user_enc);
+  free(friend_enc);
+}
+
+unsigned long replication_mark(void)
+{
+  unsigned long seq;
+
+  pthread_mutex_lock(&log_lock);
+  logging = 1;
+  seq = head;
+  pthread_mutex_unlock(&log_lock);
+
+  return seq;
+}
+
+void replication_reset(void)
+{
+  pthread_mutex_lock(&log_lock);
+  generation++;
+  oldest = head + 1;
+  pthread_cond_broadcast(&log_grew);
+  pthread_mutex_unlock(&log_lock);
+}
+
+void replication_serve(int fd, const char *their_epoch, unsigned long from)
+{
+  const char *header = "HTTP/1.1 200 OK\r\n"
+                       "Server: Friendlist Web Server\r\n"
+                       "Connection: close\r\n"
+                       "Content-type: text/plain; charset=utf-8\r\n\r\n";
+  struct timeval timeout = {REPL_TIMEOUT, 0};
+  unsigned long next = 0;
+  int gen;
+
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (rio_writen(fd, (void *)header, strlen(header)) < 0)
+    return;
+
+  pthread_mutex_lock(&log_lock);
+  replicas++;
+  gen = generation;
+  if (their_epoch && !strcmp(their_epoch, epoch) && logging
+      && from >= oldest && from <= head + 1)
+    next = from;
+  pthread_mutex_unlock(&log_lock);
+
+  while (1)
+  {
+    buffer_t out = {NULL, 0, 0};
+    struct timespec deadline;
+
+    if (next == 0)
+    {
+      pthread_mutex_lock(&log_lock);
+      gen = generation;
+      pthread_mutex_unlock(&log_lock);
+      if (send_snapshot(fd, &next) < 0)
+        break;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_HEARTBEAT;
+
+    pthread_mutex_lock(&log_lock);
+    if (next > head && gen == generation)
+      pthread_cond_timedwait(&log_grew, &log_lock, &deadline);
+    if (gen != generation || next < oldest)
+      next = 0; /* too far behind, or the graph was replaced */
+    else if (next <= head)
+    {
+      for (; next <= head && out.len < REPL_BATCH * 64; next++)
+      {
+        const char *line = log_lines[next % REPL_LOG_SIZE];
+        buffer_add(&out, line, strlen(line));
+      }
+    }
+    else
+    {
+      char beat[64];
+      snprintf(beat, sizeof(beat), "head %lu %lld\n", head, now_ms());
+      buffer_add(&out, beat, strlen(beat));
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    if (out.len > 0 && rio_writen(fd, out.text, out.len) < 0)
+    {
+      free(out.text);
+      break;
+    }
+    free(out.text);
+  }
+
+  pthread_mutex_lock(&log_lock);
+  replicas--;
+  pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * send_snapshot - send the whole graph, setting `*next_p` to the first
+ *   change that the snapshot does not include
+ */
+static int send_snapshot(int fd, unsigned long *next_p)
+{
+  unsigned long seq;
+  snapshot_out_t s = {fd, 0, 0, &seq, {NULL, 0, 0}};
+
+  take_snapshot(add_to_snapshot, &s, &seq);
+  start_snapshot(&s);
+  buffer_add(&s.out, "end\n", 4);
+  flush_snapshot(&s);
+  free(s.out.text);
+
+  *next_p = seq + 1;
+  return (s.failed ? -1 : 0);
+}
+
+static void add_to_snapshot(void *ctx, const char *user, const char *friend)
+{
+  snapshot_out_t *s = ctx;
+  char *user_enc, *friend_enc;
+
+  if (s->failed)
+    return;
+  start_snapshot(s);
+  user_enc = query_encode(user);
+  friend_enc = query_encode(friend);
+  buffer_add(&s->out, "+ ", 2);
+  buffer_add(&s->out, user_enc, strlen(user_enc));
+  buffer_add(&s->out, " ", 1);
+  buffer_add(&s->out, friend_enc, strlen(friend_enc));
+  buffer_add(&s->out, "\n", 1);
+  free(user_enc);
+  free(friend_enc);
+
+  if (s->out.len >= REPL_BATCH * 64)
+    flush_snapshot(s);
+}
+
+/*
+ * start_snapshot - put the snapshot's first line in the buffer, once;
+ *   the server has marked the log by the time it reports anything
+ */
+static void start_snapshot(snapshot_out_t *s)
+{
+  char line[128];
+  int n;
+
+  if (s->started)
+    return;
+  s->started = 1;
+  n = snprintf(line, sizeof(line), "snapshot %lu %s\n", *s->seq_p, epoch);
+  buffer_add(&s->out, line, n);
+}
+
+static void flush_snapshot(snapshot_out_t *s)
+{
+  if (!s->failed && s->out.len > 0 && rio_writen(s->fd, s->out.text, s->out.len) < 0)
+    s->failed = 1;
+  s->out.len = 0;
+}
+
+static void buffer_add(buffer_t *b, const char *s, size_t len)
+{
+  if (b->len + len + 1 > b->alloc)
+  {
+    b->alloc = (b->alloc ? b->alloc * 2 : MAXBUF);
+    if (b->alloc < b->len + len + 1)
+      b->alloc = b->len + len + 1;
+    b->text = realloc(b->text, b->alloc);
+  }
+  memcpy(b->text + b->len, s, len);
+  b->len += len;
+  b->text[b->len] = 0;
+}
+
+static long long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void replication_follow(const char *host, const char *port,
+                        replication_apply_t apply)
+{
+  pthread_t tid;
+
+  primary_host = strdup(host);
+  primary_port = strdup(port);
+  apply_changes = apply;
+  pthread_create(&tid, NULL, follow_main, NULL);
+  pthread_detach(tid);
+}
+
+const char *replication_primary_host(void)
+{
+  return primary_host;
+}
+
+const char *replication_primary_port(void)
+{
+  return primary_port;
+}
+
+static void *follow_main(void *arg)
+{
+  while (1)
+  {
+    follow_once();
+
+    pthread_mutex_lock(&follow_lock);
+    connected = 0;
+    pthread_mutex_unlock(&follow_lock);
+    sleep(REPL_RETRY);
+  }
+
+  return NULL;
+}
+
+/*
+ * follow_once - subscribe to the primary and apply its stream until
+ *   the connection breaks
+ */
+static void follow_once(void)
+{
+  struct timeval timeout = {REPL_TIMEOUT, 0};
+  char buf[MAXLINE], *request, from[32];
+  replication_op_t *ops = malloc(REPL_BATCH * sizeof(replication_op_t));
+  int fd, count = 0, alloc = REPL_BATCH, in_snapshot = 0;
+  unsigned long snapshot_seq = 0, batch_seq = 0;
+  long long batch_sent = 0;
+  char *snapshot_epoch = NULL;
+  rio_t rio;
+
+  if ((fd = open_clientfd(primary_host, primary_port)) < 0)
+  {
+    free(ops);
+    return;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  pthread_mutex_lock(&follow_lock);
+  snprintf(from, sizeof(from), "%lu", applied + 1);
+  request = append_strings("GET /replicate?from=", from,
+                           "&epoch=", (primary_epoch ? primary_epoch : ""),
+                           " HTTP/1.1\r\n",
+                           "Host: ", primary_host, ":", primary_port, "\r\n\r\n",
+                           NULL);
+  pthread_mutex_unlock(&follow_lock);
+
+  rio_readinitb(&rio, fd);
+  if (rio_writen(fd, request, strlen(request)) < 0
+      || rio_readlineb(&rio, buf, MAXLINE) <= 0 || !strstr(buf, " 200 "))
+  {
+    free(request);
+    free(ops);
+    close(fd);
+    return;
+  }
+  free(request);
+  while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+    ;
+
+  pthread_mutex_lock(&follow_lock);
+  connected = 1;
+  pthread_mutex_unlock(&follow_lock);
+
+  while (rio_readlineb(&rio, buf, MAXLINE) > 0)
+  {
+    char **parts;
+    int n;
+
+    buf[strcspn(buf, "\n")] = 0;
+    parts = split_string(buf, ' ');
+    for (n = 0; parts[n]; n++)
+      ;
+
+    /* Changes that arrived together are applied under one lock, but
+       never held back behind a line of another kind */
+    if (count > 0 && !in_snapshot && n != 5)
+      flush_changes(ops, &count, batch_seq, batch_sent);
+
+    if (n == 3 && !strcmp(parts[0], "snapshot"))
+    {
+      in_snapshot = 1;
+      snapshot_seq = strtoul(parts[1], NULL, 10);
+      free(snapshot_epoch);
+      snapshot_epoch = strdup(parts[2]);
+      count = 0;
+    }
+    else if (n == 1 && !strcmp(parts[0], "end") && in_snapshot)
+    {
+      /* The whole snapshot replaces the graph at once */
+      apply_batch(1, ops, &count);
+      in_snapshot = 0;
+      pthread_mutex_lock(&follow_lock);
+      applied = snapshot_seq;
+      if (primary_seq < applied)
+        primary_seq = applied;
+      free(primary_epoch);
+      primary_epoch = snapshot_epoch;
+      snapshot_epoch = NULL;
+      pthread_mutex_unlock(&follow_lock);
+    }
+    else if (n == 3 && in_snapshot)
+    {
+      if (count == alloc)
+        ops = realloc(ops, (alloc *= 2) * sizeof(replication_op_t));
+      if (parse_op(parts, &ops[count]))
+        count++;
+    }
+    else if (n == 3 && !strcmp(parts[0], "head"))
+    {
+      pthread_mutex_lock(&follow_lock);
+      primary_seq = strtoul(parts[1], NULL, 10);
+      last_contact = now_ms();
+      pthread_mutex_unlock(&follow_lock);
+    }
+    else if (n == 5 && !in_snapshot)
+    {
+      batch_seq = strtoul(parts[0], NULL, 10);
+      batch_sent = atoll(parts[1]);
+      if (parse_op(parts + 2, &ops[count]))
+        count++;
+      if (rio.rio_cnt == 0 || count == REPL_BATCH)
+        flush_changes(ops, &count, batch_seq, batch_sent);
+    }
+
+    for (n = 0; parts[n]; n++)
+      free(parts[n]);
+    free(parts);
+  }
+
+  /* An incomplete batch was never acknowledged, so it is resent */
+  while (count > 0)
+  {
+    count--;
+    free(ops[count].user);
+    free(ops[count].friend);
+  }
+  free(ops);
+  free(snapshot_epoch);
+  close(fd);
+}
+
+static int parse_op(char **parts, replication_op_t *op)
+{
+  if (strcmp(parts[0], "+") && strcmp(parts[0], "-"))
+    return 0;
+  op->adding = (parts[0][0] == '+');
+  op->user = query_decode(parts[1]);
+  op->friend = query_decode(parts[2]);
+  return 1;
+}
+
+static void apply_batch(int reset, replication_op_t *ops, int *count_p)
+{
+  int i;
+
+  apply_changes(reset, ops, *count_p);
+  for (i = 0; i < *count_p; i++)
+  {
+    free(ops[i].user);
+    free(ops[i].friend);
+  }
+  *count_p = 0;
+}
+
+/*
+ * flush_changes - apply a batch of changes ending with change `seq`,
+ *   which the primary made at time `sent`
+ */
+static void flush_changes(replication_op_t *ops, int *count_p,
+                          unsigned long seq, long long sent)
+{
+  apply_batch(0, ops, count_p);
+
+  pthread_mutex_lock(&follow_lock);
+  applied = seq;
+  if (primary_seq < seq)
+    primary_seq = seq;
+  last_contact = now_ms();
+  lag_ms = last_contact - sent;
+  pthread_mutex_unlock(&follow_lock);
+}
+
+char *replication_status(void)
+{
+  char buf[MAXLINE];
+
+  if (primary_host)
+  {
+    pthread_mutex_lock(&follow_lock);
+    snprintf(buf, sizeof(buf),
+             "role replica\nprimary %s:%s\nconnected %d\n"
+             "seq %lu\nprimary_seq %lu\nbehind %lu\n"
+             "lag_ms %lld\nlast_contact_ms %lld\n",
+             primary_host, primary_port, connected,
+             applied, primary_seq,
+             (primary_seq > applied ? primary_seq - applied : 0),
+             lag_ms, (last_contact ? now_ms() - last_contact : -1));
+    pthread_mutex_unlock(&follow_lock);
+  }
+  else
+  {
+    pthread_mutex_lock(&log_lock);
+    snprintf(buf, sizeof(buf), "role primary\nseq %lu\nreplicas %d\n",
+             head, replicas);
+    pthread_mutex_unlock(&log_lock);
+  }
+
+  return strdup(buf);
+}
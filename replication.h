@@ -0,0 +1,71 @@
+/* Primary/replica replication. A replica subscribes to a primary with
+   GET /replicate on the primary's own HTTP port, and the primary
+   answers with an endless stream: first a snapshot of its friend
+   lists, then every change to them, in order, as it happens. Each
+   change carries a sequence number and the primary's clock, and the
+   primary sends a heartbeat with its newest sequence number whenever
+   the stream is idle, so a replica can tell how far behind it is.
+
+   The primary keeps only a bounded window of recent changes. A
+   replica that reconnects within the window resumes where it left
+   off; one that fell further behind, or that was following an earlier
+   run of the primary, gets a fresh snapshot. Changes are only logged
+   once some replica has subscribed. */
+
+/* One half of a friendship change, as for cluster_op_t. */
+typedef struct
+{
+  int adding;
+  char *user, *friend;
+} replication_op_t;
+
+/* Reports every half of a friendship in the graph through `add`;
+   supplied by the server. It must call replication_mark() under the
+   same lock as it takes its view of the graph, and set `*seq_p` before
+   reporting anything, since the snapshot is sent as it is reported.
+   `add` is best called without the lock, as it writes to a replica. */
+typedef void (*replication_add_t)(void *ctx, const char *user, const char *friend);
+typedef void (*replication_snapshot_t)(replication_add_t add, void *ctx,
+                                       unsigned long *seq_p);
+
+/* Applies changes received from the primary; when `reset` is set, the
+   graph is cleared first (the changes are then a snapshot). Supplied
+   by the server. */
+typedef void (*replication_apply_t)(int reset, replication_op_t *ops, int count);
+
+/* Primary side: */
+
+/* Installs the function that snapshots the graph. */
+void replication_init(replication_snapshot_t snapshot);
+
+/* Logs a change; must be called with the graph locked, in the order
+   the changes are made. Does nothing until a replica has subscribed. */
+void replication_log(int adding, const char *user, const char *friend);
+
+/* Starts logging if it was off and returns the sequence number of the
+   newest change; must be called with the graph locked. */
+unsigned long replication_mark(void);
+
+/* Forgets the log because the graph was replaced wholesale, so every
+   replica resynchronizes; must be called with the graph locked. */
+void replication_reset(void);
+
+/* Streams changes after `from` to a replica on `fd` (with the
+   response header), until the replica goes away. `epoch` is the one
+   the replica last saw, or NULL. */
+void replication_serve(int fd, const char *epoch, unsigned long from);
+
+/* Replica side: */
+
+/* Follows the primary at `host`:`port` on a background thread,
+   reconnecting whenever the stream breaks. */
+void replication_follow(const char *host, const char *port,
+                        replication_apply_t apply);
+
+/* The primary this server follows, or NULL if it is not a replica. */
+const char *replication_primary_host(void);
+const char *replication_primary_port(void);
+
+/* Returns a freshly allocated description of this server's
+   replication state, one "name value" pair per line. */
+char *replication_status(void);
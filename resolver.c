@@ -0,0 +1,261 @@
+/*
+ * resolver.c - cached host name resolution for peer connections
+ *
+ * Entries are keyed by host name alone and hold the addresses with a
+ * zero port; the caller's port is filled in when a list is copied
+ * out. Each copy is a single allocation (nodes followed by their
+ * addresses) so callers release it with one free().
+ */
+#include <time.h>
+#include "csapp.h"
+#include "dictionary.h"
+#include "resolver.h"
+
+/* Seconds a successful and a failed resolution are trusted: */
+#define RESOLVER_POSITIVE_TTL 60
+#define RESOLVER_NEGATIVE_TTL 5
+/* Entries used within this many seconds are kept warm: */
+#define RESOLVER_HOT_WINDOW 120
+/* Seconds before expiry that a warm entry is refreshed: */
+#define RESOLVER_REFRESH_AHEAD 10
+/* Seconds past expiry that a success whose refresh keeps failing is
+   still served: */
+#define RESOLVER_STALE_MAX 300
+
+typedef struct
+{
+  int error; /* getaddrinfo() result; 0 for a positive entry */
+  int count;
+  struct addrinfo *addrs; /* `count` nodes, ai_addr pointing into `storage` */
+  struct sockaddr_storage *storage;
+  time_t expires, last_used;
+  time_t retry_at; /* after a failed refresh */
+} resolution_t;
+
+static dictionary_t *cache; /* host -> resolution_t* */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+static void start_refresher(void);
+static void *refresher_main(void *arg);
+static int is_authoritative(int error);
+static resolution_t *resolve(const char *host);
+static void free_resolution(void *p);
+static int copy_out(resolution_t *r, const char *port, struct addrinfo **res);
+static int lookup(const char *host, const char *port, struct addrinfo **res,
+                  int may_block);
+
+int resolver_lookup(const char *host, const char *port, struct addrinfo **res)
+{
+  return lookup(host, port, res, 1);
+}
+
+int resolver_cached(const char *host, const char *port, struct addrinfo **res)
+{
+  return lookup(host, port, res, 0);
+}
+
+static int lookup(const char *host, const char *port, struct addrinfo **res,
+                  int may_block)
+{
+  resolution_t *r;
+  int rc = EAI_AGAIN;
+  time_t now = time(NULL);
+
+  pthread_once(&start_once, start_refresher);
+
+  pthread_mutex_lock(&cache_lock);
+  r = dictionary_get(cache, host);
+  /* An expired failure is retried now; an expired success is served
+     while the refresher catches up, but not indefinitely */
+  if (r && now >= r->expires + (r->error ? 0 : RESOLVER_STALE_MAX))
+  {
+    dictionary_remove(cache, host);
+    r = NULL;
+  }
+  if (r)
+  {
+    r->last_used = now;
+    rc = (r->error ? r->error : copy_out(r, port, res));
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (r || !may_block)
+    return rc;
+
+  r = resolve(host);
+  pthread_mutex_lock(&cache_lock);
+  rc = (r->error ? r->error : copy_out(r, port, res));
+  dictionary_set(cache, host, r);
+  pthread_mutex_unlock(&cache_lock);
+
+  return rc;
+}
+
+static void start_refresher(void)
+{
+  pthread_t tid;
+
+  cache = make_dictionary(COMPARE_CASE_INSENS, free_resolution);
+  pthread_create(&tid, NULL, refresher_main, NULL);
+  pthread_detach(tid);
+}
+
+/*
+ * refresher_main - once a second, re-resolve warm entries that are
+ *   about to expire and drop entries nobody has used in a while
+ */
+static void *refresher_main(void *arg)
+{
+  while (1)
+  {
+    char *host = NULL;
+    time_t now = time(NULL);
+    size_t i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < dictionary_count(cache); i++)
+    {
+      resolution_t *r = dictionary_value(cache, i);
+      if ((now - r->last_used > RESOLVER_HOT_WINDOW && now >= r->expires)
+          || (!r->error && now >= r->expires + RESOLVER_STALE_MAX))
+      {
+        dictionary_remove(cache, dictionary_key(cache, i));
+        i--;
+      }
+      else if (!r->error && !host && now >= r->retry_at
+               && now - r->last_used <= RESOLVER_HOT_WINDOW
+               && r->expires - now <= RESOLVER_REFRESH_AHEAD)
+        host = strdup(dictionary_key(cache, i));
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (host)
+    {
+      /* Resolve without the lock; keep the old addresses if the
+         refresh fails, since the host was reachable moments ago,
+         unless the name server says the host is gone */
+      resolution_t *fresh = resolve(host);
+      int refreshed = (!fresh->error || is_authoritative(fresh->error));
+
+      pthread_mutex_lock(&cache_lock);
+      resolution_t *r = dictionary_get(cache, host);
+      if (refreshed)
+      {
+        if (r)
+          fresh->last_used = r->last_used;
+        dictionary_set(cache, host, fresh);
+      }
+      else
+      {
+        if (r)
+          r->retry_at = now + RESOLVER_NEGATIVE_TTL;
+        free_resolution(fresh);
+      }
+      pthread_mutex_unlock(&cache_lock);
+      free(host);
+
+      if (refreshed)
+        continue; /* look for more work right away */
+    }
+
+    sleep(1);
+  }
+
+  return NULL;
+}
+
+/*
+ * is_authoritative - whether a failure means the name does not exist,
+ *   rather than that the resolver could not be reached
+ */
+static int is_authoritative(int error)
+{
+#ifdef EAI_NODATA
+  if (error == EAI_NODATA)
+    return 1;
+#endif
+  return (error == EAI_NONAME);
+}
+
+static resolution_t *resolve(const char *host)
+{
+  struct addrinfo hints, *listp, *p;
+  resolution_t *r = calloc(1, sizeof(resolution_t));
+  int i;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  r->last_used = time(NULL);
+  r->error = getaddrinfo(host, NULL, &hints, &listp);
+  if (r->error)
+  {
+    r->expires = r->last_used + RESOLVER_NEGATIVE_TTL;
+    return r;
+  }
+  r->expires = r->last_used + RESOLVER_POSITIVE_TTL;
+
+  for (p = listp; p; p = p->ai_next)
+    r->count++;
+  r->addrs = calloc(r->count, sizeof(struct addrinfo));
+  r->storage = calloc(r->count, sizeof(struct sockaddr_storage));
+  for (p = listp, i = 0; p; p = p->ai_next, i++)
+  {
+    r->addrs[i].ai_family = p->ai_family;
+    r->addrs[i].ai_socktype = p->ai_socktype;
+    r->addrs[i].ai_protocol = p->ai_protocol;
+    r->addrs[i].ai_addrlen = p->ai_addrlen;
+    r->addrs[i].ai_addr = (struct sockaddr *)&r->storage[i];
+    memcpy(&r->storage[i], p->ai_addr, p->ai_addrlen);
+  }
+  freeaddrinfo(listp);
+
+  return r;
+}
+
+static void free_resolution(void *p)
+{
+  resolution_t *r = p;
+
+  free(r->addrs);
+  free(r->storage);
+  free(r);
+}
+
+/*
+ * copy_out - copy a positive entry into one allocation, with `port`
+ *   filled into every address
+ */
+static int copy_out(resolution_t *r, const char *port, struct addrinfo **res)
+{
+  struct addrinfo *nodes;
+  struct sockaddr_storage *storage;
+  char *end;
+  long portno;
+  int i;
+
+  portno = strtol(port, &end, 10);
+  if (*port == 0 || *end != 0 || portno < 0 || portno > 65535)
+    return EAI_SERVICE;
+  if (r->count == 0)
+    return EAI_NONAME;
+
+  nodes = malloc(r->count * (sizeof(struct addrinfo) + sizeof(struct sockaddr_storage)));
+  storage = (struct sockaddr_storage *)(nodes + r->count);
+  for (i = 0; i < r->count; i++)
+  {
+    nodes[i] = r->addrs[i];
+    memcpy(&storage[i], &r->storage[i], sizeof(struct sockaddr_storage));
+    nodes[i].ai_addr = (struct sockaddr *)&storage[i];
+    nodes[i].ai_next = (i + 1 < r->count ? &nodes[i + 1] : NULL);
+    if (nodes[i].ai_family == AF_INET)
+      ((struct sockaddr_in *)&storage[i])->sin_port = htons(portno);
+    else if (nodes[i].ai_family == AF_INET6)
+      ((struct sockaddr_in6 *)&storage[i])->sin6_port = htons(portno);
+  }
+
+  *res = nodes;
+  return 0;
+}
@@ -0,0 +1,20 @@
+/* A thread-safe cache of host name resolutions shared by every
+   outbound connection to a peer. Successful resolutions are kept for
+   a while, and failures for a shorter while so that a bad host name
+   does not cost a resolver call per request. A background thread
+   re-resolves entries that are still in use before they expire, so
+   requests for a busy peer never wait on the resolver; an expired
+   entry is served as-is while it is being refreshed, for a few minutes
+   at most, and is replaced by the failure at once if the name server
+   answers that the host no longer exists. */
+
+/* Resolves `host` for a TCP connection to the numeric `port`,
+   blocking on the system resolver only if `host` is not cached. On
+   success, returns 0 and sets `*res` to a freshly allocated list that
+   the caller must release with free(); otherwise returns a
+   getaddrinfo() error code. */
+int resolver_lookup(const char *host, const char *port, struct addrinfo **res);
+
+/* Like resolver_lookup(), but never blocks: returns EAI_AGAIN if
+   `host` is not in the cache. */
+int resolver_cached(const char *host, const char *port, struct addrinfo **res);
@@ -0,0 +1,523 @@
+/*
+ * snapshot.c - memory-mapped friend-graph snapshots
+ *
+ * Layout, in native byte order:
+ *   header      magic, table sizes and offsets
+ *   users       one user_t per name, sorted by name
+ *   friends     uint32_t name indices; user i's friends are
+ *               friends[users[i].first .. users[i].first + degree)
+ *   names       the NUL-terminated names, back to back
+ * Opening checks only the header, so it costs the same for any size
+ * of graph; each access is bounds-checked instead, and each user's
+ * friend indices the first time the list is read.
+ *
+ * A background snapshot is written by a forked child, which reports
+ * its timings and copy-on-write overhead back over a pipe.
+ */
+#include <dirent.h>
+#include "csapp.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "FLSNAP1"
+
+typedef struct
+{
+  char magic[8];
+  uint64_t users;      /* entries in the user table */
+  uint64_t friends;    /* entries in the friend array */
+  uint64_t names_size; /* bytes in the name table */
+  uint64_t users_off, friends_off, names_off;
+} header_t;
+
+typedef struct
+{
+  uint64_t name;  /* offset into the name table */
+  uint64_t first; /* index into the friend array */
+  uint32_t degree;
+  uint32_t unused;
+} user_t;
+
+struct snapshot_t
+{
+  int refs;
+  char *data;
+  size_t size;
+  long count;
+  user_t *users;
+  uint32_t *friends;
+  uint64_t friend_count;
+  const char *names;
+  uint64_t names_size;
+  unsigned char *checked; /* per user, whether the friend list is valid */
+};
+
+/* What snapshot_friends() has found of a user's friend list: */
+#define LIST_UNCHECKED 0
+#define LIST_OK 1
+#define LIST_BAD 2
+
+/* A background snapshot being waited for: */
+typedef struct
+{
+  pid_t pid;
+  int fd; /* reads the child's report */
+  long fork_micros;
+  snapshot_done_t done;
+  void *done_arg;
+} child_t;
+
+/* What snapshot_write() collects from the walk: */
+typedef struct
+{
+  const char **names;
+  size_t count, alloc;
+  uint32_t **adj; /* per name */
+  uint32_t *degree;
+} builder_t;
+
+static int compare_names(const void *a, const void *b);
+static int compare_indices(const void *a, const void *b);
+static void collect_names(void *ctx, const char *user, const char **friends, int count);
+static void collect_friends(void *ctx, const char *user, const char **friends, int count);
+static long find_name(builder_t *b, const char *name);
+static int write_file(FILE *f, builder_t *b);
+static void close_inherited(int keep);
+static void *reap_child(void *arg);
+static long private_dirty_kb(void);
+static long millis_since(struct timeval *start);
+
+snapshot_t *snapshot_open(const char *path)
+{
+  struct stat st;
+  header_t *h;
+  snapshot_t *snap;
+  char *data;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(header_t))
+  {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  h = (header_t *)data;
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic))
+      || h->users_off > st.st_size
+      || h->users > (st.st_size - h->users_off) / sizeof(user_t)
+      || h->friends_off > st.st_size
+      || h->friends > (st.st_size - h->friends_off) / sizeof(uint32_t)
+      || h->names_off > st.st_size
+      || h->names_size > st.st_size - h->names_off
+      || (h->names_size > 0 && data[h->names_off + h->names_size - 1] != 0))
+  {
+    munmap(data, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  snap = malloc(sizeof(snapshot_t));
+  snap->refs = 1;
+  snap->data = data;
+  snap->size = st.st_size;
+  snap->count = h->users;
+  snap->users = (user_t *)(data + h->users_off);
+  snap->friends = (uint32_t *)(data + h->friends_off);
+  snap->friend_count = h->friends;
+  snap->names = data + h->names_off;
+  snap->names_size = h->names_size;
+  /* Untouched pages of a large calloc() cost nothing until written */
+  snap->checked = calloc(h->users + 1, 1);
+  return snap;
+}
+
+void snapshot_close(snapshot_t *snap)
+{
+  if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  munmap(snap->data, snap->size);
+  free(snap->checked);
+  free(snap);
+}
+
+snapshot_t *snapshot_retain(snapshot_t *snap)
+{
+  __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+  return snap;
+}
+
+long snapshot_count(snapshot_t *snap)
+{
+  return snap->count;
+}
+
+const char *snapshot_name(snapshot_t *snap, long i)
+{
+  uint64_t off;
+
+  if (i < 0 || i >= snap->count)
+    return "";
+  off = snap->users[i].name;
+  return (off < snap->names_size ? snap->names + off : "");
+}
+
+long snapshot_find(snapshot_t *snap, const char *name)
+{
+  long i = snapshot_lower_bound(snap, name);
+
+  if (i < snap->count && !strcmp(name, snapshot_name(snap, i)))
+    return i;
+  return -1;
+}
+
+long snapshot_lower_bound(snapshot_t *snap, const char *name)
+{
+  long lo = 0, hi = snap->count;
+
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo) / 2;
+    if (strcmp(snapshot_name(snap, mid), name) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * snapshot_friends - a list that runs past the friend array, or names
+ *   an index past the user table, is treated as empty; each list is
+ *   checked the first time it is asked for, and the verdict kept
+ */
+uint32_t snapshot_friends(snapshot_t *snap, long i, const uint32_t **friends_p)
+{
+  unsigned char verdict;
+  user_t *u;
+  uint32_t j;
+
+  *friends_p = NULL;
+  if (i < 0 || i >= snap->count)
+    return 0;
+  u = &snap->users[i];
+
+  /* Readers that race here reach the same verdict */
+  verdict = __atomic_load_n(&snap->checked[i], __ATOMIC_RELAXED);
+  if (verdict == LIST_UNCHECKED)
+  {
+    verdict = LIST_OK;
+    if (u->first > snap->friend_count || u->degree > snap->friend_count - u->first)
+      verdict = LIST_BAD;
+    for (j = 0; verdict == LIST_OK && j < u->degree; j++)
+      if (snap->friends[u->first + j] >= (uint64_t)snap->count)
+        verdict = LIST_BAD;
+    __atomic_store_n(&snap->checked[i], verdict, __ATOMIC_RELAXED);
+  }
+  if (verdict == LIST_BAD)
+    return 0;
+
+  *friends_p = snap->friends + u->first;
+  return u->degree;
+}
+
+int snapshot_write(const char *path, snapshot_walk_t walk, void *walk_arg)
+{
+  builder_t b = {NULL, 0, 0, NULL, NULL};
+  char *tmp = malloc(strlen(path) + 5);
+  size_t i, n;
+  FILE *f;
+  int rc;
+
+  /* First the names, then each user's friends as indices */
+  walk(walk_arg, collect_names, &b);
+  qsort(b.names, b.count, sizeof(char *), compare_names);
+  for (i = 0, n = 0; i < b.count; i++)
+    if (n == 0 || strcmp(b.names[i], b.names[n - 1]))
+      b.names[n++] = b.names[i];
+  b.count = n;
+  b.adj = calloc(b.count + 1, sizeof(uint32_t *));
+  b.degree = calloc(b.count + 1, sizeof(uint32_t));
+  walk(walk_arg, collect_friends, &b);
+
+  sprintf(tmp, "%s.tmp", path);
+  rc = -1;
+  if ((f = fopen(tmp, "w")) != NULL)
+  {
+    rc = write_file(f, &b);
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+      rc = -1;
+    if (fclose(f) != 0)
+      rc = -1;
+    if (rc == 0 && rename(tmp, path) < 0)
+      rc = -1;
+    if (rc < 0)
+      unlink(tmp);
+  }
+
+  for (i = 0; i < b.count; i++)
+    free(b.adj[i]);
+  free(b.adj);
+  free(b.degree);
+  free(b.names);
+  free(tmp);
+  return rc;
+}
+
+int snapshot_background(const char *path, snapshot_walk_t walk, void *walk_arg,
+                        snapshot_done_t done, void *done_arg)
+{
+  struct timeval start, forked;
+  child_t *child;
+  pthread_t tid;
+  int fds[2];
+  pid_t pid;
+
+  if (pipe(fds) < 0)
+    return -1;
+  gettimeofday(&start, NULL);
+  pid = fork();
+  gettimeofday(&forked, NULL);
+  if (pid < 0)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    /* The child: every other thread is gone, and the graph stays as it
+       was at the fork however the parent changes it */
+    char report[64];
+    int rc, n;
+
+    close_inherited(fds[1]);
+    gettimeofday(&start, NULL);
+    rc = snapshot_write(path, walk, walk_arg);
+    n = snprintf(report, sizeof(report), "%d %ld %ld\n", rc,
+                 millis_since(&start), private_dirty_kb());
+    if (write(fds[1], report, n) != n)
+      _exit(1);
+    _exit(rc < 0 ? 1 : 0);
+  }
+
+  close(fds[1]);
+  child = malloc(sizeof(child_t));
+  child->pid = pid;
+  child->fd = fds[0];
+  child->fork_micros = (forked.tv_sec - start.tv_sec) * 1000000L
+                       + (forked.tv_usec - start.tv_usec);
+  child->done = done;
+  child->done_arg = done_arg;
+  if (pthread_create(&tid, NULL, reap_child, child) != 0)
+  {
+    /* Nobody would report the child's end, so stop it now */
+    kill(pid, SIGKILL);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+    close(fds[0]);
+    free(child);
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+/*
+ * close_inherited - close every descriptor but stdio and `keep` in the
+ *   child, so it does not hold client connections, the listening
+ *   socket or the write-ahead log open for as long as it writes
+ */
+static void close_inherited(int keep)
+{
+  struct dirent *entry;
+  DIR *dir;
+  long fd, max;
+
+  if ((dir = opendir("/proc/self/fd")) != NULL)
+  {
+    while ((entry = readdir(dir)) != NULL)
+    {
+      fd = atol(entry->d_name);
+      if (fd > 2 && fd != keep && fd != dirfd(dir))
+        close(fd);
+    }
+    closedir(dir);
+    return;
+  }
+
+  max = sysconf(_SC_OPEN_MAX);
+  for (fd = 3; fd < max; fd++)
+    if (fd != keep)
+      close(fd);
+}
+
+/*
+ * reap_child - wait for a background snapshot, and report how it went
+ */
+static void *reap_child(void *arg)
+{
+  child_t *child = arg;
+  snapshot_stats_t stats = {0, child->fork_micros, -1, -1};
+  char report[64];
+  ssize_t n, len = 0;
+  int status, rc;
+
+  while (len < sizeof(report) - 1
+         && (n = read(child->fd, report + len, sizeof(report) - 1 - len)) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    len += n;
+  }
+  report[len] = 0;
+  close(child->fd);
+
+  while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (sscanf(report, "%d %ld %ld", &rc, &stats.millis, &stats.cow_kb) == 3
+      && rc == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    stats.ok = 1;
+
+  child->done(&stats, child->done_arg);
+  free(child);
+  return NULL;
+}
+
+/*
+ * private_dirty_kb - the memory this process has written since it was
+ *   forked, including pages the parent wrote (the child then holds the
+ *   only copy of the original); -1 if the kernel does not say
+ */
+static long private_dirty_kb(void)
+{
+  char line[256];
+  long kb = -1, n;
+  FILE *f;
+
+  if ((f = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "Private_Dirty: %ld kB", &n) == 1)
+      kb = n;
+  fclose(f);
+  return kb;
+}
+
+static long millis_since(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000L
+         + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void collect_names(void *ctx, const char *user, const char **friends, int count)
+{
+  builder_t *b = ctx;
+  int i;
+
+  if (b->count + count + 1 > b->alloc)
+  {
+    b->alloc = (b->count + count + 1) * 2;
+    b->names = realloc(b->names, b->alloc * sizeof(char *));
+  }
+  b->names[b->count++] = user;
+  for (i = 0; i < count; i++)
+    b->names[b->count++] = friends[i];
+}
+
+static void collect_friends(void *ctx, const char *user, const char **friends, int count)
+{
+  builder_t *b = ctx;
+  long u = find_name(b, user);
+  uint32_t *adj;
+  int i, n;
+
+  if (u < 0 || count == 0)
+    return;
+  adj = malloc(count * sizeof(uint32_t));
+  for (i = 0, n = 0; i < count; i++)
+  {
+    long f = find_name(b, friends[i]);
+    if (f >= 0)
+      adj[n++] = f;
+  }
+  qsort(adj, n, sizeof(uint32_t), compare_indices);
+
+  free(b->adj[u]);
+  b->adj[u] = adj;
+  b->degree[u] = n;
+}
+
+static long find_name(builder_t *b, const char *name)
+{
+  const char **found = bsearch(&name, b->names, b->count, sizeof(char *),
+                               compare_names);
+  return (found ? found - b->names : -1);
+}
+
+static int write_file(FILE *f, builder_t *b)
+{
+  header_t h;
+  user_t u;
+  size_t i;
+  uint64_t first = 0, name = 0;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.users = b->count;
+  for (i = 0; i < b->count; i++)
+  {
+    h.friends += b->degree[i];
+    h.names_size += strlen(b->names[i]) + 1;
+  }
+  h.users_off = sizeof(header_t);
+  h.friends_off = h.users_off + h.users * sizeof(user_t);
+  h.names_off = h.friends_off + h.friends * sizeof(uint32_t);
+
+  if (fwrite(&h, sizeof(h), 1, f) != 1)
+    return -1;
+  memset(&u, 0, sizeof(u));
+  for (i = 0; i < b->count; i++)
+  {
+    u.name = name;
+    u.first = first;
+    u.degree = b->degree[i];
+    if (fwrite(&u, sizeof(u), 1, f) != 1)
+      return -1;
+    name += strlen(b->names[i]) + 1;
+    first += b->degree[i];
+  }
+  for (i = 0; i < b->count; i++)
+    if (b->degree[i] > 0
+        && fwrite(b->adj[i], sizeof(uint32_t), b->degree[i], f) != b->degree[i])
+      return -1;
+  for (i = 0; i < b->count; i++)
+    if (fwrite(b->names[i], strlen(b->names[i]) + 1, 1, f) != 1)
+      return -1;
+
+  return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int compare_indices(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,79 @@
+/* An on-disk snapshot of the friend graph that is used in place:
+   the file is mapped into memory and read directly, so opening one
+   takes the same time however large the graph is. Every name is
+   stored once, in a table sorted by name (so a user is found by
+   binary search), and each user's friends are an array of indices
+   into that table, in name order.
+
+   A snapshot is never changed after it is written; changes are kept
+   elsewhere until the next snapshot is written. */
+
+#include <stdint.h>
+
+typedef struct snapshot_t snapshot_t;
+
+/* Maps the snapshot at `path`. Returns NULL (with errno set) if it
+   cannot be opened or is not a valid snapshot. */
+snapshot_t *snapshot_open(const char *path);
+
+/* Drops a reference to the snapshot, unmapping it with the last. */
+void snapshot_close(snapshot_t *snap);
+
+/* Adds a reference to the snapshot, so it stays mapped for a reader
+   after its opener closes it; returns `snap`. */
+snapshot_t *snapshot_retain(snapshot_t *snap);
+
+/* Returns the number of names (users) in the snapshot. */
+long snapshot_count(snapshot_t *snap);
+
+/* Returns the index of `name`, or -1 if it is not in the snapshot. */
+long snapshot_find(snapshot_t *snap, const char *name);
+
+/* Returns the index of the first name that is not less than `name`,
+   or snapshot_count() if there is none. The names that start with
+   `name` follow from there, up to the first that does not. */
+long snapshot_lower_bound(snapshot_t *snap, const char *name);
+
+/* Returns the name with index `i`, or "" if there is none. */
+const char *snapshot_name(snapshot_t *snap, long i);
+
+/* Returns the number of friends of user `i`, and sets `*friends_p` to
+   their indices, in increasing order. A list that is damaged (one
+   that reaches past the file or names a user who is not there) counts
+   as empty. */
+uint32_t snapshot_friends(snapshot_t *snap, long i, const uint32_t **friends_p);
+
+/* Reports one user and the user's friends to snapshot_write(). */
+typedef void (*snapshot_emit_t)(void *ctx, const char *user,
+                                const char **friends, int count);
+
+/* Enumerates the whole graph, calling `emit` once per user; supplied
+   by the caller of snapshot_write(), which calls it twice and expects
+   the same graph both times. The names passed to `emit` must stay
+   valid until snapshot_write() returns. */
+typedef void (*snapshot_walk_t)(void *walk_arg, snapshot_emit_t emit, void *ctx);
+
+/* Writes the graph enumerated by `walk` to `path`, replacing any file
+   there only once the new one is safely on disk. Returns 0 on
+   success and -1 on failure. */
+int snapshot_write(const char *path, snapshot_walk_t walk, void *walk_arg);
+
+/* How a background snapshot went: */
+typedef struct
+{
+  int ok;
+  long fork_micros; /* time the server was paused in fork() */
+  long millis;      /* time the child took to write the snapshot */
+  long cow_kb;      /* memory copied on write while it did, or -1 */
+} snapshot_stats_t;
+
+/* Called from a background thread when a background snapshot ends. */
+typedef void (*snapshot_done_t)(snapshot_stats_t *stats, void *done_arg);
+
+/* Forks a child that writes the graph enumerated by `walk` to `path`
+   from its copy-on-write view of memory, then calls `done`. The
+   caller must hold the graph lock, so the child sees a consistent
+   graph, but the lock need not be held once this returns. Returns 0
+   if the child was started and -1 otherwise. */
+int snapshot_background(const char *path, snapshot_walk_t walk, void *walk_arg,
+                        snapshot_done_t done, void *done_arg);
@@ -0,0 +1,103 @@
+/*
+ * triangles.c - count triangles of friends in a friend-graph snapshot
+ *
+ *   friendlist-triangles [-t threads] [-u] <snapshot>
+ *
+ * Reports the number of triangles (three users who are all friends of
+ * each other), the graph's transitivity (three times the triangles over
+ * the number of pairs of friends that share a user), and the average of
+ * every user's clustering coefficient (the share of pairs of the user's
+ * friends who are friends themselves; 0 for users with fewer than two
+ * friends). With -u, every user's "name<TAB>triangles<TAB>coefficient"
+ * is also printed, and the totals go to standard error instead.
+ *
+ * The snapshot is read in place through the same graph index as the
+ * server uses, and the counting is split across threads by
+ * graph_triangles().
+ */
+#include "csapp.h"
+#include "snapshot.h"
+#include "graph.h"
+
+static long millis_since(struct timeval *start);
+
+int main(int argc, char **argv)
+{
+  struct timeval start;
+  snapshot_t *snap;
+  graph_t *g;
+  uint64_t triangles, *per_user, wedges = 0, halves = 0;
+  double coefficients = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN), per_user_lines = 0;
+  int opt;
+  long id, count;
+  FILE *totals;
+
+  while ((opt = getopt(argc, argv, "t:u")) != -1)
+  {
+    if (opt == 't')
+      threads = atoi(optarg);
+    else if (opt == 'u')
+      per_user_lines = 1;
+    else
+      break;
+  }
+  if (optind + 1 != argc)
+  {
+    fprintf(stderr, "usage: %s [-t threads] [-u] <snapshot>\n", argv[0]);
+    exit(1);
+  }
+  if (threads < 1)
+    threads = 1;
+
+  gettimeofday(&start, NULL);
+  if ((snap = snapshot_open(argv[optind])) == NULL)
+  {
+    fprintf(stderr, "cannot read %s: %s\n", argv[optind], strerror(errno));
+    exit(1);
+  }
+  g = graph_make(snap);
+  snapshot_close(snap);
+  count = graph_count(g);
+
+  per_user = malloc((count + 1) * sizeof(uint64_t));
+  triangles = graph_triangles(g, threads, per_user);
+  long count_ms = millis_since(&start);
+
+  for (id = 0; id < count; id++)
+  {
+    const uint32_t *friends;
+    uint64_t degree = graph_friends(g, id, &friends);
+    double coefficient = 0;
+
+    halves += degree;
+    wedges += degree * (degree - (degree > 0)) / 2;
+    if (degree >= 2)
+      coefficient = 2.0 * per_user[id] / (degree * (degree - 1));
+    coefficients += coefficient;
+    if (per_user_lines)
+      printf("%s\t%lu\t%.6f\n", graph_name(g, id), (unsigned long)per_user[id],
+             coefficient);
+  }
+
+  totals = (per_user_lines ? stderr : stdout);
+  fprintf(totals, "users %ld\nfriendships %lu\ntriangles %lu\n", count,
+          (unsigned long)(halves / 2), (unsigned long)triangles);
+  fprintf(totals, "transitivity %.6f\naverage_clustering %.6f\n",
+          (wedges ? 3.0 * triangles / wedges : 0.0),
+          (count ? coefficients / count : 0.0));
+  fprintf(totals, "counted in %ld ms, %d threads\n", count_ms, threads);
+
+  free(per_user);
+  graph_free(g);
+  return 0;
+}
+
+static long millis_since(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000L
+         + (now.tv_usec - start->tv_usec) / 1000;
+}
@@ -0,0 +1,202 @@
+/*
+ * trie.c - radix trie of names
+ *
+ * A node's children are kept in an array sorted by the first byte of
+ * their labels, which no two children share, so a child is found by
+ * binary search and a walk of the children in order visits names in
+ * strcmp() order. A node's own name, if it ends one, sorts before
+ * every name below it.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "trie.h"
+
+typedef struct node_t
+{
+  const char *label;  /* into some name below, not ending in NUL */
+  size_t len;
+  char *name;         /* the name that ends here, or NULL */
+  struct node_t **children;
+  int count, alloc;
+} node_t;
+
+struct trie_t
+{
+  node_t root;
+};
+
+static int find_child(node_t *n, unsigned char c);
+static void add_child(node_t *n, int at, node_t *child);
+static node_t *make_node(const char *label, size_t len);
+static size_t common_length(const char *label, size_t len, const char *s);
+static int collect(node_t *n, int limit, const char **names, int found);
+static void free_node(node_t *n);
+
+trie_t *trie_make(void)
+{
+  return calloc(1, sizeof(trie_t));
+}
+
+void trie_free(trie_t *t)
+{
+  int i;
+
+  for (i = 0; i < t->root.count; i++)
+    free_node(t->root.children[i]);
+  free(t->root.children);
+  free(t->root.name);
+  free(t);
+}
+
+static void free_node(node_t *n)
+{
+  int i;
+
+  for (i = 0; i < n->count; i++)
+    free_node(n->children[i]);
+  free(n->children);
+  free(n->name);
+  free(n);
+}
+
+int trie_insert(trie_t *t, const char *name)
+{
+  char *copy = strdup(name);
+  const char *s = copy;
+  node_t *n = &t->root;
+
+  while (*s)
+  {
+    int at = find_child(n, *s);
+    node_t *child;
+    size_t common;
+
+    if (at < 0)
+    {
+      /* Nothing here starts with s: hang the rest of the name here */
+      child = make_node(s, strlen(s));
+      child->name = copy;
+      add_child(n, -at - 1, child);
+      return 1;
+    }
+
+    child = n->children[at];
+    common = common_length(child->label, child->len, s);
+    if (common < child->len)
+    {
+      /* The name leaves the label part way along: split the label */
+      node_t *mid = make_node(child->label, common);
+      child->label += common;
+      child->len -= common;
+      add_child(mid, 0, child);
+      n->children[at] = mid;
+      child = mid;
+    }
+    n = child;
+    s += common;
+  }
+
+  if (n->name != NULL)
+  {
+    free(copy);
+    return 0;
+  }
+  n->name = copy;
+  return 1;
+}
+
+int trie_search(trie_t *t, const char *prefix, int limit, const char **names)
+{
+  const char *s = prefix;
+  node_t *n = &t->root;
+
+  while (*s)
+  {
+    int at = find_child(n, *s);
+    size_t common;
+
+    if (at < 0)
+      return 0;
+    n = n->children[at];
+    common = common_length(n->label, n->len, s);
+    if (s[common] == 0)
+      break; /* the prefix ends in this label */
+    if (common < n->len)
+      return 0;
+    s += common;
+  }
+
+  return collect(n, limit, names, 0);
+}
+
+/*
+ * collect - add the names at and below a node, in order, until there
+ *   are `limit`; a node without a name has at least two children, so
+ *   the nodes visited are fewer than twice the names found
+ */
+static int collect(node_t *n, int limit, const char **names, int found)
+{
+  int i;
+
+  if (found < limit && n->name != NULL)
+    names[found++] = n->name;
+  for (i = 0; i < n->count && found < limit; i++)
+    found = collect(n->children[i], limit, names, found);
+  return found;
+}
+
+/*
+ * find_child - the index of the child whose label starts with `c`, or
+ *   -(where it would go) - 1 if there is none
+ */
+static int find_child(node_t *n, unsigned char c)
+{
+  int lo = 0, hi = n->count;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    unsigned char first = n->children[mid]->label[0];
+    if (first == c)
+      return mid;
+    if (first < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -lo - 1;
+}
+
+static void add_child(node_t *n, int at, node_t *child)
+{
+  if (n->count == n->alloc)
+  {
+    n->alloc = (n->alloc ? n->alloc * 2 : 2);
+    n->children = realloc(n->children, n->alloc * sizeof(node_t *));
+  }
+  memmove(n->children + at + 1, n->children + at,
+          (n->count - at) * sizeof(node_t *));
+  n->children[at] = child;
+  n->count++;
+}
+
+static node_t *make_node(const char *label, size_t len)
+{
+  node_t *n = calloc(1, sizeof(node_t));
+
+  n->label = label;
+  n->len = len;
+  return n;
+}
+
+/*
+ * common_length - how many characters a label and a string agree on
+ */
+static size_t common_length(const char *label, size_t len, const char *s)
+{
+  size_t i = 0;
+
+  while (i < len && label[i] == s[i])
+    i++;
+  return i;
+}
@@ -0,0 +1,24 @@
+/* A set of names kept in a compact radix trie, for finding every name
+   that starts with a given prefix. Each edge of the trie is labelled
+   with a run of characters rather than a single one, so a node either
+   ends a name or has at least two children, and the trie has fewer
+   nodes than it has names. Labels point into the names themselves,
+   which the trie copies once each.
+
+   A trie is not locked itself; the caller locks around every use. */
+
+/* Opaque type for a trie: */
+typedef struct trie_t trie_t;
+
+trie_t *trie_make(void);
+
+void trie_free(trie_t *t);
+
+/* Adds `name`. Returns 1 if it was new and 0 if it was already there. */
+int trie_insert(trie_t *t, const char *name);
+
+/* Stores up to `limit` of the names that start with `prefix` in
+   `names`, in strcmp() order, and returns how many. The names are
+   valid until the trie is freed. Takes time in proportion to the
+   length of the prefix plus the number of names stored. */
+int trie_search(trie_t *t, const char *prefix, int limit, const char **names);
@@ -0,0 +1,354 @@
+/*
+ * wal.c - write-ahead log with group commit
+ *
+ * Records are text lines, "+ <user> <friend>" or "- <user> <friend>"
+ * with query-encoded names, so a record is complete exactly when its
+ * newline is on disk. Appends go to an in-memory buffer and are
+ * numbered; the flusher thread takes the whole buffer at once, writes
+ * and syncs it, and then wakes every thread whose records were in it.
+ * While one group is being synced the next one collects, so under
+ * load the number of syncs per second stays fixed while the number of
+ * changes per sync grows.
+ */
+#include <time.h>
+#include "csapp.h"
+#include "dictionary.h"
+#include "more_string.h"
+#include "wal.h"
+
+/* A group that reaches this size is written without waiting out the
+   window: */
+#define WAL_GROUP_BYTES (1024 * 1024)
+
+static int wal_fd = -1;
+static char *wal_path;
+static long file_bytes; /* in the log, counting the pending group */
+static int window;
+static char *pending;
+static size_t pending_len, pending_alloc;
+static unsigned long appended, durable; /* counts of records */
+static int failed;
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t grew = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER;
+
+/* The newest record appended by this thread: */
+static __thread unsigned long last_appended;
+
+static long replay(int fd, wal_apply_t apply);
+static void *flusher_main(void *arg);
+static int write_all(int fd, const char *buf, size_t len);
+
+long wal_open(const char *path, int window_ms, wal_apply_t apply)
+{
+  pthread_t tid;
+  long count;
+  int fd;
+
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    return -1;
+  if ((count = replay(fd, apply)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  file_bytes = lseek(fd, 0, SEEK_END);
+
+  window = window_ms;
+  wal_path = strdup(path);
+  wal_fd = fd;
+  pthread_create(&tid, NULL, flusher_main, NULL);
+  pthread_detach(tid);
+  return count;
+}
+
+/*
+ * replay - apply every complete record, and cut the log off after the
+ *   last one
+ */
+static long replay(int fd, wal_apply_t apply)
+{
+  struct stat st;
+  char *data, *line, *end;
+  long count = 0;
+
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (st.st_size == 0)
+    return 0;
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return -1;
+
+  for (line = data; line < data + st.st_size; line = end + 1)
+  {
+    char *record, **parts;
+    int n, ok;
+
+    end = memchr(line, '\n', data + st.st_size - line);
+    if (!end)
+      break;
+    record = strndup(line, end - line);
+    parts = split_string(record, ' ');
+    for (n = 0; parts[n]; n++)
+      ;
+    ok = (n == 3 && (!strcmp(parts[0], "+") || !strcmp(parts[0], "-")));
+    if (ok)
+    {
+      char *user = query_decode(parts[1]), *friend = query_decode(parts[2]);
+      apply(parts[0][0] == '+', user, friend);
+      free(user);
+      free(friend);
+      count++;
+    }
+    for (n = 0; parts[n]; n++)
+      free(parts[n]);
+    free(parts);
+    free(record);
+    if (!ok)
+      break;
+  }
+
+  if (line < data + st.st_size)
+  {
+    fprintf(stderr, "wal: dropping %ld bytes after record %ld\n",
+            (long)(data + st.st_size - line), count);
+    if (ftruncate(fd, line - data) < 0)
+      count = -1;
+  }
+  munmap(data, st.st_size);
+  return count;
+}
+
+void wal_append(int adding, const char *user, const char *friend)
+{
+  char *user_enc, *friend_enc, *record;
+  size_t len;
+
+  if (wal_fd < 0)
+    return;
+
+  user_enc = query_encode(user);
+  friend_enc = query_encode(friend);
+  record = append_strings(adding ? "+ " : "- ", user_enc, " ", friend_enc, "\n",
+                          NULL);
+  len = strlen(record);
+
+  pthread_mutex_lock(&wal_lock);
+  if (failed)
+  {
+    /* wal_commit() reports the failure */
+    last_appended = ++appended;
+    pthread_mutex_unlock(&wal_lock);
+    free(record);
+    free(user_enc);
+    free(friend_enc);
+    return;
+  }
+  if (pending_len + len > pending_alloc)
+  {
+    pending_alloc = (pending_len + len) * 2;
+    pending = realloc(pending, pending_alloc);
+  }
+  memcpy(pending + pending_len, record, len);
+  pending_len += len;
+  file_bytes += len;
+  last_appended = ++appended;
+  pthread_cond_signal(&grew);
+  pthread_mutex_unlock(&wal_lock);
+
+  free(record);
+  free(user_enc);
+  free(friend_enc);
+}
+
+int wal_commit(void)
+{
+  int rc;
+
+  if (wal_fd < 0 || last_appended == 0)
+    return 0;
+
+  pthread_mutex_lock(&wal_lock);
+  while (durable < last_appended && !failed)
+    pthread_cond_wait(&synced, &wal_lock);
+  rc = (durable < last_appended ? -1 : 0);
+  pthread_mutex_unlock(&wal_lock);
+
+  last_appended = 0;
+  return rc;
+}
+
+int wal_failed(void)
+{
+  int rc;
+
+  pthread_mutex_lock(&wal_lock);
+  rc = failed;
+  pthread_mutex_unlock(&wal_lock);
+  return rc;
+}
+
+int wal_reset(void)
+{
+  int rc = 0;
+
+  if (wal_fd < 0)
+    return 0;
+
+  pthread_mutex_lock(&wal_lock);
+  while (durable < appended && !failed)
+    pthread_cond_wait(&synced, &wal_lock);
+  if (ftruncate(wal_fd, 0) < 0 || lseek(wal_fd, 0, SEEK_SET) < 0
+      || fdatasync(wal_fd) < 0)
+    rc = -1;
+  else
+  {
+    file_bytes = 0;
+    if (failed)
+    {
+      /* The snapshot holds everything the log lost; start over, with a
+         new flusher since the old one has stopped */
+      pthread_t tid;
+
+      fprintf(stderr, "wal: log emptied, accepting changes again\n");
+      failed = 0;
+      durable = appended;
+      pthread_create(&tid, NULL, flusher_main, NULL);
+      pthread_detach(tid);
+    }
+  }
+  pthread_mutex_unlock(&wal_lock);
+
+  return rc;
+}
+
+long wal_mark(void)
+{
+  long mark;
+
+  pthread_mutex_lock(&wal_lock);
+  mark = file_bytes;
+  pthread_mutex_unlock(&wal_lock);
+  return mark;
+}
+
+int wal_trim(long mark)
+{
+  char *tmp, *tail;
+  long len;
+  int fd, rc = -1;
+
+  if (wal_fd < 0 || mark <= 0)
+    return 0;
+
+  /* Appends wait while the tail is copied; it holds only the changes
+     made since the mark */
+  pthread_mutex_lock(&wal_lock);
+  while (durable < appended && !failed)
+    pthread_cond_wait(&synced, &wal_lock);
+  if (failed || mark > file_bytes)
+  {
+    pthread_mutex_unlock(&wal_lock);
+    return -1;
+  }
+
+  len = file_bytes - mark;
+  tail = malloc(len + 1);
+  tmp = append_strings(wal_path, ".tmp", NULL);
+  if (pread(wal_fd, tail, len, mark) == len
+      && (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0)
+  {
+    if (write_all(fd, tail, len) == 0 && fdatasync(fd) == 0
+        && rename(tmp, wal_path) == 0)
+    {
+      /* Keep the descriptor the flusher writes to */
+      dup2(fd, wal_fd);
+      file_bytes = len;
+      rc = 0;
+    }
+    else
+      unlink(tmp);
+    close(fd);
+  }
+  pthread_mutex_unlock(&wal_lock);
+
+  free(tail);
+  free(tmp);
+  return rc;
+}
+
+static void *flusher_main(void *arg)
+{
+  while (1)
+  {
+    char *group;
+    size_t len;
+    unsigned long upto;
+    int rc;
+
+    pthread_mutex_lock(&wal_lock);
+    while (pending_len == 0)
+      pthread_cond_wait(&grew, &wal_lock);
+
+    /* Give the group a chance to grow */
+    if (window > 0)
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (long)window * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      while (pending_len < WAL_GROUP_BYTES
+             && pthread_cond_timedwait(&grew, &wal_lock, &deadline) == 0)
+        ;
+    }
+
+    group = pending;
+    len = pending_len;
+    upto = appended;
+    pending = NULL;
+    pending_len = pending_alloc = 0;
+    pthread_mutex_unlock(&wal_lock);
+
+    rc = write_all(wal_fd, group, len);
+    if (rc == 0)
+      rc = fdatasync(wal_fd);
+    free(group);
+
+    pthread_mutex_lock(&wal_lock);
+    if (rc < 0)
+    {
+      /* The file may now end in a partial group; nothing more can be
+         promised about it */
+      fprintf(stderr, "wal: write failed: %s\n", strerror(errno));
+      failed = 1;
+    }
+    else
+      durable = upto;
+    pthread_cond_broadcast(&synced);
+    pthread_mutex_unlock(&wal_lock);
+
+    if (failed)
+      break;
+  }
+
+  return NULL;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+/* A write-ahead log of friend-list changes. Every half of every
+   friendship change is appended to the log, and a request that made
+   changes does not answer until they are on disk. Appends from many
+   requests are gathered and written by a single thread with one write
+   and one fdatasync per group, so the cost of syncing is shared.
+   Optionally, the thread waits a few milliseconds for a group to
+   grow before writing it, trading a little latency for fewer syncs.
+
+   The log is replayed when the server starts. A record cut short by a
+   crash is dropped, along with anything after it.
+
+   A change is applied in memory before it is logged, so it can be seen
+   (and replicated) before it is durable; only the answer to the request
+   waits for the log. If a write to the log fails, the requests whose
+   changes were in that group are answered 503, but their changes stay
+   in memory. From then on the log counts as failed: the server checks
+   wal_failed() before changing anything and refuses every change,
+   until a wal_reset() (after a snapshot has captured the graph) empties
+   the log and starts it again. */
+
+/* Applies one replayed change; supplied by the server. */
+typedef void (*wal_apply_t)(int adding, const char *user, const char *friend);
+
+/* Replays the log at `path` through `apply`, creating the log if it
+   does not exist, and then starts logging to it. A group waits up to
+   `window_ms` milliseconds for more changes. Returns the number of
+   changes replayed, or -1 if the log cannot be used. */
+long wal_open(const char *path, int window_ms, wal_apply_t apply);
+
+/* Appends a change; must be called with the graph locked, in the
+   order the changes are made. Does nothing unless the log is open. */
+void wal_append(int adding, const char *user, const char *friend);
+
+/* Blocks until every change the calling thread has appended is on
+   disk. Returns 0 on success, or -1 if the log could not be written. */
+int wal_commit(void);
+
+/* Returns 1 if a write to the log has failed, so that no change can be
+   made durable until the log is reset, and 0 otherwise. */
+int wal_failed(void);
+
+/* Empties the log once everything appended so far is on disk, for
+   when a snapshot has captured it all; must be called with the graph
+   locked. A log that had failed is emptied too, and used again if that
+   works. Returns 0 on success and -1 on failure. */
+int wal_reset(void);
+
+/* Returns the position in the log after the last change appended so
+   far; must be called with the graph locked. */
+long wal_mark(void);
+
+/* Drops everything in the log before `mark`, from wal_mark(), for when
+   a snapshot has captured the graph as it was there. The changes after
+   it are copied to a new log that replaces the old one. Returns 0 on
+   success and -1 on failure. */
+int wal_trim(long mark);